@@ -0,0 +1,296 @@
+// File name: 	FormatBenchmark.cpp
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: What a file format costs: a synthetic volume is written and read back
+// 		through every ImageIO the scripts use (NIfTI, NRRD, MetaImage, TIFF),
+// 		compressed and not, and through our own .nii.gz and .isv writers at
+// 		several codecs and levels. Writes and reads go through writeImage and
+// 		readImage, the path every script takes, linked against the same ITK.
+// 		Reported per format: MB/s and CPU seconds of the write and the read,
+// 		file size and ratio, and whether the voxels came back unchanged.
+
+
+
+#include "itkImage.h"
+#include "itkImageFileWriter.h"
+
+#include "Benchmark.h"
+#include "SyntheticVolume.h"
+#include "ResourceUsage.h"
+#include "ImageIO.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <utility>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <algorithm>
+
+using namespace itk;
+
+// one way of storing a volume
+struct FormatCase {
+	std::string name;
+	std::string extension;
+	bool compressed;	// ITK's UseCompression
+	bool itkWriter;	// ITK's own writer instead of writeImage (its single-threaded gzip)
+	std::vector< std::pair<std::string, std::string> > environment;	// ITKSCRIPTS_* settings
+};
+
+struct FormatResult {
+	std::string name;
+	double writeSeconds, writeCpu, readSeconds, readCpu;	// median repetition
+	unsigned long long fileBytes;	// with the .gzidx next to it, if any
+	bool identical;
+	std::string error;
+};
+
+//helper functions
+void printUsage ();
+std::vector<FormatCase> formatCases ();
+unsigned long long fileBytes (const std::string &filename);
+void dropFromCache (const std::string &filename);
+template< typename TPixel >
+std::vector<FormatResult> runFormats (const SyntheticVolumeParameters &parameters, const std::vector<FormatCase> &cases,
+	const std::string &work, unsigned int repetitions, bool cold, bool keep);
+
+
+
+// flags, all optional:
+// --size=500x500x200 --type=uchar|ushort|float --looks=4 --seed=1 --filter=<part of a name>
+// --repetitions=3 --work=<scratch directory> --warm --keep --json=<file>
+int main(int argc, char * argv []){
+
+	SyntheticVolumeParameters parameters;
+	std::string type = "float", filter, work = "format-benchmark", json;
+	int repetitions = 3;
+	bool cold = true, keep = false;
+
+	for (int i = 1; i < argc; ++i){
+		const std::string argument = argv[i];
+		std::string value;
+		if (benchmarkFlag(argument, "size", value)){
+			if (!parseVolumeSize(value, parameters.size)){
+				std::cout << "size must be like 500x500x200, got " << value << std::endl;
+				return EXIT_FAILURE;
+			}
+		} else if (benchmarkFlag(argument, "type", value)){ type = value; }
+		else if (benchmarkFlag(argument, "looks", value)){ parameters.looks = std::max(1, atoi(value.c_str())); }
+		else if (benchmarkFlag(argument, "seed", value)){ parameters.seed = std::stoull(value); }
+		else if (benchmarkFlag(argument, "filter", value)){ filter = value; }
+		else if (benchmarkFlag(argument, "repetitions", value)){ repetitions = std::max(1, atoi(value.c_str())); }
+		else if (benchmarkFlag(argument, "work", value)){ work = value; }
+		else if (benchmarkFlag(argument, "json", value)){ json = value; }
+		else if (argument == "--warm"){ cold = false; }
+		else if (argument == "--keep"){ keep = true; }
+		else {
+			printUsage();
+			return argument == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	// reads must decode, not map a volume another process shared
+	unsetenv("ITKSCRIPTS_SHM_CACHE");
+	std::vector<FormatCase> cases;
+	for (const FormatCase &format : formatCases()){
+		if (format.name.find(filter) != std::string::npos){ cases.push_back(format); }
+	}
+	mkdir(work.c_str(), 0755);
+
+	std::vector<FormatResult> results;
+	double rawBytes = (double)parameters.size[0]*parameters.size[1]*parameters.size[2];
+	if (type == "uchar"){ results = runFormats<unsigned char>(parameters, cases, work, repetitions, cold, keep); }
+	else if (type == "ushort"){ results = runFormats<unsigned short>(parameters, cases, work, repetitions, cold, keep); rawBytes *= 2; }
+	else if (type == "float"){ results = runFormats<float>(parameters, cases, work, repetitions, cold, keep); rawBytes *= 4; }
+	else {
+		std::cout << "type must be uchar, ushort or float, got " << type << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (!keep){ rmdir(work.c_str()); }
+
+	// a format this ITK cannot write is reported, voxels that come back changed are a failure
+	bool failed = false;
+	for (const FormatResult &result : results){ failed = failed || (result.error.empty() && !result.identical); }
+	if (!json.empty()){
+		std::ofstream out(json.c_str());
+		out << "{\n  \"context\": {"
+			<< "\n    \"size\": " << jsonString(std::to_string(parameters.size[0]) + "x" + std::to_string(parameters.size[1]) + "x" + std::to_string(parameters.size[2]))
+			<< ",\n    \"type\": " << jsonString(type)
+			<< ",\n    \"raw_bytes\": " << (unsigned long long)rawBytes
+			<< ",\n    \"cache\": " << jsonString(cold ? "cold" : "warm")
+			<< ",\n    \"threads\": " << workerThreads()
+			<< "\n  },\n  \"formats\": [";
+		for (std::size_t r = 0; r < results.size(); ++r){
+			const FormatResult &result = results[r];
+			out << (r ? "," : "") << "\n    {\"name\": " << jsonString(result.name);
+			if (!result.error.empty()){
+				out << ", \"error\": " << jsonString(result.error) << "}";
+				continue;
+			}
+			out << ", \"write_seconds\": " << result.writeSeconds
+				<< ", \"write_cpu_seconds\": " << result.writeCpu
+				<< ", \"write_mb_per_second\": " << rawBytes/1e6/result.writeSeconds
+				<< ", \"read_seconds\": " << result.readSeconds
+				<< ", \"read_cpu_seconds\": " << result.readCpu
+				<< ", \"read_mb_per_second\": " << rawBytes/1e6/result.readSeconds
+				<< ", \"file_bytes\": " << result.fileBytes
+				<< ", \"ratio\": " << rawBytes/std::max(1ULL, result.fileBytes)
+				<< ", \"identical\": " << (result.identical ? "true" : "false") << "}";
+		}
+		out << "\n  ]\n}\n";
+		if (!out){
+			std::cout << "could not write " << json << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void printUsage (){
+	std::cout << "Usage: FormatBenchmark [--size=500x500x200] [--type=uchar|ushort|float] [--looks=4] [--seed=1]\n";
+	std::cout << "                       [--filter=<name part>] [--repetitions=3] [--work=<scratch directory>]\n";
+	std::cout << "                       [--warm] [--keep] [--json=<file>]\n";
+}
+
+// ITK 4.12 ImageIOs only switch compression on or off; levels are only ours to set
+std::vector<FormatCase> formatCases (){
+	std::vector<FormatCase> cases = {
+		{ "nii", ".nii", false, false, {} },
+		{ "nii.gz/itk", ".nii.gz", true, true, {} },
+		{ "nrrd", ".nrrd", false, false, {} },
+		{ "nrrd/gzip", ".nrrd", true, false, {} },
+		{ "mha", ".mha", false, false, {} },
+		{ "mha/zlib", ".mha", true, false, {} },
+		{ "tif", ".tif", false, false, {} },
+		{ "tif/compressed", ".tif", true, false, {} },
+	};
+	for (const char * level : { "1", "6", "9" }){
+		cases.push_back({ std::string("nii.gz/parallel-") + level, ".nii.gz", true, false, { { "ITKSCRIPTS_GZIP_LEVEL", level } } });
+	}
+	cases.push_back({ "isv/raw", ".isv", true, false, { { "ITKSCRIPTS_ISV_CODEC", "raw" } } });
+	cases.push_back({ "isv/lz4", ".isv", true, false, { { "ITKSCRIPTS_ISV_CODEC", "lz4" } } });
+	for (const char * level : { "1", "6" }){
+		cases.push_back({ std::string("isv/zlib-") + level, ".isv", true, false, { { "ITKSCRIPTS_ISV_CODEC", "zlib" }, { "ITKSCRIPTS_ISV_LEVEL", level } } });
+	}
+	for (const char * level : { "1", "3", "9", "19" }){
+		cases.push_back({ std::string("isv/zstd-") + level, ".isv", true, false, { { "ITKSCRIPTS_ISV_CODEC", "zstd" }, { "ITKSCRIPTS_ISV_LEVEL", level } } });
+	}
+	return cases;
+}
+
+unsigned long long fileBytes (const std::string &filename){
+	struct stat information;
+	unsigned long long bytes = (stat(filename.c_str(), &information) == 0) ? information.st_size : 0;
+	if (stat(gzipIndexFileName(filename).c_str(), &information) == 0){ bytes += information.st_size; }
+	return bytes;
+}
+
+// flush filename to storage and drop its pages, so the next read comes from the disk
+void dropFromCache (const std::string &filename){
+	const int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0){ return; }
+	fdatasync(fd);
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	close(fd);
+}
+
+// median of (seconds, cpu seconds) pairs, by seconds
+std::pair<double, double> medianTiming (std::vector< std::pair<double, double> > timings){
+	std::sort(timings.begin(), timings.end());
+	return timings[timings.size()/2];
+}
+
+template< typename TPixel >
+std::vector<FormatResult> runFormats (const SyntheticVolumeParameters &parameters, const std::vector<FormatCase> &cases,
+		const std::string &work, unsigned int repetitions, bool cold, bool keep){
+	using ImageType = itk::Image< TPixel, 3 >;
+	const typename ImageType::Pointer volume = makeSyntheticVolume< ImageType >( parameters );
+	const std::size_t voxels = parameters.size[0]*parameters.size[1]*parameters.size[2];
+	const double rawMB = voxels*sizeof(TPixel)/1e6;
+
+	std::vector<FormatResult> results;
+	std::printf("%-22s %10s %10s %10s %10s %10s %8s %s\n", "format", "write MB/s", "write cpu", "read MB/s", "read cpu", "file MB", "ratio", "");
+	for (const FormatCase &format : cases){
+		FormatResult result = { format.name, 0.0, 0.0, 0.0, 0.0, 0, false, "" };
+		const std::string filename = work + "/volume" + format.extension;
+		std::vector<std::string> saved;
+		for (const auto &setting : format.environment){
+			const char * value = std::getenv(setting.first.c_str());
+			saved.push_back(value ? value : "");
+			setenv(setting.first.c_str(), setting.second.c_str(), 1);
+		}
+
+		try {
+			for (const auto &setting : format.environment){
+				if (setting.first != "ITKSCRIPTS_ISV_CODEC"){ continue; }
+				uint32_t codec = codecRaw;
+				while (codec <= codecZstd && setting.second != codecName(codec)){ ++codec; }
+				if (!codecAvailable(codec)){ itkGenericExceptionMacro(<< setting.second << " is not built in"); }
+			}
+
+			std::vector< std::pair<double, double> > writes, reads;
+			for (unsigned int r = 0; r < repetitions; ++r){
+				unlink(filename.c_str());
+				unlink(gzipIndexFileName(filename).c_str());
+				double cpu = cpuSeconds();
+				auto begin = std::chrono::steady_clock::now();
+				if (format.itkWriter){
+					using WriterType = itk::ImageFileWriter< ImageType >;
+					typename WriterType::Pointer writer = WriterType::New();
+					writer->SetInput( volume );
+					writer->SetFileName( filename );
+					writer->SetUseCompression( format.compressed );
+					writer->Update();
+				} else {
+					writeImage< ImageType >( volume, filename, format.compressed );
+				}
+				writes.push_back(std::make_pair(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count(), cpuSeconds() - cpu));
+
+				// the first read of an ITK-written .nii.gz builds its index, later ones use it
+				if (cold){
+					dropFromCache(filename);
+					dropFromCache(gzipIndexFileName(filename));
+				}
+				cpu = cpuSeconds();
+				begin = std::chrono::steady_clock::now();
+				const typename ImageType::Pointer read = readImage< ImageType >( filename );
+				reads.push_back(std::make_pair(std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count(), cpuSeconds() - cpu));
+				result.identical = read->GetBufferedRegion().GetNumberOfPixels() == voxels
+					&& std::memcmp(read->GetBufferPointer(), volume->GetBufferPointer(), voxels*sizeof(TPixel)) == 0;
+			}
+			const std::pair<double, double> write = medianTiming(writes), read = medianTiming(reads);
+			result.writeSeconds = write.first;
+			result.writeCpu = write.second;
+			result.readSeconds = read.first;
+			result.readCpu = read.second;
+			result.fileBytes = fileBytes(filename);
+			std::printf("%-22s %10.1f %10.2f %10.1f %10.2f %10.1f %8.2f %s\n", format.name.c_str(), rawMB/result.writeSeconds, result.writeCpu,
+				rawMB/result.readSeconds, result.readCpu, result.fileBytes/1e6, voxels*sizeof(TPixel)/(double)std::max(1ULL, result.fileBytes),
+				result.identical ? "" : "voxels changed");
+		} catch ( itk::ExceptionObject & err ){
+			result.error = err.GetDescription();
+			std::printf("%-22s failed: %s\n", format.name.c_str(), result.error.c_str());
+		}
+		std::fflush(stdout);
+		results.push_back(result);
+
+		for (std::size_t s = 0; s < saved.size(); ++s){
+			if (saved[s].empty()){ unsetenv(format.environment[s].first.c_str()); }
+			else { setenv(format.environment[s].first.c_str(), saved[s].c_str(), 1); }
+		}
+		if (!keep){
+			unlink(filename.c_str());
+			unlink(gzipIndexFileName(filename).c_str());
+		}
+	}
+	return results;
+}
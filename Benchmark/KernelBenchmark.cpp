@@ -0,0 +1,226 @@
+// File name: 	KernelBenchmark.cpp
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Microbenchmarks of the kernels the scripts spend their time in: slice
+// 		extraction, maximum and mean projection, window statistics, histograms,
+// 		remaps and normalization, along every axis, on a synthetic OCT-like
+// 		volume (SyntheticVolume.h). Run it before and after a change with the
+// 		same --size, --type and --seed and compare the JSON.
+
+
+
+#include "itkImage.h"
+
+#include "Benchmark.h"
+#include "SyntheticVolume.h"
+#include "SliceView.h"
+#include "Pipeline.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <fstream>
+#include <iostream>
+#include <chrono>
+#include <limits>
+#include <algorithm>
+
+using namespace itk;
+
+//helper functions
+void printUsage ();
+template< typename TPixel >
+void addKernels (BenchmarkSuite &suite, const SyntheticVolumeParameters &parameters);
+
+
+
+// flags, all optional:
+// --size=500x500x200 --type=uchar|ushort|float --looks=4 --seed=1
+// --filter=<part of a name> --min-time=0.5 --repetitions=5 --json=<file>
+int main(int argc, char * argv []){
+
+	SyntheticVolumeParameters parameters;
+	std::string type = "float", filter, json;
+	double minTime = 0.5;
+	int repetitions = 5;
+
+	for (int i = 1; i < argc; ++i){
+		const std::string argument = argv[i];
+		std::string value;
+		if (benchmarkFlag(argument, "size", value)){
+			if (!parseVolumeSize(value, parameters.size)){
+				std::cout << "size must be like 500x500x200, got " << value << std::endl;
+				return EXIT_FAILURE;
+			}
+		} else if (benchmarkFlag(argument, "type", value)){ type = value; }
+		else if (benchmarkFlag(argument, "looks", value)){ parameters.looks = std::max(1, atoi(value.c_str())); }
+		else if (benchmarkFlag(argument, "seed", value)){ parameters.seed = std::stoull(value); }
+		else if (benchmarkFlag(argument, "filter", value)){ filter = value; }
+		else if (benchmarkFlag(argument, "min-time", value)){ minTime = atof(value.c_str()); }
+		else if (benchmarkFlag(argument, "repetitions", value)){ repetitions = std::max(1, atoi(value.c_str())); }
+		else if (benchmarkFlag(argument, "json", value)){ json = value; }
+		else {
+			printUsage();
+			return argument == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	BenchmarkSuite suite(minTime, repetitions);
+	suite.setFilter(filter);
+	std::vector<BenchmarkResult> results;
+	try {
+		auto begin = std::chrono::high_resolution_clock::now();
+		if (type == "uchar"){ addKernels<unsigned char>(suite, parameters); }
+		else if (type == "ushort"){ addKernels<unsigned short>(suite, parameters); }
+		else if (type == "float"){ addKernels<float>(suite, parameters); }
+		else {
+			std::cout << "type must be uchar, ushort or float, got " << type << std::endl;
+			return EXIT_FAILURE;
+		}
+		auto stop = std::chrono::high_resolution_clock::now();
+		std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin).count()
+			<< " milliseconds to make the " << parameters.size[0] << "x" << parameters.size[1] << "x" << parameters.size[2]
+			<< " " << type << " volume" << std::endl;
+		results = suite.run(std::cout);
+	} catch ( itk::ExceptionObject & err ){
+		std::cerr << "ExceptionObject caught !" << std::endl;
+		std::cerr << err << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	if (!json.empty()){
+		std::ofstream out(json.c_str());
+		BenchmarkSuite::writeJson(out, results, {
+			{ "executable", argv[0] },
+			{ "size", std::to_string(parameters.size[0]) + "x" + std::to_string(parameters.size[1]) + "x" + std::to_string(parameters.size[2]) },
+			{ "type", type },
+			{ "looks", std::to_string(parameters.looks) },
+			{ "seed", std::to_string(parameters.seed) },
+			{ "threads", std::to_string(workerThreads()) }
+		});
+		if (!out){
+			std::cout << "could not write " << json << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
+
+void printUsage (){
+	std::cout << "Usage: KernelBenchmark [--size=500x500x200] [--type=uchar|ushort|float] [--looks=4] [--seed=1]\n";
+	std::cout << "                       [--filter=<name part>] [--min-time=0.5] [--repetitions=5] [--json=<file>]\n";
+}
+
+// a contiguous slice-sized view over buffer, with the axes of like
+template< typename TPixel, typename TLike >
+SliceView<TPixel> bufferView (std::vector<TPixel> &buffer, const SliceView<TLike> &like){
+	SliceView<TPixel> view;
+	view.data = buffer.data();
+	view.size[0] = like.size[0];
+	view.size[1] = like.size[1];
+	view.stride[0] = 1;
+	view.stride[1] = like.size[0];
+	view.axis[0] = like.axis[0];
+	view.axis[1] = like.axis[1];
+	view.geometry = like.geometry;
+	return view;
+}
+
+// every kernel along every axis, on one synthetic volume of TPixel
+template< typename TPixel >
+void addKernels (BenchmarkSuite &suite, const SyntheticVolumeParameters &parameters){
+	using VolumeType = itk::Image< TPixel, 3 >;
+	using SliceType = itk::Image< TPixel, 2 >;
+	const typename VolumeType::Pointer volume = makeSyntheticVolume< VolumeType >( parameters );
+	const VolumeView<TPixel> view = imageView(volume.GetPointer());
+	const double voxels = (double)view.size[0]*view.size[1]*view.size[2];
+	const double bytes = voxels*sizeof(TPixel);
+
+	// remaps write, they get a copy of their own. Both maps are their own inverse,
+	// so the copy stays the same volume however often it is remapped.
+	const typename VolumeType::Pointer scratch = materializeVolume< VolumeType >( view );
+	const VolumeView<TPixel> scratchView = imageView(scratch.GetPointer());
+	const bool lookup = std::numeric_limits<TPixel>::is_integer && sizeof(TPixel) <= 2;
+	auto table = std::make_shared< std::vector<TPixel> >();
+	if (lookup){
+		const std::size_t levels = (std::size_t)std::numeric_limits<TPixel>::max() + 1;
+		for (std::size_t level = 0; level < levels; ++level){ table->push_back(static_cast<TPixel>(levels - 1 - level)); }
+	}
+	const double top = syntheticRange<TPixel>();
+
+	// normalize runs on the pipeline's float volume, like NormalizeIntense
+	auto state = std::make_shared<PipelineState>();
+	state->image = materializeVolume< PipelineImageType >( view );
+
+	const char * axes = "xyz";
+	for (int d = 0; d < 3; ++d){
+		const std::string axis(1, axes[d]);
+		const SliceView<TPixel> middle = view.slice(d, view.size[d]/2);
+		const double slices = view.size[d], slicePixels = middle.pixels();
+
+		suite.add("extract/" + axis, slicePixels*sizeof(TPixel), slicePixels, [volume, middle](){
+			typename SliceType::Pointer slice = materializeSlice< SliceType >( middle );
+			benchmarkKeep(slice->GetBufferPointer()[0]);
+		});
+
+		auto maximum = std::make_shared< std::vector<TPixel> >(middle.pixels());
+		const SliceView<TPixel> maximumView = bufferView(*maximum, middle);
+		suite.add("project/max/" + axis, bytes, voxels, [volume, view, d, maximum, maximumView](){
+			viewMaximum(view, d, maximumView);
+			benchmarkKeep((*maximum)[0]);
+		});
+		auto mean = std::make_shared< std::vector<float> >(middle.pixels());
+		const SliceView<float> meanView = bufferView(*mean, middle);
+		suite.add("project/mean/" + axis, bytes, voxels, [volume, view, d, mean, meanView](){
+			viewMean(view, d, meanView);
+			benchmarkKeep((*mean)[0]);
+		});
+
+		// the NormalizeIntense window in the middle of every slice
+		const int step = (int)std::min<std::size_t>(15, (std::min(middle.size[0], middle.size[1]) - 1)/2);
+		const std::size_t window = 2*step + 1;
+		const int x = middle.size[0]/2, y = middle.size[1]/2;
+		suite.add("roi/" + std::to_string(window) + "x" + std::to_string(window) + "/" + axis,
+				slices*window*window*sizeof(TPixel), slices*window*window, [volume, view, d, x, y, step, window](){
+			double sum = 0.0;
+			for (std::size_t k = 0; k < view.size[d]; ++k){
+				sum += viewStatistics(view.slice(d, k).window(x - step, y - step, window, window)).sum;
+			}
+			benchmarkKeep(sum);
+		});
+
+		suite.add("histogram/256/" + axis, bytes, voxels, [volume, view, d, top](){
+			double first = 0.0;
+			for (std::size_t k = 0; k < view.size[d]; ++k){
+				first += viewHistogram(view.slice(d, k), 256, 0.0, top)[0];
+			}
+			benchmarkKeep(first);
+		});
+
+		if (lookup){
+			suite.add("remap/lut/" + axis, bytes, voxels, [scratch, scratchView, d, table](){
+				const TPixel * map = table->data();
+				for (std::size_t k = 0; k < scratchView.size[d]; ++k){
+					viewRemap(scratchView.slice(d, k), [map](TPixel value){ return map[static_cast<std::size_t>(value)]; });
+				}
+				benchmarkKeep(scratchView.data[0]);
+			});
+		} else {
+			suite.add("remap/affine/" + axis, bytes, voxels, [scratch, scratchView, d, top](){
+				for (std::size_t k = 0; k < scratchView.size[d]; ++k){
+					viewRemap(scratchView.slice(d, k), [top](TPixel value){ return static_cast<TPixel>(top - value); });
+				}
+				benchmarkKeep(scratchView.data[0]);
+			});
+		}
+
+		// window statistics of every slice, then the fused affine applied in one pass
+		const std::vector<std::string> arguments = { std::to_string(x), std::to_string(y), std::to_string(step), std::to_string(d) };
+		suite.add("normalize/" + axis, voxels*sizeof(PipelinePixelType), voxels, [state, arguments](){
+			normalizeStage(*state, arguments);
+			state->materialize();
+			benchmarkKeep(state->image->GetBufferPointer()[0]);
+		});
+	}
+}
@@ -0,0 +1,349 @@
+// File name: 	WorkflowBenchmark.cpp
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: The README workflow end to end on a synthetic volume: slice a volume
+// 		along x, normalize every slice, retile the slices into a volume and
+// 		project it. It is run as the shell loop does it (one process per slice),
+// 		through itkscripts batch, with the staged series mode of NormalizeIntense
+// 		and as one fused itkscripts pipeline. Every command is a child process;
+// 		per stage the wall time, CPU time, peak resident set and bytes read and
+// 		written are reported as a table and as JSON.
+
+
+
+#include "itkImage.h"
+
+#include "Benchmark.h"
+#include "SyntheticVolume.h"
+#include "ResourceUsage.h"
+#include "ImageIO.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <algorithm>
+
+using namespace itk;
+
+using Command = std::vector<std::string>;
+
+struct WorkflowStage {
+	std::string name;
+	std::vector<Command> commands;	// run one after the other, like a shell loop
+};
+
+struct Workflow {
+	std::string name;
+	std::vector<WorkflowStage> stages;
+};
+
+struct StageResult {
+	std::string name;
+	std::size_t processes;
+	double wall, cpu;
+	unsigned long long peakRss;	// largest of the stage's processes
+	IoCounters io;
+	std::string error;
+};
+
+//helper functions
+void printUsage ();
+std::vector<Workflow> makeWorkflows (const std::size_t size[3], const std::string &work);
+StageResult runStage (const WorkflowStage &stage, const std::string &bin, const std::string &run, int log);
+void clearDirectory (const std::string &directory, const std::string &keep);
+std::string stageJson (const StageResult &result);
+
+
+
+// flags, all optional:
+// --bin=<directory with ExtractSlice, NormalizeIntense, MaximumProjection, itkscripts>
+// --work=<scratch directory> --size=500x500x200 --type=uchar|ushort|float --seed=1
+// --workflows=shell,batch,series,pipeline --json=<file> --keep
+int main(int argc, char * argv []){
+
+	SyntheticVolumeParameters parameters;
+	std::string bin, work = "workflow-benchmark", type = "uchar", json = "-";
+	std::string selected = "shell,batch,series,pipeline";
+	bool keep = false;
+
+	// next to this executable unless told otherwise
+	char self[4096];
+	const ssize_t length = readlink("/proc/self/exe", self, sizeof(self) - 1);
+	if (length > 0){
+		self[length] = '\0';
+		bin = std::string(self).substr(0, std::string(self).find_last_of('/'));
+	}
+
+	for (int i = 1; i < argc; ++i){
+		const std::string argument = argv[i];
+		std::string value;
+		if (benchmarkFlag(argument, "size", value)){
+			if (!parseVolumeSize(value, parameters.size)){
+				std::cout << "size must be like 500x500x200, got " << value << std::endl;
+				return EXIT_FAILURE;
+			}
+		} else if (benchmarkFlag(argument, "bin", value)){ bin = value; }
+		else if (benchmarkFlag(argument, "work", value)){ work = value; }
+		else if (benchmarkFlag(argument, "type", value)){ type = value; }
+		else if (benchmarkFlag(argument, "seed", value)){ parameters.seed = std::stoull(value); }
+		else if (benchmarkFlag(argument, "workflows", value)){ selected = value; }
+		else if (benchmarkFlag(argument, "json", value)){ json = value; }
+		else if (argument == "--keep"){ keep = true; }
+		else {
+			printUsage();
+			return argument == "--help" ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	// work/run is where the tools run, so ../data/ and ../output/ (the same directory) are theirs
+	const std::string data = work + "/data", run = work + "/run";
+	mkdir(work.c_str(), 0755);
+	mkdir(data.c_str(), 0755);
+	mkdir(run.c_str(), 0755);
+	unlink((work + "/output").c_str());
+	if (symlink("data", (work + "/output").c_str()) != 0){
+		std::cout << "could not set up " << work << std::endl;
+		return EXIT_FAILURE;
+	}
+	const std::string logName = work + "/workflow.log";
+	const int log = open(logName.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (log < 0){
+		std::cout << "could not open " << logName << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	try {
+		auto begin = std::chrono::high_resolution_clock::now();
+		const std::string volume = data + "/volume.nii.gz";
+		if (type == "uchar"){ writeImage( makeSyntheticVolume< itk::Image<unsigned char, 3> >( parameters ).GetPointer(), volume ); }
+		else if (type == "ushort"){ writeImage( makeSyntheticVolume< itk::Image<unsigned short, 3> >( parameters ).GetPointer(), volume ); }
+		else if (type == "float"){ writeImage( makeSyntheticVolume< itk::Image<float, 3> >( parameters ).GetPointer(), volume ); }
+		else {
+			std::cout << "type must be uchar, ushort or float, got " << type << std::endl;
+			return EXIT_FAILURE;
+		}
+		auto stop = std::chrono::high_resolution_clock::now();
+		std::cout << std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin).count()
+			<< " milliseconds to make " << volume << std::endl;
+	} catch ( itk::ExceptionObject & err ){
+		std::cerr << "ExceptionObject caught !" << std::endl;
+		std::cerr << err << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::ostringstream report;
+	report << "{\n  \"context\": {"
+		<< "\n    \"size\": " << jsonString(std::to_string(parameters.size[0]) + "x" + std::to_string(parameters.size[1]) + "x" + std::to_string(parameters.size[2]))
+		<< ",\n    \"type\": " << jsonString(type)
+		<< ",\n    \"seed\": " << jsonString(std::to_string(parameters.seed))
+		<< ",\n    \"bin\": " << jsonString(bin)
+		<< ",\n    \"cores\": " << jsonString(std::to_string(std::thread::hardware_concurrency()))
+		<< "\n  },\n  \"workflows\": [";
+
+	bool failed = false, first = true;
+	std::printf("%-10s %-24s %9s %10s %10s %10s %10s %10s\n", "workflow", "stage", "processes", "wall s", "cpu s", "peak MB", "read MB", "write MB");
+	for (const Workflow &workflow : makeWorkflows(parameters.size, work)){
+		if (("," + selected + ",").find("," + workflow.name + ",") == std::string::npos){ continue; }
+		report << (first ? "" : ",") << "\n    {\"name\": " << jsonString(workflow.name);
+		first = false;
+
+		// every tool the workflow needs, or it is reported as skipped
+		std::string missing;
+		for (const WorkflowStage &stage : workflow.stages){
+			for (const Command &command : stage.commands){
+				if (access((bin + "/" + command[0]).c_str(), X_OK) != 0){ missing = bin + "/" + command[0]; }
+			}
+		}
+		if (!missing.empty()){
+			std::cout << workflow.name << ": skipped, " << missing << " is not there" << std::endl;
+			report << ", \"skipped\": " << jsonString(missing + " is not there") << "}";
+			continue;
+		}
+
+		clearDirectory(data, "volume.nii.gz");
+		StageResult total = { "total", 0, 0.0, 0.0, 0, { 0, 0, 0, 0 }, "" };
+		report << ", \"stages\": [";
+		for (std::size_t s = 0; s < workflow.stages.size(); ++s){
+			const StageResult result = runStage(workflow.stages[s], bin, run, log);
+			std::printf("%-10s %-24s %9zu %10.2f %10.2f %10.1f %10.1f %10.1f\n", workflow.name.c_str(), result.name.c_str(),
+				result.processes, result.wall, result.cpu, result.peakRss/1048576.0, result.io.rchar/1048576.0, result.io.wchar/1048576.0);
+			std::fflush(stdout);
+			report << (s ? "," : "") << "\n      " << stageJson(result);
+
+			total.processes += result.processes;
+			total.wall += result.wall;
+			total.cpu += result.cpu;
+			total.peakRss = std::max(total.peakRss, result.peakRss);
+			total.io.rchar += result.io.rchar;
+			total.io.wchar += result.io.wchar;
+			total.io.readBytes += result.io.readBytes;
+			total.io.writeBytes += result.io.writeBytes;
+			if (!result.error.empty()){
+				std::cout << workflow.name << ": " << result.error << ", see " << logName << std::endl;
+				total.error = result.error;
+				failed = true;
+				break;
+			}
+		}
+		std::printf("%-10s %-24s %9zu %10.2f %10.2f %10.1f %10.1f %10.1f\n", workflow.name.c_str(), "total",
+			total.processes, total.wall, total.cpu, total.peakRss/1048576.0, total.io.rchar/1048576.0, total.io.wchar/1048576.0);
+		report << "\n    ], \"total\": " << stageJson(total) << "}";
+	}
+	report << "\n  ]\n}\n";
+	close(log);
+
+	if (json == "-"){
+		std::cout << report.str();
+	} else {
+		std::ofstream out(json.c_str());
+		out << report.str();
+		if (!out){
+			std::cout << "could not write " << json << std::endl;
+			return EXIT_FAILURE;
+		}
+	}
+
+	// a failed workflow leaves everything, the log says why
+	if (!keep && !failed){
+		clearDirectory(data, "");
+		rmdir(data.c_str());
+		unlink((work + "/output").c_str());
+		rmdir(run.c_str());
+		clearDirectory(work, "");
+		rmdir(work.c_str());
+	}
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+void printUsage (){
+	std::cout << "Usage: WorkflowBenchmark [--bin=<tools directory>] [--work=<scratch directory>] [--size=500x500x200]\n";
+	std::cout << "                         [--type=uchar|ushort|float] [--seed=1] [--workflows=shell,batch,series,pipeline]\n";
+	std::cout << "                         [--json=<file>|-] [--keep]\n";
+}
+
+// The README workflow four ways. Slices are along x (size[0] of them), the
+// normalize window is in the middle of a slice.
+std::vector<Workflow> makeWorkflows (const std::size_t size[3], const std::string &work){
+	const std::size_t slices = size[0];
+	const std::size_t step = std::min<std::size_t>(15, (std::min(size[1], size[2]) - 1)/2);
+	const std::string x = std::to_string(size[1]/2), y = std::to_string(size[2]/2), window = std::to_string(step);
+	const std::string range = "0:" + std::to_string(slices - 1);
+
+	// the shell loops of the README, and the same lines as batch manifests
+	std::vector<Command> extractLoop, normalizeLoop;
+	std::ofstream extractManifest((work + "/extract.txt").c_str()), normalizeManifest((work + "/normalize.txt").c_str());
+	for (std::size_t k = 0; k < slices; ++k){
+		const std::string slice = std::to_string(k);
+		extractLoop.push_back({ "ExtractSlice", "volume.nii.gz", ".tif", "0", slice });
+		normalizeLoop.push_back({ "NormalizeIntense", "slice_0_" + slice + "_volume", ".tif", x, y, window });
+		extractManifest << "extractslice volume.nii.gz .tif 0 " << slice << "\n";
+		normalizeManifest << "normalizeintense slice_0_" << slice << "_volume .tif " << x << " " << y << " " << window << "\n";
+	}
+
+	const WorkflowStage extractBatch = { "slice", { { "itkscripts", "batch", "../extract.txt" } } };
+	const WorkflowStage retile = { "retile", { { "itkscripts", "assemble", "../data/slice_0_%d_volume_Norm.tif", range, "../output/stack.nii.gz", "0" } } };
+	const WorkflowStage project = { "project", { { "MaximumProjection", "stack", ".nii.gz", "0" } } };
+
+	std::vector<Workflow> workflows;
+	workflows.push_back({ "shell", { { "slice", extractLoop }, { "normalize", normalizeLoop }, retile, project } });
+	workflows.push_back({ "batch", { extractBatch, { "normalize", { { "itkscripts", "batch", "../normalize.txt" } } }, retile, project } });
+	workflows.push_back({ "series", { extractBatch,
+		{ "normalize", { { "NormalizeIntense", "slice_0_%d_volume", ".tif", x, y, window, range } } }, retile, project } });
+	workflows.push_back({ "pipeline", {
+		{ "slice+normalize+retile", { { "itkscripts", "read", "../data/volume.nii.gz", "+", "extract", "0", range,
+			"+", "normalize", x, y, window, "0", "+", "write", "../output/stack.nii.gz" } } },
+		project } });
+	return workflows;
+}
+
+// every command of the stage as a child process in run, output appended to log.
+// The first command that fails ends the stage.
+StageResult runStage (const WorkflowStage &stage, const std::string &bin, const std::string &run, int log){
+	StageResult result = { stage.name, 0, 0.0, 0.0, 0, { 0, 0, 0, 0 }, "" };
+	const IoCounters before = readProcessIo();
+	auto begin = std::chrono::steady_clock::now();
+	for (const Command &command : stage.commands){
+		// everything the child needs is made before fork
+		std::vector<std::string> arguments = command;
+		arguments[0] = bin + "/" + command[0];
+		std::vector<char *> argv;
+		for (std::string &argument : arguments){ argv.push_back(&argument[0]); }
+		argv.push_back(nullptr);
+
+		const pid_t pid = fork();
+		if (pid < 0){
+			result.error = "fork failed";
+			break;
+		}
+		if (pid == 0){
+			if (chdir(run.c_str()) != 0){ _exit(127); }
+			dup2(log, STDOUT_FILENO);
+			dup2(log, STDERR_FILENO);
+			execv(argv[0], argv.data());
+			_exit(127);
+		}
+		int status = 0;
+		rusage usage;
+		if (wait4(pid, &status, 0, &usage) < 0){
+			result.error = "lost " + command[0];
+			break;
+		}
+		++result.processes;
+		result.cpu += rusageCpuSeconds(usage);
+		result.peakRss = std::max<unsigned long long>(result.peakRss, 1024ULL*usage.ru_maxrss);
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0){
+			std::string line;
+			for (const std::string &argument : command){ line += (line.empty() ? "" : " ") + argument; }
+			result.error = "'" + line + "' failed";
+			break;
+		}
+	}
+	result.wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	result.io = readProcessIo() - before;
+	return result;
+}
+
+// unlink every file of directory but keep
+void clearDirectory (const std::string &directory, const std::string &keep){
+	DIR * entries = opendir(directory.c_str());
+	if (!entries){ return; }
+	std::vector<std::string> names;
+	for (dirent * entry = readdir(entries); entry; entry = readdir(entries)){
+		const std::string name = entry->d_name;
+		if (name == "." || name == ".." || name == keep){ continue; }
+		names.push_back(directory + "/" + name);
+	}
+	closedir(entries);
+	for (const std::string &name : names){
+		struct stat information;
+		if (lstat(name.c_str(), &information) == 0 && !S_ISDIR(information.st_mode)){ unlink(name.c_str()); }
+	}
+}
+
+std::string stageJson (const StageResult &result){
+	std::ostringstream json;
+	json << "{\"name\": " << jsonString(result.name)
+		<< ", \"processes\": " << result.processes
+		<< ", \"wall_seconds\": " << result.wall
+		<< ", \"cpu_seconds\": " << result.cpu
+		<< ", \"peak_rss_bytes\": " << result.peakRss
+		<< ", \"bytes_read\": " << result.io.rchar
+		<< ", \"bytes_written\": " << result.io.wchar
+		<< ", \"storage_bytes_read\": " << result.io.readBytes
+		<< ", \"storage_bytes_written\": " << result.io.writeBytes;
+	if (!result.error.empty()){ json << ", \"error\": " << jsonString(result.error); }
+	json << "}";
+	return json.str();
+}
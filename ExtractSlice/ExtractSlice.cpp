@@ -11,8 +11,11 @@
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 
-#include "itkExtractImageFilter.h"
-
+#include "FileNames.h"
+#include "ImageIO.h"
+#include "SliceView.h"
+#include "MemoryBudget.h"
+#include "OutputCache.h"
 
 #include <string>
 #include <iostream>
@@ -21,10 +24,6 @@
 
 using namespace itk;
 
-//helper functions
-std::string makeInputFileName (const std::string &filename);
-std::string makeOutputFileName (const std::string &filename, const std::string &outType, const int &direction, const int &slice);
-
 
 
 // 5 arguments:
@@ -32,9 +31,14 @@ std::string makeOutputFileName (const std::string &filename, const std::string &
 // 2 - outType
 // 3 - direction
 // 4 - slice number
+// --mem-budget=<MB> anywhere: stop before reading when the slice does not fit
+// --threads=<n> anywhere: threads for ITK and our own loops, every core by default
+// ITKSCRIPTS_CACHE_DIR=<dir>: an unchanged input links the slice from the cache
 int main(int argc, char * argv []){
 
 	std::cout << "Starting extracting a slice"  << std::endl;
+	if (!takeMemoryBudget(argc, argv)){ return EXIT_FAILURE; }
+	if (!takeThreads(argc, argv)){ return EXIT_FAILURE; }
 
 	if (argc > 5){
 		std::cout << "too many arguments" << std::endl;
@@ -68,31 +72,39 @@ int main(int argc, char * argv []){
 	}
 
 	std::string inputFileName = makeInputFileName(filename);	// input is assumed in ../data/
-	std::string outputFileName = makeOutputFileName(filename, outType, direction, slice);
+	std::string outputFileName = makeOutputFileName("slice_" + std::to_string(direction) + "_" + std::to_string(slice) + "_", stripExtension(filename), "", outType);
 	
 
 	std::cout << "filename: " << inputFileName << "\n";
 	std::cout << "  output: " << outputFileName << "\n";
+	OutputCache cache("ExtractSlice", { std::to_string(direction), std::to_string(slice) }, { inputFileName }, { outputFileName });
+	if (cache.restore()){ return EXIT_SUCCESS; }
 	
 	
 	// setting up reader type
 	using imagePixelType = float;						// float is ITK acceptable
 	using InputImageType = itk::Image< imagePixelType,  3 >;
   	using OutputImageType = itk::Image< imagePixelType, 2 >;
-	using ReaderType = itk::ImageFileReader< InputImageType >;
 	
-	// Setting up writer
-	using WriterType = itk::ImageFileWriter< OutputImageType >;
-	WriterType::Pointer writer = WriterType::New();
-	writer->SetFileName( outputFileName );
-
-	// setting up image reader
-	ReaderType::Pointer reader = ReaderType::New();
-	reader->SetFileName( inputFileName );
+	// read image
+	InputImageType::Pointer image;
 	
-	// retrieve image with Update()
+	// retrieve only the slice, .nii.gz inflates just the part of the file holding it
   	try{
-    		reader->Update();
+		if (direction < 0 || direction > 2){ itkGenericExceptionMacro(<< "direction must be 0, 1 or 2"); }
+		InputImageType::RegionType sliceRegion = readLargestRegion< InputImageType >( inputFileName );
+		if (slice < 0 || slice >= (int)sliceRegion.GetSize()[direction]){
+			std::cerr << "slice " << slice << " is out of range" << std::endl;
+			return EXIT_FAILURE;
+		}
+		InputImageType::SizeType sliceSize = sliceRegion.GetSize();
+		InputImageType::IndexType sliceStart = sliceRegion.GetIndex();
+		sliceSize[direction] = 1;
+		sliceStart[direction] = slice;
+		sliceRegion.SetSize( sliceSize );
+		sliceRegion.SetIndex( sliceStart );
+		requireMemory(2.0*regionBytes< InputImageType >( sliceRegion ), "the slice and its 2D copy");
+    		image = readImageRegion< InputImageType >( inputFileName, sliceRegion );
 	} catch( itk::ExceptionObject & err ){
     		std::cerr << "ExceptionObject caught !" << std::endl;
     		std::cerr << err << std::endl;
@@ -105,30 +117,13 @@ int main(int argc, char * argv []){
 	std::cout << duration.count() << " milliseconds for reading in the file and creating constants"<<std::endl;
 
 	
-	using ExtractFilter = itk::ExtractImageFilter< InputImageType, OutputImageType >;	
-	ExtractFilter::Pointer extracted = ExtractFilter::New();
-	extracted->InPlaceOn();
-	extracted->SetDirectionCollapseToSubmatrix();
-	
-	InputImageType::RegionType inputRegion = reader->GetOutput()->GetLargestPossibleRegion();
-	InputImageType::SizeType size = inputRegion.GetSize();
-	size[direction]=0;
-	InputImageType::IndexType start = inputRegion.GetIndex();
-	start[direction] = slice;
-
-	InputImageType::RegionType desiredRegion;
-	desiredRegion.SetSize( size );
-	desiredRegion.SetIndex( start );
-	
-	extracted->SetExtractionRegion( desiredRegion );
-	extracted->SetInput( reader->GetOutput() );	
+	// the slice is a view into what was read, it becomes a 2D image only for the writer
+	const SliceView<imagePixelType> sliceView = imageView(image.GetPointer()).slice(direction, 0);
 
 	// write out image
-	writer->SetInput( extracted->GetOutput() );
-	writer->SetUseCompression(true);
-	
 	try {
-	writer->Update();
+	writeImage< OutputImageType >( materializeSlice< OutputImageType >( sliceView ), outputFileName );
+	cache.store();
 	} catch ( itk::ExceptionObject & error ){
 	std::cerr << "Error: " << error << "\n";
 	return EXIT_FAILURE;
@@ -138,25 +133,6 @@ int main(int argc, char * argv []){
 	stop = std::chrono::high_resolution_clock::now();
 	duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
 	std::cout << duration.count() << " milliseconds for file written out succesfully\n"<<std::endl;
+	printPeakMemory(std::cout);
 	return EXIT_SUCCESS;
 }
-
-//Creating the input file name for a nifti
-std::string makeInputFileName (const std::string &filename){
-	std::string inputFileName = "../data/";
-	inputFileName.append(filename);
-	return inputFileName;
-}
-
-
-std::string makeOutputFileName (const std::string &filename, const std::string &outType, const int &direction, const int &slice){
-	std::string OutputFileName = "../output/";
-	OutputFileName.append("slice_").append(std::to_string(direction)).append("_");
-	OutputFileName.append(std::to_string(slice)).append("_");
-	std::size_t point = filename.find(".");
-	std::string temp = filename;
-	temp.erase(temp.begin()+point, temp.end());
-	OutputFileName.append(temp).append(outType);
-	return OutputFileName;
-}
-
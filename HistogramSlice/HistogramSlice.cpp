@@ -11,22 +11,22 @@
 #include "itkImageFileReader.h"
 #include "itkImageFileWriter.h"
 
-#include "itkExtractImageFilter.h"
-#include "itkPasteImageFilter.h"
-
-#include "itkHistogramMatchingImageFilter.h"
 #include "itkRescaleIntensityImageFilter.h"
 
+#include "FileNames.h"
+#include "ImageIO.h"
+#include "SliceView.h"
+#include "Trace.h"
+#include "PerfCounters.h"
+#include "MemoryBudget.h"
+#include "OutputCache.h"
+
 #include <string>
 #include <iostream>
 #include <chrono>
 
 using namespace itk;
 
-//helper functions
-std::string makeInputFileName (const std::string &filename, const std::string &filetype);
-std::string makeOutputFileName (const std::string &filename, const std::string &filetype);
-
 
 
 // 5 arguments:
@@ -35,9 +35,14 @@ std::string makeOutputFileName (const std::string &filename, const std::string &
 // 3 - outputType
 // 4 - orientation x:0, y=1, z=2
 // 5 - scaleToUsual
+// --mem-budget=<MB> anywhere: stop before reading when the volume does not fit
+// --threads=<n> anywhere: threads for ITK and our own loops, every core by default
+// ITKSCRIPTS_CACHE_DIR=<dir>: an unchanged input links the matched volume from the cache
 int main(int argc, char * argv []){
 
 	std::cout << "Starting histogram filter on slices"  << std::endl;
+	if (!takeMemoryBudget(argc, argv)){ return EXIT_FAILURE; }
+	if (!takeThreads(argc, argv)){ return EXIT_FAILURE; }
 
 	if (argc > 5){
 		std::cout << "too many arguments" << std::endl;
@@ -73,7 +78,9 @@ int main(int argc, char * argv []){
 	auto begin = std::chrono::high_resolution_clock::now();	
 
 	std::string inputFileName = makeInputFileName(filename, inputType);	// input is assumed in ../data/
-	std::string outputFileName = makeOutputFileName(filename, outputType);
+	std::string outputFileName = makeOutputFileName("", filename, "_HistogramFilterMid", outputType);
+	OutputCache cache("HistogramSlice", { std::to_string(orientation) }, { inputFileName }, { outputFileName });
+	if (cache.restore()){ return EXIT_SUCCESS; }
 	
 	auto stop = std::chrono::high_resolution_clock::now();
 	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
@@ -82,170 +89,71 @@ int main(int argc, char * argv []){
 	// setting up reader type
 	using imagePixelType = short;						// short is faster
 	using ImageType = itk::Image< imagePixelType, Dimension>;		// ImageType is used for both input and output
-	using ReaderType = itk::ImageFileReader< ImageType >;
 	
-	// Setting up writer
-	using WriterType = itk::ImageFileWriter< ImageType >;
-	WriterType::Pointer writer = WriterType::New();
-	writer->SetFileName( outputFileName );
-
-	// setting up image reader
-	ReaderType::Pointer imageReader = ReaderType::New();
-	imageReader->SetFileName( inputFileName );
+	// read image
+	ImageType::Pointer image;
 	
-	// retrieve image with Update()
+	// retrieve image, shared memory cache aware
   	try{
-    		imageReader->Update();
+		requireMemory(imageFileBytes< ImageType >( inputFileName ), "the volume, matched in place");
+    		image = readImage< ImageType >( inputFileName );
 	} catch( itk::ExceptionObject & err ){
     		std::cerr << "ExceptionObject caught !" << std::endl;
     		std::cerr << err << std::endl;
     		return EXIT_FAILURE;
     	}
 
-	// get image specifications for use
-	ImageType * inputImage = imageReader->GetOutput();				// get the input image
-	ImageType::RegionType inputRegion = inputImage->GetLargestPossibleRegion();	// get image region
-	ImageType::SizeType size = inputRegion.GetSize();				//getting the region size
-	ImageType::IndexType start = inputRegion.GetIndex();				// get index start
-	
-	// set size of slice
-	ImageType::SizeType sliceSize = size;						// set up the size for any slice
-	sliceSize[orientation] = 1; 							// setting the orientation direction to 1 for collapse
+	// every slice is a view into the volume buffer, nothing is extracted or pasted
+	const VolumeView<imagePixelType> volume = imageView(image.GetPointer());
+	const std::size_t slices = volume.size[orientation];
 
-	using ExtractFilterType = itk::ExtractImageFilter< ImageType, ImageType >; 	// output 3d slices (not 2d slices)
-	
 	stop = std::chrono::high_resolution_clock::now();
 	duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
-	std::cout << duration.count() << " milliseconds to set up all reader writer extraction filter" << std::endl;
-
+	std::cout << duration.count() << " milliseconds to set up the slice views" << std::endl;
 
-	/********** MIDDLE SLICE EXTRACTION **********/
-
-	// set the index need to extract middle slice
-	const unsigned int midSliceNumber = (int) size[orientation]/2;			// finding middle slice
-	ImageType::IndexType middleStart = start;					// create a index for middle slice
-	middleStart[orientation] = midSliceNumber;					// pick the middle slice index
-	
-	// set up extraction region for middle slice
-	ImageType::RegionType desiredMiddleRegion; 					// create middle region
-	desiredMiddleRegion.SetSize( sliceSize ); 					// set size (with collapsed direction) for middle region
-	desiredMiddleRegion.SetIndex( middleStart ); 					// set extraction region index start
-	std::cout << sliceSize << std::endl;
-	std::cout << middleStart << std::endl;
-	// setting up Extraction filter for middle slice
-	ExtractFilterType::Pointer extractMiddleFilter = ExtractFilterType::New();	// make filter to extract middle slice
-	extractMiddleFilter->SetDirectionCollapseToSubmatrix();				// set flag to collapse
-	extractMiddleFilter->SetExtractionRegion( desiredMiddleRegion );		// set region
-	extractMiddleFilter->SetInput( inputImage );					// set input image
-	extractMiddleFilter->Update();
-	ImageType::Pointer middleSlice = extractMiddleFilter->GetOutput();		// get middle slice for later use
-
-	std::cout << "right after extraction\n";
-	std::cout << middleSlice->GetLargestPossibleRegion() << "\n";
-	
-	stop = std::chrono::high_resolution_clock::now();
-	duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
-	std::cout << duration.count() << " milliseconds to extract middle slice" << std::endl;
-	
-	/********** SLICE EXTRACTION AND HISTOGRAM MATCH FILTER **********/
-	
 
-	// setting up HistogramMatchFilter (HMFilter)
-	using HMFilterType = itk::HistogramMatchingImageFilter< ImageType , ImageType >;
-	HMFilterType::Pointer intensityEqualizeFilter = HMFilterType::New();
-	intensityEqualizeFilter->SetNumberOfHistogramLevels(100);
-	intensityEqualizeFilter->SetNumberOfMatchPoints(15);
-	intensityEqualizeFilter->ThresholdAtMeanIntensityOn();
-	intensityEqualizeFilter->SetReferenceImage( middleSlice );
+	/********** MIDDLE SLICE REFERENCE **********/
 
-	// Setting up Paste Filter
-	ImageType * outputImage = inputImage;					// make outputImage
-	using PasteFilterType = itk::PasteImageFilter< ImageType, ImageType >;
-	PasteFilterType::Pointer pasteFilter = PasteFilterType::New();
-	pasteFilter->SetSourceImage( outputImage );
+	// quantiles of the middle slice are taken before any slice is matched
+	const std::size_t midSliceNumber = slices/2;					// finding middle slice
+	const HistogramMatch intensityEqualize(volume.slice(orientation, midSliceNumber), 100, 15);
+	std::cout << "reference slice " << midSliceNumber << " of " << slices << "\n";
 
 	stop = std::chrono::high_resolution_clock::now();
 	duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
-	std::cout << duration.count() << " milliseconds to set up histogram and paste filter" << std::endl;
-
-
-
-	for (int i = 1; i <= size[orientation]; ++i){
-		/*** SLICE EXTRACTION ***/
-		// set the index need to extract a slice
-		ImageType::IndexType sliceStart = start; std::cout<< 1 << "\n";				// create a index
-		sliceStart[orientation] = i;std::cout<< 2 << "\n";							// pick the index
-	
-		// set up extraction region for a slice
-		ImageType::RegionType desiredSliceRegion; std::cout<< 3 << "\n";					// create slice region
-		desiredSliceRegion.SetSize( sliceSize ); std::cout<< 4 << "\n";					// set size (with collapsed direction) 
-		desiredSliceRegion.SetIndex( sliceStart ); std::cout<< 5 << "\n";					// set extraction region index start
-		std::cout << "slice number = " << i << " \n";
-
-		// setting up Extraction filter for middle slice
-		ExtractFilterType::Pointer extractSliceFilter = ExtractFilterType::New();std::cout<< 6 << "\n";	// make filter to extract a slice
-		extractSliceFilter->SetDirectionCollapseToSubmatrix();std::cout<< 7 << "\n";				// set flag to collapse
-		extractSliceFilter->SetExtractionRegion( desiredSliceRegion );	std::cout<< 8 << "\n";		// set region
-		extractSliceFilter->SetInput( inputImage );std::cout<< 9 << "\n";					// set input image
-		extractSliceFilter->Update();
-		ImageType::Pointer currentSlice = extractSliceFilter->GetOutput();std::cout<< 10 << "\n";		// get slice for later use
-
-		// update HMFilter
-		intensityEqualizeFilter->SetInput( currentSlice );std::cout<< 11 << "\n";
-		std::cout << currentSlice->GetLargestPossibleRegion() << "\n";
-		std::cout << middleSlice->GetLargestPossibleRegion() << "\n";
-		intensityEqualizeFilter->Update();std::cout<< 12 << "\n";
-
-		// use pasteFilter
-		pasteFilter->SetDestinationImage( intensityEqualizeFilter->GetOutput() );std::cout<< 13 << "\n";
-		pasteFilter->SetDestinationIndex( sliceStart );std::cout<< 14 << "\n";
-		pasteFilter->SetSourceRegion( inputRegion );std::cout<< 15 << "\n";
-		pasteFilter->Update();std::cout<< 16 << "\n";
+	std::cout << duration.count() << " milliseconds to histogram the middle slice" << std::endl;
+
+	/********** HISTOGRAM MATCH EVERY SLICE **********/
+
+	PerfCounters counters;								// ITKSCRIPTS_PERF=1 to count
+	counters.start();
+	{
+		TraceSpan span("compute", "histogram match");
+		span.setVoxels(image->GetBufferedRegion().GetNumberOfPixels());
+		for (std::size_t i = 0; i < slices; ++i){
+			intensityEqualize.apply(volume.slice(orientation, i));			// matched in place
+		}
 	}
-
-
-
-
-
-
-
-
-
+	const PerfSample matching = counters.stop();
 
 	stop = std::chrono::high_resolution_clock::now();
 	duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
-	std::cout << duration.count() << " about to use writer" << std::endl;
+	std::cout << duration.count() << " about to use writer"
+		<< describePerfSample(matching, 2.0*image->GetBufferedRegion().GetNumberOfPixels()*sizeof(imagePixelType)) << std::endl;
 
 
-  	writer->SetInput( pasteFilter->GetOutput() );
-
 	try{
-		writer->Update();
+		writeImage< ImageType >( image, outputFileName, false );
+		cache.store();
 	} catch (itk::ExceptionObject &err) {
 		std::cerr << "ExceptionObject caught" << std::endl;
 		std::cerr << err << std::endl;
 	}
 
+	printPeakMemory(std::cout);
 	return EXIT_SUCCESS;
 }
 
-//Creating the input file name for a nifti
-std::string makeInputFileName (const std::string &filename, const std::string &inputType){
-	std::string inputFileName = "../data/";
-	inputFileName.append(filename);
-	inputFileName.append(inputType);
-	return inputFileName;
-}
-
-
-std::string makeOutputFileName (const std::string &filename, const std::string &filetype){
-	std::string OutputFileName = "../output/";
-	OutputFileName.append(filename);
-	OutputFileName.append("_HistogramFilterMid");
-	OutputFileName.append(filetype);
-	return OutputFileName;
-}
-
 
 ////////////////////////////////Previous 2D Slicer
 //	using InputPixelType = float;
@@ -0,0 +1,345 @@
+// File name: 	ITKScripts.cpp
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: One binary for all the scripts. Either a subcommand that behaves like
+// 		the standalone script, or a pipeline of stages joined by '+' that hands
+// 		the image from stage to stage in memory, or a batch of either read from
+// 		a manifest and run on one pool of threads.
+
+
+
+#include "itkMultiThreader.h"
+
+#include "Pipeline.h"
+#include "FileNames.h"
+#include "VolumeServer.h"
+#include "WorkStealingPool.h"
+#include "BatchJournal.h"
+
+#include <unistd.h>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+
+using namespace itk;
+
+//helper functions
+void printUsage ();
+std::vector<PipelineStage> scriptPipeline (const std::string &script, const std::vector<std::string> &args);
+void runQuery (const std::vector<std::string> &args);
+int runBatch (const std::vector<std::string> &args);
+
+
+
+// itkscripts <subcommand> [script arguments]
+// itkscripts serve <socket> [cacheMB]
+// itkscripts query <socket> <request> [args]
+// itkscripts batch <manifest> [jobs] [memoryMB]
+// itkscripts <stage> [args] [+ <stage> [args]]...
+// --mem-budget=<MB> anywhere caps the memory of a pipeline
+// --threads=<n> anywhere: threads for ITK and our own loops, every core by default
+int main(int argc, char * argv []){
+
+	if (!takeMemoryBudget(argc, argv)){ return EXIT_FAILURE; }
+	if (!takeThreads(argc, argv)){ return EXIT_FAILURE; }
+	if (argc < 2 || std::string(argv[1]) == "help"){
+		printUsage();
+		return argc < 2 ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	auto begin = std::chrono::high_resolution_clock::now();
+
+	std::vector<std::string> tokens(argv + 1, argv + argc);
+	try {
+		if (tokens[0] == "serve"){
+			if (tokens.size() < 2 || tokens.size() > 3){ itkGenericExceptionMacro(<< "usage: serve <socket> [cacheMB]"); }
+			const int capacity = (tokens.size() == 3) ? stageInt(tokens[2], "cacheMB") : 4096;
+			if (capacity <= 0){ itkGenericExceptionMacro(<< "usage: serve <socket> [cacheMB], cacheMB > 0"); }
+			runVolumeServer(tokens[1], (std::size_t)capacity << 20);
+			return EXIT_SUCCESS;
+		}
+		if (tokens[0] == "query"){
+			runQuery(std::vector<std::string>(tokens.begin() + 1, tokens.end()));
+			return EXIT_SUCCESS;
+		}
+		if (tokens[0] == "batch"){
+			return runBatch(std::vector<std::string>(tokens.begin() + 1, tokens.end()));
+		}
+		std::vector<PipelineStage> stages = scriptPipeline(tokens[0], std::vector<std::string>(tokens.begin() + 1, tokens.end()));
+		if (stages.empty()){
+			stages = parsePipeline(tokens);
+		}
+		OutputCache cache = pipelineCache(stages);
+		if (!cache.restore()){
+			fitPipelineToBudget(stages);
+			runPipeline(stages);
+			cache.store();
+		}
+	} catch ( itk::ExceptionObject & error ){
+		std::cerr << "Error: " << error << "\n";
+		return EXIT_FAILURE;
+	}
+
+	auto stop = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
+	std::cout << duration.count() << " milliseconds for the whole pipeline\n" << std::endl;
+	return EXIT_SUCCESS;
+}
+
+void printUsage (){
+	std::cout << "Usage:\n";
+	std::cout << "  itkscripts extractslice [filename] [outType] [direction] [slice#]\n";
+	std::cout << "  itkscripts maximumprojection [filename] [type] [direction]\n";
+	std::cout << "  itkscripts normalizeintense [filename] [type] [x] [y] [step]\n";
+	std::cout << "  itkscripts histogramslice [filename] [inputType] [outputType] [orientation]\n";
+	std::cout << "  itkscripts convert <input> <output> [chunk]\n";
+	std::cout << "  itkscripts assemble <pattern> <first>:<last> <output> [direction] [spacing]\n";
+	std::cout << "  itkscripts <stage> [args] [+ <stage> [args]]...\n";
+	std::cout << "  itkscripts serve <socket> [cacheMB]\n";
+	std::cout << "  itkscripts query <socket> slice <volume> <direction> <slice#> <output>\n";
+	std::cout << "  itkscripts query <socket> project <volume> <direction> <output>\n";
+	std::cout << "  itkscripts query <socket> stats <volume> <direction> <slice#> <x> <y> <step>\n";
+	std::cout << "  itkscripts query <socket> status|shutdown\n";
+	std::cout << "  itkscripts batch <manifest> [jobs] [memoryMB]\n";
+	std::cout << "Add --mem-budget=<MB> to cap the memory of a pipeline (of each batch job); over it read + project goes slab by slab,\n";
+	std::cout << "anything else stops with an estimate before reading.\n";
+	std::cout << "Add --threads=<n> to run ITK and our own loops on n threads instead of every core.\n";
+	std::cout << "Stages:\n";
+	for (const StageInfo &info : pipelineStages()){
+		std::cout << "  " << info.usage << "\n";
+	}
+}
+
+// The standalone scripts as pipelines, same arguments, defaults, file names and
+// output pixel types, dimensions and compression.
+// Returns an empty pipeline when script is not one of them.
+std::vector<PipelineStage> scriptPipeline (const std::string &script, const std::vector<std::string> &args){
+	std::vector<std::string> tokens;
+	auto arg = [&](std::size_t i, const char * fallback){
+		return args.size() > i ? args[i] : std::string(fallback);
+	};
+
+	if (script == "extractslice"){
+		if (args.size() > 4){ itkGenericExceptionMacro(<< "too many arguments"); }
+		const std::string filename = arg(0, "proj_norm.nii"), outType = arg(1, ".tif");
+		const std::string direction = arg(2, "0"), slice = arg(3, "0");
+		tokens = { "read", makeInputFileName(filename), direction, slice,
+			"+", "write", makeOutputFileName("slice_" + direction + "_" + slice + "_", stripExtension(filename), "", outType),
+			"slice=" + direction };
+	} else if (script == "maximumprojection"){
+		if (args.size() > 3){ itkGenericExceptionMacro(<< "too many arguments"); }
+		const std::string filename = arg(0, "volume"), type = arg(1, ".nii.gz"), direction = arg(2, "0");
+		tokens = { "read", makeInputFileName(filename, type),
+			"+", "project", direction,
+			"+", "write", makeOutputFileName("proj_" + direction + "_", filename, "", ".nii") };
+	} else if (script == "normalizeintense"){
+		if (args.size() > 5){ itkGenericExceptionMacro(<< "too many arguments"); }
+		const std::string filename = arg(0, "slice000"), type = arg(1, ".tif");
+		tokens = { "read", makeInputFileName(filename, type),
+			"+", "normalize", arg(2, "25"), arg(3, "25"), arg(4, "10"),
+			"+", "write", makeOutputFileName("", filename, "_Norm", type), "uncompressed" };
+	} else if (script == "histogramslice"){
+		if (args.size() > 4){ itkGenericExceptionMacro(<< "too many arguments"); }
+		const std::string filename = arg(0, "Smallfield_OCT_Angiography_Volume_fovea");
+		const std::string inputType = arg(1, ".nii"), outputType = arg(2, inputType.c_str());
+		tokens = { "read", makeInputFileName(filename, inputType),
+			"+", "histmatch", arg(3, "0"),
+			"+", "write", makeOutputFileName("", filename, "_HistogramFilterMid", outputType), "short", "uncompressed" };
+	} else if (script == "convert"){
+		// e.g. export an .isv intermediate to .nii.gz, or brick a NIfTI volume for
+		// slicing along any axis; the formats follow the extensions
+		if (args.size() < 2 || args.size() > 3){ itkGenericExceptionMacro(<< "usage: convert <input> <output> [chunk]"); }
+		tokens = { "read", args[0], "+", "write", args[1] };
+		if (args.size() == 3){ tokens.push_back(args[2]); }
+	} else if (script == "assemble"){
+		// c3d slice{000..499}_Norm.tif -tile z -o volume.nii.gz, without c3d:
+		// assemble ../output/slice%03d_Norm.tif 0:499 ../output/volume.nii.gz
+		if (args.size() < 3 || args.size() > 5){ itkGenericExceptionMacro(<< "usage: assemble <pattern> <first>:<last> <output> [direction] [spacing]"); }
+		tokens = { "stack", args[0], args[1] };
+		tokens.insert(tokens.end(), args.begin() + 3, args.end());
+		tokens.insert(tokens.end(), { "+", "write", args[2] });
+	} else {
+		return std::vector<PipelineStage>();
+	}
+	return parsePipeline(tokens);
+}
+
+// one request to a running server, slices and projections are written to <output>
+void runQuery (const std::vector<std::string> &args){
+	if (args.size() < 2){ itkGenericExceptionMacro(<< "usage: query <socket> <request> [args]"); }
+	const std::string &request = args[1];
+	std::vector<int> numbers;
+	std::string path, output;
+	uint32_t op;
+	if (request == "slice" && args.size() == 6){
+		op = opSlice;
+		path = args[2];
+		numbers = { stageDirection(args[3]), stageInt(args[4], "slice") };
+		output = args[5];
+	} else if (request == "project" && args.size() == 5){
+		op = opProjection;
+		path = args[2];
+		numbers = { stageDirection(args[3]) };
+		output = args[4];
+	} else if (request == "stats" && args.size() == 8){
+		op = opStatistics;
+		path = args[2];
+		numbers = { stageDirection(args[3]), stageInt(args[4], "slice"), stageInt(args[5], "x"), stageInt(args[6], "y"), stageInt(args[7], "step") };
+	} else if (request == "status" && args.size() == 2){
+		op = opStatus;
+	} else if (request == "shutdown" && args.size() == 2){
+		op = opShutdown;
+	} else {
+		itkGenericExceptionMacro(<< "unknown or incomplete query '" << request << "'");
+	}
+
+	int connection = connectVolumeServer(args[0]);
+	PipelineState state;
+	ResponseHeader response;
+	try {
+		response = queryVolumeServer(connection, op, numbers, path, state.image);
+	} catch ( itk::ExceptionObject & ){
+		close(connection);
+		throw;
+	}
+	close(connection);
+
+	if (op == opStatistics){
+		std::cout << "sum: " << response.values[0] << "\n";
+		std::cout << "mean: " << response.values[1] << "\n";
+		std::cout << "min: " << response.values[2] << "\n";
+		std::cout << "max: " << response.values[3] << "\n";
+	} else if (op == opStatus){
+		std::cout << "volumes: " << response.values[0] << "\n";
+		std::cout << "bytes: " << response.values[1] << "\n";
+		std::cout << "hits: " << response.values[2] << "\n";
+		std::cout << "misses: " << response.values[3] << "\n";
+	} else if (!output.empty()){
+		writeStage(state, { output });
+	}
+}
+
+// one line of a batch manifest
+struct BatchJob {
+	std::size_t line;
+	std::string command;
+	std::vector<PipelineStage> stages;
+	std::size_t bytes;
+};
+
+// Every line of the manifest is an itkscripts command line without "itkscripts":
+// a script subcommand or stages joined by '+'. "mem=<MB>" in front sets the memory
+// of the job instead of the estimate; '#' starts a comment. Jobs run side by side
+// on one pool, the largest first, and the cores are split between jobs and the
+// threads of each job, so ITK and the gzip/transpose helpers do not oversubscribe.
+// Finished jobs go to <manifest>.journal; running the batch again skips the jobs
+// it names whose outputs are still there, so a killed batch resumes where it
+// stopped. Jobs that only print (stats) are not journaled and run again.
+// --mem-budget caps every job like a single pipeline, memoryMB is the sum of the jobs.
+int runBatch (const std::vector<std::string> &args){
+	if (args.empty() || args.size() > 3){ itkGenericExceptionMacro(<< "usage: batch <manifest> [jobs] [memoryMB]"); }
+	std::ifstream manifest(args[0].c_str());
+	if (!manifest){ itkGenericExceptionMacro(<< "cannot open manifest " << args[0]); }
+
+	// every line is checked before anything runs
+	std::vector<BatchJob> jobs;
+	std::string text;
+	for (std::size_t line = 1; std::getline(manifest, text); ++line){
+		const std::size_t comment = text.find('#');
+		if (comment != std::string::npos){ text.erase(comment); }
+		std::stringstream words(text);
+		std::vector<std::string> tokens;
+		for (std::string word; words >> word; ){ tokens.push_back(word); }
+		if (tokens.empty()){ continue; }
+
+		BatchJob job;
+		job.line = line;
+		job.bytes = 0;
+		bool estimated = true;
+		try {
+			if (tokens[0].compare(0, 4, "mem=") == 0){
+				const int megabytes = stageInt(tokens[0].substr(4), "mem");
+				if (megabytes <= 0){ itkGenericExceptionMacro(<< "expected mem=<MB> with MB > 0, got '" << tokens[0] << "'"); }
+				job.bytes = (std::size_t)megabytes << 20;
+				estimated = false;
+				tokens.erase(tokens.begin());
+				if (tokens.empty()){ itkGenericExceptionMacro(<< "no command"); }
+			}
+			job.stages = scriptPipeline(tokens[0], std::vector<std::string>(tokens.begin() + 1, tokens.end()));
+			if (job.stages.empty()){ job.stages = parsePipeline(tokens); }
+			fitPipelineToBudget(job.stages);
+		} catch ( itk::ExceptionObject & err ){
+			itkGenericExceptionMacro(<< args[0] << ":" << line << ": " << err.GetDescription());
+		}
+		if (estimated){ job.bytes = (std::size_t)estimatePipelineBytes(job.stages); }
+		for (const std::string &token : tokens){ job.command += (job.command.empty() ? "" : " ") + token; }
+		jobs.push_back(job);
+	}
+	if (jobs.empty()){
+		std::cout << "nothing to do in " << args[0] << "\n";
+		return EXIT_SUCCESS;
+	}
+
+	BatchJournal journal(args[0] + ".journal");
+	const std::size_t listed = jobs.size();
+	jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [&journal](const BatchJob &job){
+		const std::vector<std::string> outputs = pipelineOutputs(job.stages);
+		return !outputs.empty() && journal.done(job.command, outputs);
+	}), jobs.end());
+	if (jobs.size() < listed){
+		std::cout << (listed - jobs.size()) << " of " << listed << " jobs already done, from " << journal.path() << "\n";
+	}
+	if (jobs.empty()){ return EXIT_SUCCESS; }
+
+	// longest processing time first: the big volumes start early, the small ones fill in
+	std::stable_sort(jobs.begin(), jobs.end(), [](const BatchJob &a, const BatchJob &b){ return a.bytes > b.bytes; });
+
+	const unsigned int cores = processThreads();
+	const unsigned int workers = std::min<std::size_t>(jobs.size(), args.size() > 1 ? std::max(1, stageInt(args[1], "jobs")) : cores);
+	const unsigned int threadsPerJob = std::max(1u, cores/workers);
+	const std::size_t budget = (args.size() > 2) ? (std::size_t)std::max(1, stageInt(args[2], "memoryMB")) << 20
+		: (std::size_t)sysconf(_SC_PHYS_PAGES)*sysconf(_SC_PAGE_SIZE)/2;
+	itk::MultiThreader::SetGlobalDefaultNumberOfThreads( threadsPerJob );
+	// freed image buffers wait for the next job, up to the largest job's worth
+	if (!std::getenv("ITKSCRIPTS_BUFFER_POOL")){ ImageBufferPool::instance().setCapacity(jobs.front().bytes); }
+	std::cout << jobs.size() << " jobs, " << workers << " at a time with " << threadsPerJob << " threads each, "
+		<< (budget >> 20) << " MB of memory\n";
+
+	// jobs whose inputs did not change since the last run come from the output cache
+	std::atomic<std::size_t> cached(0);
+	WorkStealingPool pool(workers, threadsPerJob, budget);
+	for (const BatchJob &job : jobs){
+		pool.add({ [&job, &cached, &journal](){
+			TraceSpan span("job", job.command);
+			OutputCache cache = pipelineCache(job.stages);
+			if (cache.restore()){
+				++cached;
+			} else {
+				runPipeline(job.stages, false);
+				cache.store();
+			}
+			const std::vector<std::string> outputs = pipelineOutputs(job.stages);
+			if (!outputs.empty()){ journal.record(job.command, outputs); }
+		}, job.bytes });
+	}
+	auto begin = std::chrono::high_resolution_clock::now();
+	const std::vector< std::pair<std::size_t, std::string> > errors = pool.run();
+	auto stop = std::chrono::high_resolution_clock::now();
+
+	for (const auto &error : errors){
+		const BatchJob &job = jobs[error.first];
+		std::cerr << "Error: " << args[0] << ":" << job.line << ": " << job.command << "\n\t" << error.second << "\n";
+	}
+	std::cout << (jobs.size() - errors.size()) << " of " << jobs.size() << " jobs done in "
+		<< std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin).count() << " milliseconds, "
+		<< cached << " from the output cache, "
+		<< ImageBufferPool::instance().reused() << " of " << ImageBufferPool::instance().mapped() + ImageBufferPool::instance().reused()
+		<< " large image buffers reused\n" << std::endl;
+	return errors.empty() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -15,21 +15,21 @@
 #include "itkPasteImageFilter.h"
 
 
+#include "FileNames.h"
+#include "ImageIO.h"
+#include "SliceSeries.h"
+
 #include <string>
 #include <iostream>
 #include <chrono>
 
 using namespace itk;
 
-//helper functions
-std::string makeInputFileName (const std::string &filename, const std::string &filetype);
-std::string makeOutputFileName (const std::string &filename1, const std::string &filename2, const std::string &filetype);
-
 
 
 // 7 arguments:
-// 1 - filename1
-// 2 - filename2
+// 1 - filename1, or a series pattern like slice%03d
+// 2 - filename2, or the slices of the series as first:last
 // 3 - type
 // 4 - x
 // 5 - y
@@ -73,9 +73,37 @@ int main(int argc, char * argv []){
 	//timing
 	auto begin = std::chrono::high_resolution_clock::now();	
 
+	/********** SERIES: WINDOW STATISTICS OF EVERY SLICE IN first:last **********/
+
+	if (isSeriesPattern(filename1)){
+		const std::size_t colon = filename2.find(":");
+		const int first = atoi(filename2.substr(0, colon).c_str());
+		const int last = (colon == std::string::npos) ? first : atoi(filename2.substr(colon+1).c_str());
+		std::cout << "series: " << makeInputFileName(filename1, type) << " " << first << ":" << last << "\n";
+		try {
+			// only the slices in the range are decoded, one at a time through the cache
+			SliceSeries< float > series( makeInputFileName(filename1, type), first, last );
+			std::cout << "slice,sum,mean,min,max\n";
+			for (std::size_t k = 0; k < series.slices(); ++k){
+				const RegionStatistics stats = series.roiStatistics(k, x, y, step);
+				std::cout << first + k << "," << stats.sum << "," << stats.sum/stats.count
+					<< "," << stats.min << "," << stats.max << "\n";
+			}
+			std::cout << series.decodes() << " slices decoded\n";
+		} catch( itk::ExceptionObject & err ){
+			std::cerr << "ExceptionObject caught !" << std::endl;
+			std::cerr << err << std::endl;
+			return EXIT_FAILURE;
+		}
+		auto stop = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
+		std::cout << duration.count() << " milliseconds for the series"<<std::endl;
+		return EXIT_SUCCESS;
+	}
+
 	std::string inputFileName1 = makeInputFileName(filename1, type);	// input is assumed in ../data/
 	std::string inputFileName2 = makeInputFileName(filename2, type);	// input is assumed in ../data/
-	std::string outputFileName = makeOutputFileName(filename1, filename2, type);
+	std::string outputFileName = makeOutputFileName("", filename1, "_" + filename2, type);
 	
 
 	std::cout << "x: " << x << "\n";
@@ -91,23 +119,22 @@ int main(int argc, char * argv []){
 	// setting up reader type
 	using imagePixelType = short;						// short is faster
 	using ImageType = itk::Image< imagePixelType, Dimension>;		// ImageType is used for both input and output
-	using ReaderType = itk::ImageFileReader< ImageType >;
 	
 	// Setting up writer
 	using WriterType = itk::ImageFileWriter< ImageType >;
 	WriterType::Pointer writer = WriterType::New();
 	writer->SetFileName( outputFileName );
 
-	// setting up image reader
-	ReaderType::Pointer imageReader1 = ReaderType::New();
-	imageReader1->SetFileName( inputFileName1 );
-	ReaderType::Pointer imageReader2 = ReaderType::New();
-	imageReader2->SetFileName( inputFileName2 );
+	// read images
+	ImageType::Pointer image1, image2;
 	
-	// retrieve image with Update()
+	// only the window is read, a TIFF decodes just the strips or tiles under it
+	ImageType::RegionType window;
+	window.SetIndex( {{ x-step, y-step }} );
+	window.SetSize( {{ (SizeValueType)(2*step+1), (SizeValueType)(2*step+1) }} );
   	try{
-    		imageReader1->Update();
-		imageReader2->Update();
+    		image1 = readImageRegion< ImageType >( inputFileName1, window );
+		image2 = readImageRegion< ImageType >( inputFileName2, window );
 	} catch( itk::ExceptionObject & err ){
     		std::cerr << "ExceptionObject caught !" << std::endl;
     		std::cerr << err << std::endl;
@@ -115,10 +142,6 @@ int main(int argc, char * argv []){
     	}
 
 
-	// get images
-	ImageType::Pointer image1 = imageReader1->GetOutput();
-	ImageType::Pointer image2 = imageReader2->GetOutput();
-
 	std::cout << "check\n";
 	imagePixelType sum1 = 0;
 	imagePixelType sum2 = 0;
@@ -144,21 +167,3 @@ int main(int argc, char * argv []){
 	std::cout << "max: " << max << "\n";
 
 }
-
-//Creating the input file name for a nifti
-std::string makeInputFileName (const std::string &filename, const std::string &inputType){
-	std::string inputFileName = "../data/";
-	inputFileName.append(filename);
-	inputFileName.append(inputType);
-	return inputFileName;
-}
-
-
-std::string makeOutputFileName (const std::string &filename1, const std::string &filename2, const std::string &filetype){
-	std::string OutputFileName = "../output/";
-	OutputFileName.append(filename1);
-	OutputFileName.append("_").append(filename2);
-	OutputFileName.append(filetype);
-	return OutputFileName;
-}
-
@@ -0,0 +1,325 @@
+// File name: 	SliceSimilarity.cpp
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Dense local NCC and SSIM maps between two slices, or between every
+// 		consecutive pair of slices in a volume (motion artifacts, blinks)
+
+
+
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+
+#include "SliceSimilarity.h"
+
+#include "FileNames.h"
+#include "ImageIO.h"
+#include "Transpose.h"
+#include "WorkerThreads.h"
+#include "Trace.h"
+#include "MemoryBudget.h"
+#include "OutputCache.h"
+
+#include <string>
+#include <iostream>
+#include <chrono>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <cmath>
+
+using namespace itk;
+
+
+
+// 6 arguments:
+// 1 - mode (pair or volume)
+// pair:
+// 	2 - filename1
+// 	3 - filename2
+// 	4 - type
+// 	5 - radius
+// volume:
+// 	2 - filename
+// 	3 - type
+// 	4 - direction
+// 	5 - radius
+// --mem-budget=<MB> anywhere: stop before reading when the images and maps do not fit
+// --threads=<n> anywhere: threads for ITK and our own loops, every core by default
+// ITKSCRIPTS_CACHE_DIR=<dir>: unchanged inputs link the maps from the cache, without the scores
+int main(int argc, char * argv []){
+
+	std::cout << "Starting slice similarity"  << std::endl;
+	if (!takeMemoryBudget(argc, argv)){ return EXIT_FAILURE; }
+	if (!takeThreads(argc, argv)){ return EXIT_FAILURE; }
+
+	if (argc > 6){
+		std::cout << "too many arguments" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	auto begin = std::chrono::high_resolution_clock::now();
+
+	// setting up arguments
+	std::string mode, filename1, filename2, type;
+	int direction = 2, radius;
+
+	if (argc == 6){
+		std::cout << "Accepted input arguments" << std::endl;
+		mode = argv[1];
+		if (mode == "volume"){
+			filename1 = argv[2];
+			type = argv[3];
+			direction = atoi(argv[4]);
+		} else {
+			filename1 = argv[2];
+			filename2 = argv[3];
+			type = argv[4];
+		}
+		radius = atoi(argv[5]);
+	} else {
+		std::cout << "Not enough arguments, went with default" << std::endl;
+		mode = "pair";
+		filename1 = "slice000";
+		filename2 = "slice001";
+		type = ".tif";
+		radius = 3;
+	}
+
+	if (mode != "pair" && mode != "volume"){
+		std::cout << "mode must be pair or volume" << std::endl;
+		return EXIT_FAILURE;
+	}
+	if (radius < 1 || direction < 0 || direction > 2){
+		std::cout << "radius must be >= 1 and direction in [0, 2]" << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	std::cout << "mode: " << mode << "\n";
+	std::cout << "radius: " << radius << "\n";
+
+	using imagePixelType = float;
+	using SliceImageType = itk::Image< imagePixelType, 2 >;
+	using VolumeImageType = itk::Image< imagePixelType, 3 >;
+
+	if (mode == "pair"){
+		std::string inputFileName1 = makeInputFileName(filename1, type);	// input is assumed in ../data/
+		std::string inputFileName2 = makeInputFileName(filename2, type);
+		std::string outputPrefix = filename1 + "_" + filename2;
+		std::cout << "filename1: " << inputFileName1 << "\n";
+		std::cout << "filename2: " << inputFileName2 << "\n";
+		OutputCache cache("SliceSimilarity", { mode, std::to_string(radius) }, { inputFileName1, inputFileName2 },
+			{ makeOutputFileName("", outputPrefix, "_NCC", ".nii.gz"), makeOutputFileName("", outputPrefix, "_SSIM", ".nii.gz") });
+		if (cache.restore()){ return EXIT_SUCCESS; }
+
+		SliceImageType::Pointer image1, image2;
+		try{
+			// plus eight doubles per pixel of moments while the maps are computed
+			const double sliceBytes = imageFileBytes< SliceImageType >( inputFileName1 );
+			requireMemory(2.0*(sliceBytes + imageFileBytes< SliceImageType >( inputFileName2 )) + 64.0*sliceBytes/sizeof(imagePixelType),
+				"both slices, their NCC and SSIM maps and the local moments");
+			image1 = readImage< SliceImageType >( inputFileName1 );
+			image2 = readImage< SliceImageType >( inputFileName2 );
+		} catch( itk::ExceptionObject & err ){
+			std::cerr << "ExceptionObject caught !" << std::endl;
+			std::cerr << err << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		SliceImageType::SizeType size = image1->GetLargestPossibleRegion().GetSize();
+		if (size != image2->GetLargestPossibleRegion().GetSize()){
+			std::cout << "slices have different sizes" << std::endl;
+			return EXIT_FAILURE;
+		}
+
+		auto stop = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
+		std::cout << duration.count() << " milliseconds for reading in the files"<<std::endl;
+
+		// maps share the geometry of the first slice
+		SliceImageType::Pointer nccMap = SliceImageType::New();
+		nccMap->CopyInformation( image1 );
+		nccMap->SetRegions( image1->GetLargestPossibleRegion() );
+		nccMap->Allocate();
+		SliceImageType::Pointer ssimMap = SliceImageType::New();
+		ssimMap->CopyInformation( image1 );
+		ssimMap->SetRegions( image1->GetLargestPossibleRegion() );
+		ssimMap->Allocate();
+
+		// SSIM's dynamic range L is the intensity range of both slices
+		const float dynamicRange = dataRange(image1->GetBufferPointer(), (size_t)size[0]*size[1], image2->GetBufferPointer());
+		std::cout << "dynamic range: " << dynamicRange << "\n";
+		SimilarityScores scores;
+		{
+			TraceSpan span("compute", "similarity maps");
+			span.setVoxels((double)size[0]*size[1]);
+			scores = computeSimilarityMaps(image1->GetBufferPointer(), image2->GetBufferPointer(),
+					size[0], size[1], radius, dynamicRange, nccMap->GetBufferPointer(), ssimMap->GetBufferPointer());
+		}
+
+		std::cout << "mean local NCC: " << scores.meanNCC << "\n";
+		std::cout << "mean local SSIM: " << scores.meanSSIM << "\n";
+		std::cout << "global NCC: " << scores.globalNCC << "\n";
+
+		stop = std::chrono::high_resolution_clock::now();
+		duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
+		std::cout << duration.count() << " milliseconds for computing the maps"<<std::endl;
+
+		try {
+			writeImage< SliceImageType >( nccMap, makeOutputFileName("", outputPrefix, "_NCC", ".nii.gz") );
+			writeImage< SliceImageType >( ssimMap, makeOutputFileName("", outputPrefix, "_SSIM", ".nii.gz") );
+			cache.store();
+		} catch ( itk::ExceptionObject & error ){
+			std::cerr << "Error: " << error << "\n";
+			return EXIT_FAILURE;
+		}
+
+		stop = std::chrono::high_resolution_clock::now();
+		duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
+		std::cout << duration.count() << " milliseconds for file written out succesfully\n"<<std::endl;
+		return EXIT_SUCCESS;
+	}
+
+	/********** VOLUME: EVERY CONSECUTIVE PAIR ALONG direction **********/
+
+	std::string inputFileName = makeInputFileName(filename1, type);
+	std::string outputPrefix = filename1 + "_" + std::to_string(direction);
+	std::cout << "filename: " << inputFileName << "\n";
+	OutputCache cache("SliceSimilarity", { mode, std::to_string(direction), std::to_string(radius) }, { inputFileName },
+		{ makeOutputFileName("", outputPrefix, "_NCC", ".nii.gz"), makeOutputFileName("", outputPrefix, "_SSIM", ".nii.gz") });
+	if (cache.restore()){ return EXIT_SUCCESS; }
+	std::cout << "direction: " << direction << "\n";
+
+	VolumeImageType::Pointer volume;
+	try{
+		// the volume and two maps, twice along x or y where they are transposed slice-major,
+		// plus eight doubles per pixel of a slice of moments on every worker thread
+		const VolumeImageType::RegionType largest = readLargestRegion< VolumeImageType >( inputFileName );
+		const double volumeBytes = regionBytes< VolumeImageType >( largest );
+		const double planePixels = volumeBytes/sizeof(imagePixelType)/std::max<uint64_t>(1, largest.GetSize()[direction]);
+		const int workers = std::max(1, std::min<int>(workerThreads(), (int)largest.GetSize()[direction] - 1));
+		requireMemory((direction != 2 ? 6.0 : 3.0)*volumeBytes + 64.0*planePixels*workers,
+			"the volume, its NCC and SSIM maps and the local moments");
+		volume = readImage< VolumeImageType >( inputFileName );
+	} catch( itk::ExceptionObject & err ){
+		std::cerr << "ExceptionObject caught !" << std::endl;
+		std::cerr << err << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	VolumeImageType::RegionType region = volume->GetLargestPossibleRegion();
+	VolumeImageType::SizeType size = region.GetSize();
+	if (size[direction] < 2){
+		std::cout << "need at least two slices along direction " << direction << std::endl;
+		return EXIT_FAILURE;
+	}
+
+	auto stop = std::chrono::high_resolution_clock::now();
+	auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
+	std::cout << duration.count() << " milliseconds for reading in the file"<<std::endl;
+
+	// in-slice axes are the other two, in increasing order
+	int order[3];
+	sliceMajorOrder(direction, order);
+	const int width = size[order[0]];
+	const int height = size[order[1]];
+	const int pairs = size[direction] - 1;
+	const size_t plane = (size_t)width*height;
+
+	// one map slice per pair, so the maps are one slice shorter than the input
+	VolumeImageType::RegionType mapRegion = region;
+	VolumeImageType::SizeType mapSize = size;
+	mapSize[direction] = pairs;
+	mapRegion.SetSize( mapSize );
+	VolumeImageType::Pointer nccMap = VolumeImageType::New();
+	nccMap->CopyInformation( volume );
+	nccMap->SetRegions( mapRegion );
+	nccMap->Allocate();
+	VolumeImageType::Pointer ssimMap = VolumeImageType::New();
+	ssimMap->CopyInformation( volume );
+	ssimMap->SetRegions( mapRegion );
+	ssimMap->Allocate();
+
+	// along x or y, work on a slice-major copy where every slice is one plane,
+	// the maps are made in that layout and transposed back at the end
+	const imagePixelType * in = volume->GetBufferPointer();
+	imagePixelType * nccOut = nccMap->GetBufferPointer();
+	imagePixelType * ssimOut = ssimMap->GetBufferPointer();
+	std::vector<imagePixelType> major, nccMajor, ssimMajor;
+	if (direction != 2){
+		const uint64_t volumeSize[3] = { size[0], size[1], size[2] };
+		major.resize(plane*size[direction]);
+		transposeBuffer(in, volumeSize, order, &major[0]);
+		nccMajor.resize(plane*pairs);
+		ssimMajor.resize(plane*pairs);
+		in = &major[0];
+		nccOut = &nccMajor[0];
+		ssimOut = &ssimMajor[0];
+	}
+
+	// one dynamic range L for the whole volume, so the SSIM of every pair is on one scale
+	const float dynamicRange = dataRange(volume->GetBufferPointer(), region.GetNumberOfPixels());
+	std::cout << "dynamic range: " << dynamicRange << "\n";
+
+	// pairs are independent, hand them out to worker threads
+	std::vector<SimilarityScores> scores(pairs);
+	std::atomic<int> nextPair(0);
+	auto worker = [&](){
+		for (int k = nextPair++; k < pairs; k = nextPair++){
+			TraceSpan span("compute", "similarity pair");
+			span.setVoxels(plane);
+			scores[k] = computeSimilarityMaps(in + k*plane, in + (k+1)*plane, width, height,
+					radius, dynamicRange, nccOut + k*plane, ssimOut + k*plane);
+		}
+	};
+	const int threads = std::max(1, std::min<int>(workerThreads(), pairs));
+	runWorkers(threads, worker);
+
+	if (direction != 2){
+		int inverse[3];
+		inverseOrder(order, inverse);
+		const uint64_t majorSize[3] = { (uint64_t)width, (uint64_t)height, (uint64_t)pairs };
+		transposeBuffer(&nccMajor[0], majorSize, inverse, nccMap->GetBufferPointer());
+		transposeBuffer(&ssimMajor[0], majorSize, inverse, ssimMap->GetBufferPointer());
+	}
+
+	stop = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
+	std::cout << duration.count() << " milliseconds for computing " << pairs << " pairs on " << threads << " threads"<<std::endl;
+
+	// flag pairs whose SSIM drops far below the typical pair (median - 3 * MAD)
+	std::vector<double> ssimScores(pairs);
+	for (int k = 0; k < pairs; ++k){ ssimScores[k] = scores[k].meanSSIM; }
+	std::vector<double> sorted = ssimScores;
+	std::nth_element(sorted.begin(), sorted.begin() + pairs/2, sorted.end());
+	const double median = sorted[pairs/2];
+	for (int k = 0; k < pairs; ++k){ sorted[k] = std::fabs(ssimScores[k] - median); }
+	std::nth_element(sorted.begin(), sorted.begin() + pairs/2, sorted.end());
+	// with more than half the pairs alike (blank or padded slices) MAD is 0 and every
+	// pair below the median would be flagged, so it is floored at 1% of the median
+	// (and 0.001, SSIM being within -1..1)
+	const double mad = std::max(sorted[pairs/2], std::max(0.01*std::fabs(median), 1e-3));
+	const double threshold = median - 3.0*1.4826*mad;
+
+	std::cout << "pair,meanNCC,meanSSIM,globalNCC,flag\n";
+	for (int k = 0; k < pairs; ++k){
+		std::cout << k << "-" << k+1 << "," << scores[k].meanNCC << "," << scores[k].meanSSIM << ","
+			<< scores[k].globalNCC << "," << (scores[k].meanSSIM < threshold ? "outlier" : "") << "\n";
+	}
+
+	try {
+		writeImage< VolumeImageType >( nccMap, makeOutputFileName("", outputPrefix, "_NCC", ".nii.gz") );
+		writeImage< VolumeImageType >( ssimMap, makeOutputFileName("", outputPrefix, "_SSIM", ".nii.gz") );
+		cache.store();
+	} catch ( itk::ExceptionObject & error ){
+		std::cerr << "Error: " << error << "\n";
+		return EXIT_FAILURE;
+	}
+
+	stop = std::chrono::high_resolution_clock::now();
+	duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
+	std::cout << duration.count() << " milliseconds for file written out succesfully\n"<<std::endl;
+	printPeakMemory(std::cout);
+	return EXIT_SUCCESS;
+}
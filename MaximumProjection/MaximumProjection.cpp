@@ -14,6 +14,13 @@
 #include "itkMaximumProjectionImageFilter.h"
 
 
+#include "FileNames.h"
+#include "ImageIO.h"
+#include "SliceSeries.h"
+#include "Trace.h"
+#include "MemoryBudget.h"
+#include "OutputCache.h"
+
 #include <string>
 #include <iostream>
 #include <chrono>
@@ -21,21 +28,23 @@
 
 using namespace itk;
 
-//helper functions
-std::string makeInputFileName (const std::string &filename, const std::string &filetype);
-std::string makeOutputFileName (const std::string &filename, const std::string &filetype, const int &direction);
-
 
 
 // 4 arguments:
-// 1 - filename
+// 1 - filename, or a series pattern like slice%03d
 // 2 - type
 // 3 - direction
+// 4 - series only, the slices as first:last
+// --mem-budget=<MB> anywhere: over it the volume is projected slab by slab
+// --threads=<n> anywhere: threads for ITK and our own loops, every core by default
+// ITKSCRIPTS_CACHE_DIR=<dir>: an unchanged input links the projection from the cache
 int main(int argc, char * argv []){
 
 	std::cout << "Starting maximum projection on slices"  << std::endl;
+	if (!takeMemoryBudget(argc, argv)){ return EXIT_FAILURE; }
+	if (!takeThreads(argc, argv)){ return EXIT_FAILURE; }
 
-	if (argc > 4){
+	if (argc > 5){
 		std::cout << "too many arguments" << std::endl;
 		return EXIT_FAILURE;
 	}
@@ -51,7 +60,7 @@ int main(int argc, char * argv []){
 	constexpr float intensityMinimum = 0.0;
 	constexpr float intensityMaximum = 255.0;
 	
-	if (argc == 4){
+	if (argc >= 4){
 		std::cout << "Accepted input arguments" << std::endl;
 		filename = argv[1];
 		type = argv[2];
@@ -65,29 +74,68 @@ int main(int argc, char * argv []){
 	}
 
 	std::string inputFileName = makeInputFileName(filename, type);	// input is assumed in ../data/
-	std::string outputFileName = makeOutputFileName(filename, type, direction);
+	std::string outputFileName = makeOutputFileName("proj_" + std::to_string(direction) + "_", filename, "", ".nii");
+
+	// a series is projected along z slice by slice, never assembled
+	if (isSeriesPattern(filename)){
+		const std::string range = (argc == 5) ? argv[4] : "0";
+		const std::size_t colon = range.find(":");
+		const int first = atoi(range.substr(0, colon).c_str());
+		const int last = (colon == std::string::npos) ? first : atoi(range.substr(colon+1).c_str());
+		if (direction != 2){
+			std::cout << "a series is projected along its slices, direction 2" << std::endl;
+			return EXIT_FAILURE;
+		}
+		outputFileName = makeOutputFileName("proj_2_", seriesFileName(filename, first) + "_" + std::to_string(last), "", ".nii");
+		OutputCache cache("MaximumProjection", { "series" }, seriesFileNames(inputFileName, first, last), { outputFileName });
+		if (cache.restore()){ return EXIT_SUCCESS; }
+		try {
+			SliceSeries< float > series( inputFileName, first, last );
+			writeImage< itk::Image< float, Dimension > >( series.maximum< itk::Image< float, Dimension > >( 0, series.slices() - 1 ), outputFileName );
+			cache.store();
+		} catch( itk::ExceptionObject & err ){
+			std::cerr << "ExceptionObject caught !" << std::endl;
+			std::cerr << err << std::endl;
+			return EXIT_FAILURE;
+		}
+		auto stop = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
+		std::cout << duration.count() << " milliseconds for the series projection written to " << outputFileName << std::endl;
+		printPeakMemory(std::cout);
+		return EXIT_SUCCESS;
+	}
 	
 
 	std::cout << "filename: " << inputFileName << "\n";
+	OutputCache cache("MaximumProjection", { std::to_string(direction) }, { inputFileName }, { outputFileName });
+	if (cache.restore()){ return EXIT_SUCCESS; }
 	
 	
 	// setting up reader type
 	using imagePixelType = float;						// float is ITK acceptable
 	using ImageType = itk::Image< imagePixelType, Dimension>;		// ImageType is used for both input and output
-	using ReaderType = itk::ImageFileReader< ImageType >;
 	
-	// Setting up writer
-	using WriterType = itk::ImageFileWriter< ImageType >;
-	WriterType::Pointer writer = WriterType::New();
-	writer->SetFileName( outputFileName );
-
-	// setting up image reader
-	ReaderType::Pointer reader = ReaderType::New();
-	reader->SetFileName( inputFileName );
+	// read image
+	ImageType::Pointer image;
 	
-	// retrieve image with Update()
+	// retrieve image, shared memory cache aware. A volume over the memory budget
+	// is never held, it is read and projected slab by slab.
   	try{
-    		reader->Update();
+		if (direction < 0 || direction > 2){ itkGenericExceptionMacro(<< "direction must be 0, 1 or 2"); }
+		const ImageType::RegionType largest = readLargestRegion< ImageType >( inputFileName );
+		const double volumeBytes = regionBytes< ImageType >( largest );
+		if (!fitsMemoryBudget(volumeBytes + volumeBytes/largest.GetSize()[direction])){
+			std::cout << "the " << megabytes(volumeBytes) << " volume is over the " << megabytes(memoryBudget())
+				<< " memory budget, projecting slab by slab" << std::endl;
+			writeImage< ImageType >( readMaximumProjection< ImageType >( inputFileName, direction, memoryBudget() ), outputFileName );
+			cache.store();
+			auto stop = std::chrono::high_resolution_clock::now();
+			auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
+			std::cout << duration.count() << " milliseconds for file written out succesfully\n"<<std::endl;
+			printPeakMemory(std::cout);
+			return EXIT_SUCCESS;
+		}
+    		image = readImage< ImageType >( inputFileName );
 	} catch( itk::ExceptionObject & err ){
     		std::cerr << "ExceptionObject caught !" << std::endl;
     		std::cerr << err << std::endl;
@@ -102,16 +150,19 @@ int main(int argc, char * argv []){
 	
 	using ProjectionType = itk::MaximumProjectionImageFilter< ImageType , ImageType >;
 	ProjectionType::Pointer projection = ProjectionType::New();
-	projection->SetInput( reader->GetOutput() );
+	projection->SetInput( image );
 	projection->SetProjectionDimension( direction );
 	std::cout << "GetProjectionDimension(): " << projection->GetProjectionDimension() << "\n";
 	
-	// write out image
-	writer->SetInput( projection->GetOutput() );
-	writer->SetUseCompression(true);
-	
+	// write out image, .nii.gz is compressed on all cores
 	try {
-	writer->Update();
+	{
+		TraceSpan span("compute", "maximum projection");
+		span.setVoxels(image->GetBufferedRegion().GetNumberOfPixels());
+		projection->Update();
+	}
+	writeImage< ImageType >( projection->GetOutput(), outputFileName );
+	cache.store();
 	} catch ( itk::ExceptionObject & error ){
 	std::cerr << "Error: " << error << "\n";
 	return EXIT_FAILURE;
@@ -121,22 +172,6 @@ int main(int argc, char * argv []){
 	stop = std::chrono::high_resolution_clock::now();
 	duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
 	std::cout << duration.count() << " milliseconds for file written out succesfully\n"<<std::endl;
+	printPeakMemory(std::cout);
 	return EXIT_SUCCESS;
 }
-
-//Creating the input file name for a nifti
-std::string makeInputFileName (const std::string &filename, const std::string &inputType){
-	std::string inputFileName = "../data/";
-	inputFileName.append(filename);
-	inputFileName.append(inputType);
-	return inputFileName;
-}
-
-
-std::string makeOutputFileName (const std::string &filename, const std::string &filetype, const int &direction){
-	std::string OutputFileName = "../output/";
-	OutputFileName.append("proj_").append(std::to_string(direction)).append("_").append(filename);
-	OutputFileName.append(".nii");
-	return OutputFileName;
-}
-
@@ -12,6 +12,15 @@
 #include "itkImageFileWriter.h"
 
 
+#include "FileNames.h"
+#include "ImageIO.h"
+#include "SliceSeries.h"
+#include "StagedExecutor.h"
+#include "Trace.h"
+#include "PerfCounters.h"
+#include "MemoryBudget.h"
+#include "OutputCache.h"
+
 #include <string>
 #include <iostream>
 #include <chrono>
@@ -19,23 +28,25 @@
 
 using namespace itk;
 
-//helper functions
-std::string makeInputFileName (const std::string &filename, const std::string &filetype);
-std::string makeOutputFileName (const std::string &filename, const std::string &filetype);
-
 
 
 // 6 arguments:
-// 1 - filename
+// 1 - filename, or a series pattern like slice%03d
 // 2 - type
 // 3 - x
 // 4 - y
 // 5 - step
+// 6 - series only, the slices as first:last
+// --mem-budget=<MB> anywhere: stop before reading when the image does not fit
+// --threads=<n> anywhere: threads for ITK and our own loops, every core by default
+// ITKSCRIPTS_CACHE_DIR=<dir>: unchanged inputs link the normalized images from the cache
 int main(int argc, char * argv []){
 
 	std::cout << "Starting histogram filter on slices"  << std::endl;
+	if (!takeMemoryBudget(argc, argv)){ return EXIT_FAILURE; }
+	if (!takeThreads(argc, argv)){ return EXIT_FAILURE; }
 
-	if (argc > 6){
+	if (argc > 7){
 		std::cout << "too many arguments" << std::endl;
 		return EXIT_FAILURE;
 	}
@@ -51,7 +62,7 @@ int main(int argc, char * argv []){
 	constexpr float intensityMinimum = 0.0;
 	constexpr float intensityMaximum = 255.0;
 	
-	if (argc == 6){
+	if (argc >= 6){
 		std::cout << "Accepted input arguments" << std::endl;
 		filename = argv[1];
 		type = argv[2];
@@ -69,33 +80,93 @@ int main(int argc, char * argv []){
 	}
 	//timing
 
+	/********** SERIES: NORMALIZE EVERY SLICE IN first:last **********/
+
+	if (isSeriesPattern(filename)){
+		const std::string range = (argc == 7) ? argv[6] : "0";
+		const std::size_t colon = range.find(":");
+		const int first = atoi(range.substr(0, colon).c_str());
+		const int last = (colon == std::string::npos) ? first : atoi(range.substr(colon+1).c_str());
+		std::vector<std::string> outputs;
+		for (int k = first; k <= last; ++k){ outputs.push_back(makeOutputFileName("", seriesFileName(filename, k), "_Norm", type)); }
+		OutputCache cache("NormalizeIntense", { "series", std::to_string(x), std::to_string(y), std::to_string(step) },
+			seriesFileNames(makeInputFileName(filename, type), first, last), outputs);
+		if (cache.restore()){ return EXIT_SUCCESS; }
+		try {
+			// every slice is used once, nothing to gain from keeping decoded slices around
+			SliceSeries< float > series( makeInputFileName(filename, type), first, last, 1 );
+			using SliceImageType = itk::Image< float, Dimension >;
+			struct SliceItem {
+				SliceImageType::Pointer image;
+			};
+			std::vector<RegionStatistics> stats(series.slices());
+
+			// decode, normalize and encode overlap, on separate threads
+			StagedExecutor< SliceItem > executor;
+			executor.addStage("read", 2, [&](std::size_t k, SliceItem &item){
+				const std::shared_ptr<const SliceSeries< float >::SliceBuffer> buffer = series.slice(k);
+				item.image = materializeSlice< SliceImageType >( series.view(*buffer, k) );
+			});
+			executor.addStage("normalize", 1, [&](std::size_t k, SliceItem &item){
+				const SliceView<float> slice = imageView(item.image.GetPointer()).slice(2, 0);
+				if ((x-step) < 0 || (x+step) >= (int)slice.size[0]){ itkGenericExceptionMacro(<< "step is out of bound x"); }
+				if ((y-step) < 0 || (y+step) >= (int)slice.size[1]){ itkGenericExceptionMacro(<< "step is out of bound y"); }
+				stats[k] = viewStatistics(slice.window(x-step, y-step, 2*step+1, 2*step+1));
+				const double mean = stats[k].sum/stats[k].count;
+				const double stdDev = std::sqrt((stats[k].squareSum - stats[k].sum*mean)/(stats[k].count - 1));
+				viewRemap(slice, [&](float curPix){ return (curPix-mean)/stdDev; });
+			});
+			executor.addStage("write", 2, [&](std::size_t k, SliceItem &item){
+				writeImage< SliceImageType >( item.image, outputs[k], false );
+			});
+			executor.run(series.slices());
+			executor.report(std::cout);
+			cache.store();
+
+			for (std::size_t k = 0; k < series.slices(); ++k){
+				const double mean = stats[k].sum/stats[k].count;
+				std::cout << first + k << " mean: " << mean << " std.dev.: "
+					<< std::sqrt((stats[k].squareSum - stats[k].sum*mean)/(stats[k].count - 1)) << "\n";
+			}
+		} catch( itk::ExceptionObject & err ){
+			std::cerr << "ExceptionObject caught !" << std::endl;
+			std::cerr << err << std::endl;
+			return EXIT_FAILURE;
+		}
+		auto stop = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
+		std::cout << duration.count() << " milliseconds for the series"<<std::endl;
+		printPeakMemory(std::cout);
+		return EXIT_SUCCESS;
+	}
+	if (argc == 7){
+		std::cout << "a slice range needs a series pattern like slice%03d" << std::endl;
+		return EXIT_FAILURE;
+	}
+
 	std::string inputFileName = makeInputFileName(filename, type);	// input is assumed in ../data/
-	std::string outputFileName = makeOutputFileName(filename, type);
+	std::string outputFileName = makeOutputFileName("", filename, "_Norm", type);
 	
 
 	std::cout << "x: " << x << "\n";
 	std::cout << "y: " << y << "\n";
 	std::cout << "step: " << step << "\n";
 	std::cout << "filename: " << inputFileName << "\n";
+	OutputCache cache("NormalizeIntense", { std::to_string(x), std::to_string(y), std::to_string(step) }, { inputFileName }, { outputFileName });
+	if (cache.restore()){ return EXIT_SUCCESS; }
 	
 	
 	// setting up reader type
 	using imagePixelType = float;						// float is ITK acceptable
 	using ImageType = itk::Image< imagePixelType, Dimension>;		// ImageType is used for both input and output
-	using ReaderType = itk::ImageFileReader< ImageType >;
 	
-	// Setting up writer
-	using WriterType = itk::ImageFileWriter< ImageType >;
-	WriterType::Pointer writer = WriterType::New();
-	writer->SetFileName( outputFileName );
-
-	// setting up image reader
-	ReaderType::Pointer reader = ReaderType::New();
-	reader->SetFileName( inputFileName );
+	// read image
+	ImageType::Pointer image;
 	
-	// retrieve image with Update()
+	// retrieve image, shared memory cache aware
   	try{
-    		reader->Update();
+		requireMemory(imageFileBytes< ImageType >( inputFileName ), "the image as float");
+    		image = readImage< ImageType >( inputFileName );
 	} catch( itk::ExceptionObject & err ){
     		std::cerr << "ExceptionObject caught !" << std::endl;
     		std::cerr << err << std::endl;
@@ -108,7 +179,6 @@ int main(int argc, char * argv []){
 	std::cout << duration.count() << " milliseconds for reading in the file and creating constants"<<std::endl;
 
 	// get image and region
-	ImageType::Pointer image = reader->GetOutput();
 	ImageType::RegionType region = image->GetLargestPossibleRegion();
 	ImageType::SizeType size = region.GetSize();
 	int width = size[0];
@@ -162,20 +232,29 @@ int main(int argc, char * argv []){
 	std::cout << duration.count() << " milliseconds for calculating mean and standard deviation"<<std::endl;
 
 	// setting the pixel values
-	for (int i = 0; i < width; ++i){
-		for(int j = 0; j < height; ++j){
-			ImageType::IndexType index = {{ i , j }};
-			imagePixelType curPix = image->GetPixel(index);
-			image->SetPixel( index, ((curPix-mean)/stdDev) );
+	PerfCounters counters;				// ITKSCRIPTS_PERF=1 to count
+	counters.start();
+	{
+		TraceSpan span("compute", "normalize");
+		span.setVoxels((double)width*height);
+		for (int i = 0; i < width; ++i){
+			for(int j = 0; j < height; ++j){
+				ImageType::IndexType index = {{ i , j }};
+				imagePixelType curPix = image->GetPixel(index);
+				image->SetPixel( index, ((curPix-mean)/stdDev) );
+			}
 		}
 	}
+	if (counters.available()){
+		std::cout << "normalized " << width*height << " pixels"
+			<< describePerfSample(counters.stop(), 2.0*width*height*sizeof(imagePixelType)) << std::endl;
+	}
 	
 	
 	// write out image
-	writer->SetInput( image );
-	
 	try {
-	writer->Update();
+	writeImage< ImageType >( image, outputFileName, false );
+	cache.store();
 	} catch ( itk::ExceptionObject & error ){
 	std::cerr << "Error: " << error << "\n";
 	return EXIT_FAILURE;
@@ -185,23 +264,6 @@ int main(int argc, char * argv []){
 	stop = std::chrono::high_resolution_clock::now();
 	duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
 	std::cout << duration.count() << " milliseconds for file written out succesfully\n"<<std::endl;
+	printPeakMemory(std::cout);
 	return EXIT_SUCCESS;
 }
-
-//Creating the input file name for a nifti
-std::string makeInputFileName (const std::string &filename, const std::string &inputType){
-	std::string inputFileName = "../data/";
-	inputFileName.append(filename);
-	inputFileName.append(inputType);
-	return inputFileName;
-}
-
-
-std::string makeOutputFileName (const std::string &filename, const std::string &filetype){
-	std::string OutputFileName = "../output/";
-	OutputFileName.append(filename);
-	OutputFileName.append("_").append("Norm");
-	OutputFileName.append(filetype);
-	return OutputFileName;
-}
-
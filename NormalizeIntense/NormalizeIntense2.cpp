@@ -12,6 +12,12 @@
 #include "itkImageFileWriter.h"
 
 
+#include "FileNames.h"
+#include "ImageIO.h"
+#include "Trace.h"
+#include "MemoryBudget.h"
+#include "OutputCache.h"
+
 #include <string>
 #include <iostream>
 #include <chrono>
@@ -19,10 +25,6 @@
 
 using namespace itk;
 
-//helper functions
-std::string makeInputFileName (const std::string &filename, const std::string &filetype);
-std::string makeOutputFileName (const std::string &filename, const std::string &filetype);
-
 
 
 // 5 arguments:
@@ -31,9 +33,14 @@ std::string makeOutputFileName (const std::string &filename, const std::string &
 // 3 - x
 // 4 - y
 // 5 - step
+// --mem-budget=<MB> anywhere: stop before reading when the image does not fit
+// --threads=<n> anywhere: threads for ITK and our own loops, every core by default
+// ITKSCRIPTS_CACHE_DIR=<dir>: an unchanged input links the normalized image from the cache
 int main(int argc, char * argv []){
 
 	std::cout << "Starting histogram filter on slices"  << std::endl;
+	if (!takeMemoryBudget(argc, argv)){ return EXIT_FAILURE; }
+	if (!takeThreads(argc, argv)){ return EXIT_FAILURE; }
 
 	if (argc > 6){
 		std::cout << "too many arguments" << std::endl;
@@ -70,32 +77,28 @@ int main(int argc, char * argv []){
 	//timing
 
 	std::string inputFileName = makeInputFileName(filename, type);	// input is assumed in ../data/
-	std::string outputFileName = makeOutputFileName(filename, type);
+	std::string outputFileName = makeOutputFileName("", filename, "_Norm", type);
 	
 
 	std::cout << "x: " << x << "\n";
 	std::cout << "y: " << y << "\n";
 	std::cout << "step: " << step << "\n";
 	std::cout << "filename: " << inputFileName << "\n";
+	OutputCache cache("NormalizeIntense2", { std::to_string(x), std::to_string(y), std::to_string(step) }, { inputFileName }, { outputFileName });
+	if (cache.restore()){ return EXIT_SUCCESS; }
 	
 	
 	// setting up reader type
 	using imagePixelType = float;						// float is ITK acceptable
 	using ImageType = itk::Image< imagePixelType, Dimension>;		// ImageType is used for both input and output
-	using ReaderType = itk::ImageFileReader< ImageType >;
 	
-	// Setting up writer
-	using WriterType = itk::ImageFileWriter< ImageType >;
-	WriterType::Pointer writer = WriterType::New();
-	writer->SetFileName( outputFileName );
-
-	// setting up image reader
-	ReaderType::Pointer reader = ReaderType::New();
-	reader->SetFileName( inputFileName );
+	// read image
+	ImageType::Pointer image;
 	
-	// retrieve image with Update()
+	// retrieve image, shared memory cache aware
   	try{
-    		reader->Update();
+		requireMemory(imageFileBytes< ImageType >( inputFileName ), "the image as float");
+    		image = readImage< ImageType >( inputFileName );
 	} catch( itk::ExceptionObject & err ){
     		std::cerr << "ExceptionObject caught !" << std::endl;
     		std::cerr << err << std::endl;
@@ -108,7 +111,6 @@ int main(int argc, char * argv []){
 	std::cout << duration.count() << " milliseconds for reading in the file and creating constants"<<std::endl;
 
 	// get image and region
-	ImageType::Pointer image = reader->GetOutput();
 	ImageType::RegionType region = image->GetLargestPossibleRegion();
 	ImageType::SizeType size = region.GetSize();
 	int width = size[0];
@@ -162,21 +164,23 @@ int main(int argc, char * argv []){
 	std::cout << duration.count() << " milliseconds for calculating mean and standard deviation"<<std::endl;
 
 	// setting the pixel values
-	for (int i = 0; i < width; ++i){
-		for(int j = 0; j < height; ++j){
-			ImageType::IndexType index = {{ i , j }};
-			imagePixelType curPix = image->GetPixel(index);
-			image->SetPixel( index, ((curPix-mean)/stdDev) );
+	{
+		TraceSpan span("compute", "normalize");
+		span.setVoxels((double)width*height);
+		for (int i = 0; i < width; ++i){
+			for(int j = 0; j < height; ++j){
+				ImageType::IndexType index = {{ i , j }};
+				imagePixelType curPix = image->GetPixel(index);
+				image->SetPixel( index, ((curPix-mean)/stdDev) );
+			}
 		}
 	}
 	
 	
 	// write out image
-	writer->SetInput( image );
-	writer->SetUseCompression(true);
-	
 	try {
-	writer->Update();
+	writeImage< ImageType >( image, outputFileName );
+	cache.store();
 	} catch ( itk::ExceptionObject & error ){
 	std::cerr << "Error: " << error << "\n";
 	return EXIT_FAILURE;
@@ -186,23 +190,6 @@ int main(int argc, char * argv []){
 	stop = std::chrono::high_resolution_clock::now();
 	duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
 	std::cout << duration.count() << " milliseconds for file written out succesfully\n"<<std::endl;
+	printPeakMemory(std::cout);
 	return EXIT_SUCCESS;
 }
-
-//Creating the input file name for a nifti
-std::string makeInputFileName (const std::string &filename, const std::string &inputType){
-	std::string inputFileName = "../data/";
-	inputFileName.append(filename);
-	inputFileName.append(inputType);
-	return inputFileName;
-}
-
-
-std::string makeOutputFileName (const std::string &filename, const std::string &filetype){
-	std::string OutputFileName = "../output/";
-	OutputFileName.append(filename);
-	OutputFileName.append("_").append("Norm");
-	OutputFileName.append(filetype);
-	return OutputFileName;
-}
-
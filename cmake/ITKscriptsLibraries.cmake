@@ -0,0 +1,36 @@
+# Libraries every script links next to ITK, collected in ITKSCRIPTS_LIBRARIES.
+# zstd and LZ4 are optional codecs for .isv volumes, zlib comes with ITK.
+
+find_package(Threads REQUIRED)
+set(ITKSCRIPTS_LIBRARIES ${CMAKE_THREAD_LIBS_INIT})
+
+# trace spans (include/Trace.h) cost nothing unless compiled in with -DITKSCRIPTS_TRACE=ON
+option(ITKSCRIPTS_TRACE "Compile trace spans into the scripts" OFF)
+if (ITKSCRIPTS_TRACE)
+	add_definitions(-DITKSCRIPTS_TRACE)
+	message("trace spans compiled in, set ITKSCRIPTS_TRACE_FILE to record")
+endif()
+
+# shm_open lives in librt on older glibc
+find_library(RT_LIBRARY rt)
+if (RT_LIBRARY)
+	list(APPEND ITKSCRIPTS_LIBRARIES ${RT_LIBRARY})
+endif()
+
+find_path(ZSTD_INCLUDE_DIR zstd.h)
+find_library(ZSTD_LIBRARY NAMES zstd)
+if (ZSTD_INCLUDE_DIR AND ZSTD_LIBRARY)
+	add_definitions(-DITKSCRIPTS_HAVE_ZSTD)
+	include_directories(${ZSTD_INCLUDE_DIR})
+	list(APPEND ITKSCRIPTS_LIBRARIES ${ZSTD_LIBRARY})
+	message("zstd found for .isv volumes")
+endif()
+
+find_path(LZ4_INCLUDE_DIR lz4.h)
+find_library(LZ4_LIBRARY NAMES lz4)
+if (LZ4_INCLUDE_DIR AND LZ4_LIBRARY)
+	add_definitions(-DITKSCRIPTS_HAVE_LZ4)
+	include_directories(${LZ4_INCLUDE_DIR})
+	list(APPEND ITKSCRIPTS_LIBRARIES ${LZ4_LIBRARY})
+	message("LZ4 found for .isv volumes")
+endif()
@@ -0,0 +1,106 @@
+// File name: 	BatchJournal.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: What a batch has finished, so a batch that was killed or preempted
+// 		picks up where it stopped. One line per finished job (the manifest
+// 		command: script, volume, slices, with its XXH64), appended to
+// 		<manifest>.journal only once the job's outputs are renamed into place
+// 		and synced, and synced itself before the job counts as done. A line cut
+// 		short by a crash does not match its hash and is left out.
+
+#ifndef ITKSCRIPTS_BATCHJOURNAL_H
+#define ITKSCRIPTS_BATCHJOURNAL_H
+
+#include "itkImage.h"
+
+#include "ContentHash.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <set>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+
+// flush path (a file or a directory) to the disk, false when it cannot be opened
+inline bool syncPath (const std::string &path, bool directory = false){
+	const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | (directory ? O_DIRECTORY : 0));
+	if (fd < 0){ return false; }
+	const bool ok = fsync(fd) == 0;
+	close(fd);
+	return ok;
+}
+
+class BatchJournal {
+public:
+	explicit BatchJournal (const std::string &path) : m_Path(path) {
+		std::ifstream in(path.c_str(), std::ios::binary);
+		std::string text((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+		std::size_t begin = 0;
+		for (std::size_t end; (end = text.find('\n', begin)) != std::string::npos; begin = end + 1){
+			const std::string line = text.substr(begin, end - begin);
+			const std::size_t tab = line.rfind('\t');
+			if (line.empty() || line[0] == '#' || tab == std::string::npos){ continue; }
+			const std::string command = line.substr(0, tab);
+			if (line.substr(tab + 1) == hexHash(xxh64(command.data(), command.size()))){ m_Done.insert(command); }
+		}
+
+		m_File = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if (m_File < 0){ itkGenericExceptionMacro(<< "cannot open the batch journal " << path << ": " << std::strerror(errno)); }
+		// a torn last line ends here, the next job starts on a line of its own
+		const std::string start = text.empty() ? "# finished jobs, delete this file to run them again\n"
+			: (text[text.size() - 1] != '\n') ? "\n" : "";
+		if (!start.empty() && (write(m_File, start.data(), start.size()) != (ssize_t)start.size() || fdatasync(m_File) != 0)){
+			close(m_File);
+			itkGenericExceptionMacro(<< "cannot write the batch journal " << path);
+		}
+	}
+
+	~BatchJournal (){ close(m_File); }
+
+	const std::string & path () const { return m_Path; }
+
+	// finished by an earlier run, and its outputs are all still there
+	bool done (const std::string &command, const std::vector<std::string> &outputs) const {
+		if (m_Done.count(command) == 0){ return false; }
+		struct stat info;
+		for (const std::string &output : outputs){
+			if (stat(output.c_str(), &info) != 0){ return false; }
+		}
+		return true;
+	}
+
+	// command finished: its outputs (and their directories, for the renames) go to
+	// the disk first, then the line, so the journal never names an output it may lose
+	void record (const std::string &command, const std::vector<std::string> &outputs){
+		for (const std::string &output : outputs){
+			const std::size_t slash = output.find_last_of('/');
+			if (!syncPath(output) || !syncPath(slash == std::string::npos ? "." : output.substr(0, slash + 1), true)){
+				itkGenericExceptionMacro(<< "cannot sync " << output << " to the disk");
+			}
+		}
+		const std::string line = command + "\t" + hexHash(xxh64(command.data(), command.size())) + "\n";
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		if (write(m_File, line.data(), line.size()) != (ssize_t)line.size() || fdatasync(m_File) != 0){
+			itkGenericExceptionMacro(<< "cannot write the batch journal " << m_Path);
+		}
+		m_Done.insert(command);
+	}
+
+private:
+	BatchJournal (const BatchJournal &) = delete;
+	BatchJournal & operator= (const BatchJournal &) = delete;
+
+	std::string m_Path;
+	int m_File;
+	std::set<std::string> m_Done;
+	std::mutex m_Mutex;
+};
+
+#endif
@@ -0,0 +1,167 @@
+// File name: 	Benchmark.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: A small benchmark harness in the manner of Google Benchmark, without
+// 		the dependency. Every benchmark is run once to warm up, then in a number
+// 		of repetitions of enough iterations to last the minimum time; the median
+// 		repetition is reported as wall and CPU time per iteration, bytes/s and
+// 		voxels/s, as a table and optionally as JSON.
+
+#ifndef ITKSCRIPTS_BENCHMARK_H
+#define ITKSCRIPTS_BENCHMARK_H
+
+#include <ctime>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <chrono>
+#include <ostream>
+#include <algorithm>
+
+// keeps the compiler from dropping a result nobody reads
+template< typename T >
+inline void benchmarkKeep (const T &value){
+	asm volatile("" : : "r,m"(value) : "memory");
+}
+
+inline double processCpuSeconds (){
+	timespec now;
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+	return now.tv_sec + 1e-9*now.tv_nsec;
+}
+
+// "--name=value" into value, false for any other argument
+inline bool benchmarkFlag (const std::string &argument, const char * name, std::string &value){
+	const std::string prefix = std::string("--") + name + "=";
+	if (argument.compare(0, prefix.size(), prefix) != 0){ return false; }
+	value = argument.substr(prefix.size());
+	return true;
+}
+
+inline std::string jsonString (const std::string &text){
+	std::string quoted = "\"";
+	for (char c : text){
+		if (c == '"' || c == '\\'){ quoted += '\\'; quoted += c; }
+		else if ((unsigned char)c < 0x20){
+			char escaped[8];
+			std::snprintf(escaped, sizeof(escaped), "\\u%04x", (unsigned char)c);
+			quoted += escaped;
+		} else { quoted += c; }
+	}
+	return quoted + "\"";
+}
+
+struct BenchmarkResult {
+	std::string name;
+	std::size_t iterations;	// per repetition
+	double realTime, cpuTime;	// seconds per iteration, median repetition
+	double fastest;	// seconds per iteration, fastest repetition
+	double bytes, voxels;	// touched per iteration
+};
+
+class BenchmarkSuite {
+public:
+	BenchmarkSuite (double minTime = 0.5, unsigned int repetitions = 5)
+		: m_MinTime(minTime), m_Repetitions(std::max(1u, repetitions)) {}
+
+	// only benchmarks whose name contains filter run
+	void setFilter (const std::string &filter){ m_Filter = filter; }
+
+	void add (const std::string &name, double bytes, double voxels, std::function<void ()> body){
+		if (name.find(m_Filter) == std::string::npos){ return; }
+		Benchmark benchmark;
+		benchmark.name = name;
+		benchmark.bytes = bytes;
+		benchmark.voxels = voxels;
+		benchmark.body = body;
+		m_Benchmarks.push_back(benchmark);
+	}
+
+	// run everything added, one table line per benchmark as it finishes
+	std::vector<BenchmarkResult> run (std::ostream &table){
+		std::vector<BenchmarkResult> results;
+		std::size_t width = 9;
+		for (const Benchmark &benchmark : m_Benchmarks){ width = std::max(width, benchmark.name.size()); }
+		table << pad("benchmark", width) << "      ms/iter     cpu ms/iter   iterations        GB/s    Mvoxels/s\n";
+		for (const Benchmark &benchmark : m_Benchmarks){
+			// warm up, then size the repetitions from one timed call
+			benchmark.body();
+			auto begin = std::chrono::steady_clock::now();
+			benchmark.body();
+			const double once = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+			const double target = m_MinTime/m_Repetitions;
+			const std::size_t iterations = (once >= target) ? 1 : (std::size_t)std::ceil(target/std::max(once, 1e-9));
+
+			std::vector< std::pair<double, double> > repetitions;	// (real, cpu) per iteration
+			for (unsigned int r = 0; r < m_Repetitions; ++r){
+				const double cpu = processCpuSeconds();
+				begin = std::chrono::steady_clock::now();
+				for (std::size_t i = 0; i < iterations; ++i){ benchmark.body(); }
+				const double real = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+				repetitions.push_back(std::make_pair(real/iterations, (processCpuSeconds() - cpu)/iterations));
+			}
+			std::sort(repetitions.begin(), repetitions.end());
+
+			BenchmarkResult result;
+			result.name = benchmark.name;
+			result.iterations = iterations;
+			result.realTime = repetitions[repetitions.size()/2].first;
+			result.cpuTime = repetitions[repetitions.size()/2].second;
+			result.fastest = repetitions[0].first;
+			result.bytes = benchmark.bytes;
+			result.voxels = benchmark.voxels;
+			results.push_back(result);
+
+			char line[128];
+			std::snprintf(line, sizeof(line), " %12.3f %15.3f %12zu %11.3f %12.1f\n", 1e3*result.realTime, 1e3*result.cpuTime,
+				iterations, result.bytes/result.realTime/1e9, result.voxels/result.realTime/1e6);
+			table << pad(result.name, width) << line << std::flush;
+		}
+		return results;
+	}
+
+	// Google Benchmark's JSON layout, so its compare.py can diff two runs
+	static void writeJson (std::ostream &out, const std::vector<BenchmarkResult> &results,
+			const std::vector< std::pair<std::string, std::string> > &context){
+		out << "{\n  \"context\": {";
+		for (std::size_t c = 0; c < context.size(); ++c){
+			out << (c ? "," : "") << "\n    " << jsonString(context[c].first) << ": " << jsonString(context[c].second);
+		}
+		out << "\n  },\n  \"benchmarks\": [";
+		for (std::size_t b = 0; b < results.size(); ++b){
+			const BenchmarkResult &result = results[b];
+			out << (b ? "," : "") << "\n    {"
+				<< "\"name\": " << jsonString(result.name)
+				<< ", \"iterations\": " << result.iterations
+				<< ", \"real_time\": " << 1e9*result.realTime
+				<< ", \"cpu_time\": " << 1e9*result.cpuTime
+				<< ", \"fastest_time\": " << 1e9*result.fastest
+				<< ", \"time_unit\": \"ns\""
+				<< ", \"bytes_per_second\": " << result.bytes/result.realTime
+				<< ", \"items_per_second\": " << result.voxels/result.realTime << "}";
+		}
+		out << "\n  ]\n}\n";
+	}
+
+private:
+	struct Benchmark {
+		std::string name;
+		double bytes, voxels;
+		std::function<void ()> body;
+	};
+
+	static std::string pad (const std::string &text, std::size_t width){
+		return text + std::string(width > text.size() ? width - text.size() : 0, ' ');
+	}
+
+	double m_MinTime;
+	unsigned int m_Repetitions;
+	std::string m_Filter;
+	std::vector<Benchmark> m_Benchmarks;
+};
+
+#endif
@@ -0,0 +1,576 @@
+// File name: 	ChunkedVolume.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: .isv, our own container for intermediate volumes. The volume is cut
+// 		into chunks that are compressed independently (zstd, LZ4 or zlib,
+// 		whatever the build found), on all cores, after a byte shuffle that
+// 		puts the same byte of every voxel together. Geometry is kept in full,
+// 		so `read x.isv + write x.nii.gz` exports without losing anything.
+// 		Chunks are 64^3 bricks by default, so a slice along any axis, a slab
+// 		or an ROI only inflates the bricks it touches. Whole z slabs are
+// 		still available for volumes that are only ever read whole.
+//
+// 		Layout (native byte order):
+// 		  ChunkedVolumeHeader
+// 		  chunkCount x ChunkEntry (offset, bytes), chunks in x, y, z order
+// 		  chunk data, each chunk is its box of voxels, x fastest
+
+#ifndef ITKSCRIPTS_CHUNKEDVOLUME_H
+#define ITKSCRIPTS_CHUNKEDVOLUME_H
+
+#include "itkImage.h"
+#include "itk_zlib.h"
+
+#include "WorkerThreads.h"
+#include "Trace.h"
+#include "FileNames.h"
+
+#ifdef ITKSCRIPTS_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef ITKSCRIPTS_HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+constexpr uint64_t chunkedVolumeMagic = 0x3156534953544b49ULL;	// "IKTSISV1"
+constexpr std::size_t chunkedVolumeTargetBytes = 4 << 20;		// z slab size
+constexpr uint32_t chunkedVolumeBrick = 64;				// default brick edge
+
+enum ChunkCodec : uint32_t {
+	codecRaw = 0,
+	codecZlib = 1,
+	codecLz4 = 2,
+	codecZstd = 3
+};
+
+struct ChunkedVolumeHeader {
+	uint64_t magic;
+	uint32_t dimension;
+	uint32_t pixelCode;
+	uint32_t pixelSize;
+	uint32_t codec;
+	uint32_t chunk[3];		// chunk extent, edge chunks are clipped
+	uint32_t shuffled;
+	uint64_t size[3];
+	double spacing[3];
+	double origin[3];
+	double direction[9];
+	uint64_t chunkCount;
+};
+
+struct ChunkEntry {
+	uint64_t offset;
+	uint64_t bytes;
+};
+
+/********** PIXEL TYPES **********/
+
+template< typename T > struct ChunkedPixel;
+template<> struct ChunkedPixel< unsigned char > { static const uint32_t code = 1; };
+template<> struct ChunkedPixel< signed char > { static const uint32_t code = 2; };
+template<> struct ChunkedPixel< char > { static const uint32_t code = 2; };
+template<> struct ChunkedPixel< unsigned short > { static const uint32_t code = 3; };
+template<> struct ChunkedPixel< short > { static const uint32_t code = 4; };
+template<> struct ChunkedPixel< unsigned int > { static const uint32_t code = 5; };
+template<> struct ChunkedPixel< int > { static const uint32_t code = 6; };
+template<> struct ChunkedPixel< float > { static const uint32_t code = 7; };
+template<> struct ChunkedPixel< double > { static const uint32_t code = 8; };
+
+template< typename TStored, typename TPixel >
+void convertStoredRow (const unsigned char * in, std::size_t count, TPixel * out){
+	for (std::size_t i = 0; i < count; ++i){
+		TStored value;
+		std::memcpy(&value, in + i*sizeof(TStored), sizeof(TStored));
+		out[i] = static_cast<TPixel>(value);
+	}
+}
+
+// count voxels of the stored type to TPixel
+template< typename TPixel >
+void convertStoredVoxels (uint32_t pixelCode, const unsigned char * in, std::size_t count, TPixel * out){
+	switch (pixelCode){
+		case 1: convertStoredRow< unsigned char >(in, count, out); break;
+		case 2: convertStoredRow< signed char >(in, count, out); break;
+		case 3: convertStoredRow< unsigned short >(in, count, out); break;
+		case 4: convertStoredRow< short >(in, count, out); break;
+		case 5: convertStoredRow< unsigned int >(in, count, out); break;
+		case 6: convertStoredRow< int >(in, count, out); break;
+		case 7: convertStoredRow< float >(in, count, out); break;
+		case 8: convertStoredRow< double >(in, count, out); break;
+	}
+}
+
+inline uint32_t storedPixelSize (uint32_t pixelCode){
+	static const uint32_t sizes[] = { 0, 1, 1, 2, 2, 4, 4, 4, 8 };
+	return pixelCode < 9 ? sizes[pixelCode] : 0;
+}
+
+/********** CODECS **********/
+
+inline bool isChunkedVolume (const std::string &filename){
+	return filename.size() > 4 && filename.compare(filename.size() - 4, 4, ".isv") == 0;
+}
+
+inline const char * codecName (uint32_t codec){
+	switch (codec){
+		case codecRaw: return "raw";
+		case codecZlib: return "zlib";
+		case codecLz4: return "lz4";
+		case codecZstd: return "zstd";
+	}
+	return "unknown";
+}
+
+inline bool codecAvailable (uint32_t codec){
+	switch (codec){
+		case codecRaw: case codecZlib: return true;
+#ifdef ITKSCRIPTS_HAVE_LZ4
+		case codecLz4: return true;
+#endif
+#ifdef ITKSCRIPTS_HAVE_ZSTD
+		case codecZstd: return true;
+#endif
+	}
+	return false;
+}
+
+// ITKSCRIPTS_ISV_CODEC=zstd|lz4|zlib|raw, otherwise the fastest one built in
+inline uint32_t defaultChunkCodec (){
+	if (const char * value = std::getenv("ITKSCRIPTS_ISV_CODEC")){
+		for (uint32_t codec = codecRaw; codec <= codecZstd; ++codec){
+			if (codecName(codec) == std::string(value) && codecAvailable(codec)){ return codec; }
+		}
+	}
+	if (codecAvailable(codecZstd)){ return codecZstd; }
+	if (codecAvailable(codecLz4)){ return codecLz4; }
+	return codecZlib;
+}
+
+// ITKSCRIPTS_ISV_LEVEL for zlib (1-9) and zstd (1-19), 1 otherwise: .isv is for
+// intermediates, written and read back soon, where speed beats size
+inline int chunkLevel (){
+	const char * value = std::getenv("ITKSCRIPTS_ISV_LEVEL");
+	const int level = value ? std::atoi(value) : 0;
+	return level > 0 ? level : 1;
+}
+
+inline bool compressChunk (uint32_t codec, int level, const unsigned char * in, std::size_t bytes, std::vector<unsigned char> &out){
+	switch (codec){
+		case codecRaw:
+			out.assign(in, in + bytes);
+			return true;
+		case codecZlib: {
+			uLongf packed = compressBound(bytes);
+			out.resize(packed);
+			const bool ok = compress2(&out[0], &packed, in, bytes, std::min(level, 9)) == Z_OK;
+			out.resize(packed);
+			return ok;
+		}
+#ifdef ITKSCRIPTS_HAVE_LZ4
+		case codecLz4: {
+			out.resize(LZ4_compressBound(bytes));
+			const int packed = LZ4_compress_default(reinterpret_cast<const char *>(in), reinterpret_cast<char *>(&out[0]), bytes, out.size());
+			out.resize(std::max(packed, 0));
+			return packed > 0 || bytes == 0;
+		}
+#endif
+#ifdef ITKSCRIPTS_HAVE_ZSTD
+		case codecZstd: {
+			out.resize(ZSTD_compressBound(bytes));
+			const std::size_t packed = ZSTD_compress(&out[0], out.size(), in, bytes, level);
+			if (ZSTD_isError(packed)){ return false; }
+			out.resize(packed);
+			return true;
+		}
+#endif
+	}
+	return false;
+}
+
+inline bool decompressChunk (uint32_t codec, const unsigned char * in, std::size_t bytes, unsigned char * out, std::size_t outBytes){
+	switch (codec){
+		case codecRaw:
+			if (bytes != outBytes){ return false; }
+			std::memcpy(out, in, bytes);
+			return true;
+		case codecZlib: {
+			uLongf unpacked = outBytes;
+			return uncompress(out, &unpacked, in, bytes) == Z_OK && unpacked == outBytes;
+		}
+#ifdef ITKSCRIPTS_HAVE_LZ4
+		case codecLz4:
+			return LZ4_decompress_safe(reinterpret_cast<const char *>(in), reinterpret_cast<char *>(out), bytes, outBytes) == (int)outBytes;
+#endif
+#ifdef ITKSCRIPTS_HAVE_ZSTD
+		case codecZstd:
+			return ZSTD_decompress(out, outBytes, in, bytes) == outBytes;
+#endif
+	}
+	return false;
+}
+
+// byte k of every voxel goes to plane k, so exponents and high bytes compress together
+inline void shuffleBytes (const unsigned char * in, std::size_t count, std::size_t pixelSize, unsigned char * out){
+	for (std::size_t k = 0; k < pixelSize; ++k){
+		unsigned char * plane = out + k*count;
+		for (std::size_t i = 0; i < count; ++i){ plane[i] = in[i*pixelSize + k]; }
+	}
+}
+
+inline void unshuffleBytes (const unsigned char * in, std::size_t count, std::size_t pixelSize, unsigned char * out){
+	for (std::size_t k = 0; k < pixelSize; ++k){
+		const unsigned char * plane = in + k*count;
+		for (std::size_t i = 0; i < count; ++i){ out[i*pixelSize + k] = plane[i]; }
+	}
+}
+
+/********** CHUNK GRID **********/
+
+struct ChunkBox {
+	uint64_t start[3];
+	uint64_t size[3];
+	uint64_t voxels () const { return size[0]*size[1]*size[2]; }
+};
+
+inline uint64_t chunksAlong (const ChunkedVolumeHeader &header, int d){
+	return (header.size[d] + header.chunk[d] - 1)/header.chunk[d];
+}
+
+inline ChunkBox chunkBox (const ChunkedVolumeHeader &header, uint64_t chunk){
+	ChunkBox box;
+	for (int d = 0; d < 3; ++d){
+		const uint64_t along = chunksAlong(header, d);
+		box.start[d] = (chunk % along)*header.chunk[d];
+		box.size[d] = std::min<uint64_t>(header.chunk[d], header.size[d] - box.start[d]);
+		chunk /= along;
+	}
+	return box;
+}
+
+// whole xy planes, as many as make about chunkedVolumeTargetBytes
+inline void slabChunkShape (const uint64_t size[3], std::size_t pixelSize, uint32_t chunk[3]){
+	const uint64_t plane = std::max<uint64_t>(1, size[0]*size[1]*pixelSize);
+	chunk[0] = size[0];
+	chunk[1] = size[1];
+	chunk[2] = std::max<uint64_t>(1, std::min<uint64_t>(size[2], chunkedVolumeTargetBytes/plane));
+}
+
+// "slab" for whole xy planes, a number n for n^3 bricks, empty for the default bricks
+inline void chunkShape (const std::string &shape, const uint64_t size[3], std::size_t pixelSize, uint32_t chunk[3]){
+	if (shape == "slab"){
+		slabChunkShape(size, pixelSize, chunk);
+		return;
+	}
+	const long edge = shape.empty() ? chunkedVolumeBrick : std::strtol(shape.c_str(), nullptr, 10);
+	if (edge <= 0){ itkGenericExceptionMacro(<< "chunk shape '" << shape << "' is not 'slab' or a brick edge"); }
+	for (int d = 0; d < 3; ++d){ chunk[d] = std::max<uint64_t>(1, std::min<uint64_t>(edge, size[d])); }
+}
+
+// the part of box inside an image region (start/size in file voxels), false when empty
+inline bool intersectBox (const ChunkBox &box, const uint64_t start[3], const uint64_t size[3], ChunkBox &common){
+	for (int d = 0; d < 3; ++d){
+		common.start[d] = std::max(box.start[d], start[d]);
+		const uint64_t end = std::min(box.start[d] + box.size[d], start[d] + size[d]);
+		if (end <= common.start[d]){ return false; }
+		common.size[d] = end - common.start[d];
+	}
+	return true;
+}
+
+// copy part (a sub box of box) between a chunk buffer shaped like box (x fastest)
+// and an image buffer covering [imageStart, imageStart + imageSize)
+template< typename TPixel >
+void copyBox (const ChunkBox &box, const ChunkBox &part, const uint64_t imageStart[3], const uint64_t imageSize[3],
+		TPixel * image, TPixel * chunk, bool toImage){
+	for (uint64_t z = 0; z < part.size[2]; ++z){
+		for (uint64_t y = 0; y < part.size[1]; ++y){
+			TPixel * row = image + ((part.start[2] - imageStart[2] + z)*imageSize[1] + part.start[1] - imageStart[1] + y)*imageSize[0]
+				+ part.start[0] - imageStart[0];
+			TPixel * piece = chunk + ((part.start[2] - box.start[2] + z)*box.size[1] + part.start[1] - box.start[1] + y)*box.size[0]
+				+ part.start[0] - box.start[0];
+			if (toImage){
+				std::memcpy(row, piece, part.size[0]*sizeof(TPixel));
+			} else {
+				std::memcpy(piece, row, part.size[0]*sizeof(TPixel));
+			}
+		}
+	}
+}
+
+/********** WRITING **********/
+
+// write image as .isv, shape as for chunkShape (ITKSCRIPTS_ISV_CHUNK when empty),
+// through a hidden temporary renamed onto filename once complete
+template< typename TImage >
+void writeChunkedVolume (const TImage * image, const std::string &filename, std::string shape = "",
+		unsigned int threads = workerThreads()){
+	using PixelType = typename TImage::PixelType;
+	ChunkedVolumeHeader header;
+	std::memset(&header, 0, sizeof(header));
+	header.magic = chunkedVolumeMagic;
+	header.dimension = TImage::ImageDimension;
+	header.pixelCode = ChunkedPixel< PixelType >::code;
+	header.pixelSize = sizeof(PixelType);
+	header.codec = defaultChunkCodec();
+	header.shuffled = sizeof(PixelType) > 1;
+	const typename TImage::RegionType region = image->GetBufferedRegion();
+	for (int d = 0; d < 3; ++d){
+		header.size[d] = 1;
+		header.spacing[d] = 1.0;
+		header.direction[4*d] = 1.0;
+	}
+	for (unsigned int d = 0; d < TImage::ImageDimension; ++d){
+		header.size[d] = region.GetSize(d);
+		header.spacing[d] = image->GetSpacing()[d];
+		header.origin[d] = image->GetOrigin()[d];
+		for (unsigned int e = 0; e < TImage::ImageDimension; ++e){
+			header.direction[3*d + e] = image->GetDirection()[d][e];
+		}
+	}
+	// a region that does not start at 0 keeps its place in space
+	typename TImage::PointType corner;
+	image->TransformIndexToPhysicalPoint(region.GetIndex(), corner);
+	for (unsigned int d = 0; d < TImage::ImageDimension; ++d){ header.origin[d] = corner[d]; }
+
+	if (shape.empty() && std::getenv("ITKSCRIPTS_ISV_CHUNK")){ shape = std::getenv("ITKSCRIPTS_ISV_CHUNK"); }
+	chunkShape(shape, header.size, sizeof(PixelType), header.chunk);
+	header.chunkCount = chunksAlong(header, 0)*chunksAlong(header, 1)*chunksAlong(header, 2);
+
+	const std::string temporary = temporaryFileName( filename );
+	FILE * file = std::fopen(temporary.c_str(), "wb");
+	if (!file){ itkGenericExceptionMacro(<< "cannot open " << filename << " for writing"); }
+	std::vector<ChunkEntry> table(header.chunkCount);
+	std::fwrite(&header, sizeof(header), 1, file);
+	std::fwrite(&table[0], sizeof(ChunkEntry), table.size(), file);
+	uint64_t offset = sizeof(header) + table.size()*sizeof(ChunkEntry);
+
+	// compress a few chunks per thread at a time, written in order
+	threads = std::max(1u, threads);
+	const std::size_t round = 4*threads;
+	std::vector< std::vector<unsigned char> > packed(std::min<uint64_t>(round, header.chunkCount));
+	PixelType * buffer = const_cast<PixelType *>(image->GetBufferPointer());
+	const uint64_t zero[3] = { 0, 0, 0 };
+	const int level = chunkLevel();
+	std::atomic<bool> ok(true);
+	for (uint64_t first = 0; first < header.chunkCount && ok; first += round){
+		const std::size_t count = std::min<uint64_t>(round, header.chunkCount - first);
+		std::atomic<std::size_t> next(0);
+		auto worker = [&](){
+			std::vector<PixelType> voxels;
+			std::vector<unsigned char> shuffled;
+			for (std::size_t c = next++; c < count && ok; c = next++){
+				TraceSpan span("compress", codecName(header.codec));
+				const ChunkBox box = chunkBox(header, first + c);
+				span.setBytes((double)box.voxels()*sizeof(PixelType));
+				voxels.resize(box.voxels());
+				copyBox(box, box, zero, header.size, buffer, &voxels[0], false);
+				const unsigned char * bytes = reinterpret_cast<const unsigned char *>(&voxels[0]);
+				if (header.shuffled){
+					shuffled.resize(voxels.size()*sizeof(PixelType));
+					shuffleBytes(bytes, voxels.size(), sizeof(PixelType), &shuffled[0]);
+					bytes = &shuffled[0];
+				}
+				if (!compressChunk(header.codec, level, bytes, voxels.size()*sizeof(PixelType), packed[c])){ ok = false; }
+			}
+		};
+		runWorkers(std::min<std::size_t>(threads, count), worker);
+
+		for (std::size_t c = 0; c < count && ok; ++c){
+			table[first + c].offset = offset;
+			table[first + c].bytes = packed[c].size();
+			if (std::fwrite(packed[c].data(), 1, packed[c].size(), file) != packed[c].size()){ ok = false; }
+			offset += packed[c].size();
+		}
+	}
+
+	if (ok){
+		ok = std::fseek(file, sizeof(header), SEEK_SET) == 0
+			&& std::fwrite(&table[0], sizeof(ChunkEntry), table.size(), file) == table.size();
+	}
+	if (std::fclose(file) != 0 || !ok || std::rename(temporary.c_str(), filename.c_str()) != 0){
+		std::remove(temporary.c_str());
+		itkGenericExceptionMacro(<< "could not write " << filename);
+	}
+}
+
+/********** READING **********/
+
+inline void readChunkedHeader (int fd, const std::string &filename, ChunkedVolumeHeader &header, std::vector<ChunkEntry> &table){
+	if (pread(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || header.magic != chunkedVolumeMagic){
+		itkGenericExceptionMacro(<< filename << " is not an .isv volume");
+	}
+	if (!codecAvailable(header.codec)){
+		itkGenericExceptionMacro(<< filename << " needs " << codecName(header.codec) << ", which this build does not have");
+	}
+	// the table must cover exactly the chunk grid of a non-empty volume
+	bool broken = storedPixelSize(header.pixelCode) != header.pixelSize;
+	uint64_t grid = 1;
+	for (int d = 0; d < 3 && !broken; ++d){
+		broken = header.chunk[d] == 0 || header.size[d] == 0 || header.size[d] > UINT64_MAX - header.chunk[d];
+		if (!broken){
+			const uint64_t along = chunksAlong(header, d);
+			broken = grid > UINT64_MAX/along;
+			grid *= along;
+		}
+	}
+	if (broken || header.chunkCount != grid){
+		itkGenericExceptionMacro(<< filename << " has a broken header");
+	}
+	struct stat info;
+	if (fstat(fd, &info) != 0 || (uint64_t)info.st_size < sizeof(header)
+			|| header.chunkCount > ((uint64_t)info.st_size - sizeof(header))/sizeof(ChunkEntry)){
+		itkGenericExceptionMacro(<< filename << " is truncated");
+	}
+	table.resize(header.chunkCount);
+	const ssize_t tableBytes = table.size()*sizeof(ChunkEntry);
+	if (pread(fd, &table[0], tableBytes, sizeof(header)) != tableBytes){
+		itkGenericExceptionMacro(<< filename << " is truncated");
+	}
+}
+
+inline ChunkedVolumeHeader chunkedVolumeHeader (const std::string &filename){
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0){ itkGenericExceptionMacro(<< "cannot open " << filename); }
+	ChunkedVolumeHeader header;
+	std::vector<ChunkEntry> table;
+	try {
+		readChunkedHeader(fd, filename, header, table);
+	} catch ( itk::ExceptionObject & ){
+		close(fd);
+		throw;
+	}
+	close(fd);
+	return header;
+}
+
+// geometry of an .isv volume, set on image without allocating it
+template< typename TImage >
+void setChunkedGeometry (const ChunkedVolumeHeader &header, TImage * image){
+	typename TImage::RegionType region;
+	typename TImage::SpacingType spacing;
+	typename TImage::PointType origin;
+	typename TImage::DirectionType direction;
+	for (unsigned int d = 0; d < TImage::ImageDimension; ++d){
+		region.SetIndex(d, 0);
+		region.SetSize(d, header.size[d]);
+		spacing[d] = header.spacing[d];
+		origin[d] = header.origin[d];
+		for (unsigned int e = 0; e < TImage::ImageDimension; ++e){
+			direction[d][e] = header.direction[3*d + e];
+		}
+	}
+	image->SetRegions( region );
+	image->SetSpacing( spacing );
+	image->SetOrigin( origin );
+	image->SetDirection( direction );
+}
+
+// Read region of an .isv volume (the whole volume when region is null). Only the
+// chunks that intersect it are read and inflated, on all cores. The result keeps
+// the region's index, like a streamed ITK read.
+template< typename TImage >
+typename TImage::Pointer readChunkedVolume (const std::string &filename, const typename TImage::RegionType * region = nullptr,
+		unsigned int threads = workerThreads()){
+	using PixelType = typename TImage::PixelType;
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0){ itkGenericExceptionMacro(<< "cannot open " << filename); }
+	ChunkedVolumeHeader header;
+	std::vector<ChunkEntry> table;
+	try {
+		readChunkedHeader(fd, filename, header, table);
+		if (header.dimension != TImage::ImageDimension){
+			itkGenericExceptionMacro(<< filename << " is " << header.dimension << "D");
+		}
+	} catch ( itk::ExceptionObject & ){
+		close(fd);
+		throw;
+	}
+
+	typename TImage::Pointer image = TImage::New();
+	setChunkedGeometry(header, image.GetPointer());
+	uint64_t start[3] = { 0, 0, 0 }, size[3] = { 1, 1, 1 };
+	for (unsigned int d = 0; d < TImage::ImageDimension; ++d){
+		start[d] = region ? region->GetIndex(d) : 0;
+		size[d] = region ? region->GetSize(d) : header.size[d];
+		if (region && (region->GetIndex(d) < 0 || start[d] + size[d] > header.size[d])){
+			close(fd);
+			itkGenericExceptionMacro(<< "region is outside of " << filename);
+		}
+	}
+	if (region){ image->SetRegions( *region ); }
+	image->Allocate();
+	PixelType * buffer = image->GetBufferPointer();
+	const bool native = header.pixelCode == ChunkedPixel< PixelType >::code;
+
+	// the chunks that intersect the region
+	std::vector<uint64_t> chunks;
+	uint64_t first[3], last[3];
+	for (int d = 0; d < 3; ++d){
+		first[d] = start[d]/header.chunk[d];
+		last[d] = size[d] ? (start[d] + size[d] - 1)/header.chunk[d] : 0;
+	}
+	for (uint64_t z = first[2]; z <= last[2] && size[0]*size[1]*size[2] > 0; ++z){
+		for (uint64_t y = first[1]; y <= last[1]; ++y){
+			for (uint64_t x = first[0]; x <= last[0]; ++x){
+				chunks.push_back((z*chunksAlong(header, 1) + y)*chunksAlong(header, 0) + x);
+			}
+		}
+	}
+
+	std::atomic<std::size_t> next(0);
+	std::atomic<bool> ok(true);
+	auto worker = [&](){
+		std::vector<unsigned char> packed, bytes, unshuffled;
+		std::vector<PixelType> voxels;
+		for (std::size_t i = next++; i < chunks.size() && ok; i = next++){
+			TraceSpan span("decompress", codecName(header.codec));
+			const uint64_t c = chunks[i];
+			const ChunkBox box = chunkBox(header, c);
+			const std::size_t rawBytes = box.voxels()*header.pixelSize;
+			span.setBytes(rawBytes);
+			packed.resize(table[c].bytes);
+			bytes.resize(rawBytes);
+			if (pread(fd, packed.data(), packed.size(), table[c].offset) != (ssize_t)packed.size()
+					|| !decompressChunk(header.codec, packed.data(), packed.size(), bytes.data(), rawBytes)){
+				ok = false;
+				break;
+			}
+			const unsigned char * stored = bytes.data();
+			if (header.shuffled){
+				unshuffled.resize(rawBytes);
+				unshuffleBytes(bytes.data(), box.voxels(), header.pixelSize, unshuffled.data());
+				stored = unshuffled.data();
+			}
+			voxels.resize(box.voxels());
+			if (native){
+				std::memcpy(voxels.data(), stored, rawBytes);
+			} else {
+				convertStoredVoxels(header.pixelCode, stored, box.voxels(), voxels.data());
+			}
+			ChunkBox part;
+			intersectBox(box, start, size, part);
+			copyBox(box, part, start, size, buffer, voxels.data(), true);
+		}
+	};
+	threads = std::max(1u, std::min<unsigned int>(threads, chunks.size()));
+	runWorkers(threads, worker);
+	close(fd);
+	if (!ok){ itkGenericExceptionMacro(<< filename << " has a broken chunk"); }
+	return image;
+}
+
+#endif
@@ -0,0 +1,150 @@
+// File name: 	ContentHash.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: XXH64 (xxHash, 64 bit) of bytes and of whole files, to tell whether an
+// 		input changed. Same results as the reference implementation and xxhsum -H1,
+// 		several GB/s on one core, so hashing a volume costs about what reading it does.
+
+#ifndef ITKSCRIPTS_CONTENTHASH_H
+#define ITKSCRIPTS_CONTENTHASH_H
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+class Xxh64 {
+public:
+	explicit Xxh64 (uint64_t seed = 0) : m_Total(0), m_Buffered(0) {
+		m_V[0] = seed + Prime1 + Prime2;
+		m_V[1] = seed + Prime2;
+		m_V[2] = seed;
+		m_V[3] = seed - Prime1;
+		m_Seed = seed;
+	}
+
+	void update (const void * data, std::size_t length){
+		const unsigned char * p = static_cast<const unsigned char *>(data);
+		m_Total += length;
+		if (m_Buffered + length < 32){
+			std::memcpy(m_Buffer + m_Buffered, p, length);
+			m_Buffered += length;
+			return;
+		}
+		if (m_Buffered > 0){
+			const std::size_t fill = 32 - m_Buffered;
+			std::memcpy(m_Buffer + m_Buffered, p, fill);
+			stripe(m_Buffer);
+			p += fill;
+			length -= fill;
+			m_Buffered = 0;
+		}
+		for (; length >= 32; p += 32, length -= 32){ stripe(p); }
+		std::memcpy(m_Buffer, p, length);
+		m_Buffered = length;
+	}
+
+	void update (const std::string &text){ update(text.data(), text.size()); }
+
+	uint64_t digest () const {
+		uint64_t h;
+		if (m_Total >= 32){
+			h = rotate(m_V[0], 1) + rotate(m_V[1], 7) + rotate(m_V[2], 12) + rotate(m_V[3], 18);
+			for (int i = 0; i < 4; ++i){
+				h ^= round(0, m_V[i]);
+				h = h*Prime1 + Prime4;
+			}
+		} else {
+			h = m_Seed + Prime5;
+		}
+		h += m_Total;
+
+		const unsigned char * p = m_Buffer;
+		std::size_t left = m_Buffered;
+		for (; left >= 8; p += 8, left -= 8){
+			h ^= round(0, read64(p));
+			h = rotate(h, 27)*Prime1 + Prime4;
+		}
+		if (left >= 4){
+			h ^= (uint64_t)read32(p)*Prime1;
+			h = rotate(h, 23)*Prime2 + Prime3;
+			p += 4;
+			left -= 4;
+		}
+		for (; left > 0; ++p, --left){
+			h ^= (*p)*Prime5;
+			h = rotate(h, 11)*Prime1;
+		}
+		h ^= h >> 33;
+		h *= Prime2;
+		h ^= h >> 29;
+		h *= Prime3;
+		h ^= h >> 32;
+		return h;
+	}
+
+private:
+	static constexpr uint64_t Prime1 = 11400714785074694791ULL;
+	static constexpr uint64_t Prime2 = 14029467366897019727ULL;
+	static constexpr uint64_t Prime3 = 1609587929392839161ULL;
+	static constexpr uint64_t Prime4 = 9650029242287828579ULL;
+	static constexpr uint64_t Prime5 = 2870177450012600261ULL;
+
+	static uint64_t rotate (uint64_t x, int bits){ return (x << bits) | (x >> (64 - bits)); }
+	static uint64_t round (uint64_t accumulator, uint64_t input){
+		return rotate(accumulator + input*Prime2, 31)*Prime1;
+	}
+	// little endian, like the scripts' file formats
+	static uint64_t read64 (const unsigned char * p){
+		uint64_t value;
+		std::memcpy(&value, p, 8);
+		return value;
+	}
+	static uint32_t read32 (const unsigned char * p){
+		uint32_t value;
+		std::memcpy(&value, p, 4);
+		return value;
+	}
+
+	void stripe (const unsigned char * p){
+		for (int i = 0; i < 4; ++i){ m_V[i] = round(m_V[i], read64(p + 8*i)); }
+	}
+
+	uint64_t m_V[4];
+	uint64_t m_Seed, m_Total;
+	unsigned char m_Buffer[32];
+	std::size_t m_Buffered;
+};
+
+inline uint64_t xxh64 (const void * data, std::size_t length, uint64_t seed = 0){
+	Xxh64 hash(seed);
+	hash.update(data, length);
+	return hash.digest();
+}
+
+// XXH64 of a whole file, false when it cannot be read
+inline bool hashFile (const std::string &path, uint64_t &hash){
+	const int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0){ return false; }
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	Xxh64 state;
+	std::vector<unsigned char> buffer(std::size_t(4) << 20);
+	ssize_t got;
+	while ((got = read(fd, buffer.data(), buffer.size())) > 0){ state.update(buffer.data(), got); }
+	close(fd);
+	if (got < 0){ return false; }
+	hash = state.digest();
+	return true;
+}
+
+inline std::string hexHash (uint64_t hash){
+	char hex[17];
+	std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+	return hex;
+}
+
+#endif
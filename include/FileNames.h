@@ -0,0 +1,111 @@
+// File name: 	FileNames.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Input/output file name helpers shared by every script.
+// 		Inputs are assumed in ../data/, outputs go to ../output/
+
+#ifndef ITKSCRIPTS_FILENAMES_H
+#define ITKSCRIPTS_FILENAMES_H
+
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+//Creating the input file name, type may be empty when filename already has it
+inline std::string makeInputFileName (const std::string &filename, const std::string &inputType = ""){
+	std::string inputFileName = "../data/";
+	inputFileName.append(filename);
+	inputFileName.append(inputType);
+	return inputFileName;
+}
+
+// ../output/[prefix][filename][suffix][filetype]
+inline std::string makeOutputFileName (const std::string &prefix, const std::string &filename,
+		const std::string &suffix, const std::string &filetype){
+	std::string OutputFileName = "../output/";
+	OutputFileName.append(prefix);
+	OutputFileName.append(filename);
+	OutputFileName.append(suffix);
+	OutputFileName.append(filetype);
+	return OutputFileName;
+}
+
+// hidden file of this process next to filename ("dir/volume.nii" -> "dir/.itkscripts-<pid>-volume.nii"),
+// written first and renamed onto filename once complete
+inline std::string temporaryFileName (const std::string &filename){
+	const std::size_t slash = filename.find_last_of('/') + 1;	// 0 without a directory
+	return filename.substr(0, slash) + ".itkscripts-" + std::to_string((long long)getpid()) + "-" + filename.substr(slash);
+}
+
+// drop everything from the first '.' ("volume.nii.gz" -> "volume")
+inline std::string stripExtension (const std::string &filename){
+	std::size_t point = filename.find(".");
+	if (point == std::string::npos){ return filename; }
+	return filename.substr(0, point);
+}
+
+// everything from the first '.' of the last path component ("dir/volume.nii.gz" -> ".nii.gz")
+inline std::string fileExtension (const std::string &filename){
+	std::size_t slash = filename.find_last_of("/");
+	std::size_t point = filename.find(".", slash == std::string::npos ? 0 : slash + 1);
+	if (point == std::string::npos){ return ""; }
+	return filename.substr(point);
+}
+
+// formats whose header names a second file by its own name, written in place
+// and never cached as one file
+inline bool writtenInPlace (const std::string &filename){
+	const std::string extension = fileExtension( filename );
+	return extension == ".mhd" || extension == ".hdr" || extension == ".img" || extension == ".img.gz";
+}
+
+// position and length of the one integer conversion in a series pattern
+// ("slice%03d.tif" -> 5, 4), false when there is not exactly one
+inline bool seriesConversion (const std::string &pattern, std::size_t &start, std::size_t &length){
+	bool found = false;
+	for (std::size_t i = 0; i < pattern.size(); ++i){
+		if (pattern[i] != '%'){ continue; }
+		if (i + 1 < pattern.size() && pattern[i+1] == '%'){ ++i; continue; }
+		std::size_t end = i + 1;
+		while (end < pattern.size() && pattern[end] >= '0' && pattern[end] <= '9'){ ++end; }
+		if (found || end >= pattern.size() || (pattern[end] != 'd' && pattern[end] != 'i')){ return false; }
+		found = true;
+		start = i;
+		length = end + 1 - i;
+		i = end;
+	}
+	return found;
+}
+
+inline bool isSeriesPattern (const std::string &pattern){
+	std::size_t start, length;
+	return seriesConversion(pattern, start, length);
+}
+
+// file index of a series ("slice%03d.tif", 7 -> "slice007.tif"), index >= 0
+inline std::string seriesFileName (const std::string &pattern, int index){
+	std::size_t start, length;
+	if (!seriesConversion(pattern, start, length)){ return pattern; }
+	const std::string flags = pattern.substr(start + 1, length - 2);
+	std::string number = std::to_string(index);
+	const std::size_t width = flags.empty() ? 0 : std::stoul(flags);
+	if (number.size() < width){ number.insert(0, width - number.size(), flags[0] == '0' ? '0' : ' '); }
+
+	std::string filename;
+	for (std::size_t i = 0; i < pattern.size(); ++i){
+		if (i == start){ filename += number; i += length - 1; continue; }
+		filename += pattern[i];
+		if (pattern[i] == '%' && i + 1 < pattern.size() && pattern[i+1] == '%'){ ++i; }
+	}
+	return filename;
+}
+
+// the files of a series, first to last
+inline std::vector<std::string> seriesFileNames (const std::string &pattern, int first, int last){
+	std::vector<std::string> filenames;
+	for (int k = first; k <= last; ++k){ filenames.push_back(seriesFileName(pattern, k)); }
+	return filenames;
+}
+
+#endif
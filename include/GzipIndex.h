@@ -0,0 +1,353 @@
+// File name: 	GzipIndex.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Random access into gzip files (zran style). One full pass records an
+// 		access point every few MB of output: the compressed bit position plus the
+// 		32K of history deflate may refer back to. Any byte range can then be
+// 		inflated starting from the closest point, and the pieces between points
+// 		inflate independently on separate threads. Multi-member files (pigz) get
+// 		a free access point at every member start.
+// 		The index is kept next to the file as <file>.gzidx.
+
+#ifndef ITKSCRIPTS_GZIPINDEX_H
+#define ITKSCRIPTS_GZIPINDEX_H
+
+#include "itk_zlib.h"
+
+#include "WorkerThreads.h"
+#include "Trace.h"
+
+#include <sys/stat.h>
+#include <cstdio>
+#include <cstdint>
+#include <cstring>
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+constexpr std::size_t gzipWindowSize = 32768;
+constexpr uint64_t gzipIndexSpan = 4 << 20;			// uncompressed bytes between access points
+constexpr uint64_t gzipIndexMagic = 0x5844495a47534b49ULL;	// "IKSGZIDX"
+
+struct GzipAccessPoint {
+	uint64_t out;				// uncompressed offset of the point
+	uint64_t in;				// compressed offset of the first whole byte
+	int32_t bits;				// bits of the byte before in still to be used, 0..7
+	int32_t memberStart;			// a gzip member header starts at in, no history needed
+	std::vector<unsigned char> window;	// the 32K of output before out
+};
+
+struct GzipIndex {
+	uint64_t totalOut;
+	std::vector<GzipAccessPoint> points;
+};
+
+/********** BUILDING **********/
+
+inline void addMemberStart (GzipIndex &index, uint64_t in, uint64_t out){
+	GzipAccessPoint point;
+	point.out = out;
+	point.in = in;
+	point.bits = 0;
+	point.memberStart = 1;
+	index.points.push_back(point);
+}
+
+// One pass over the whole file. Output bytes in [copyFrom, copyFrom + copyLength)
+// are also copied to copyTo, so the first read of a file builds the index for free.
+inline bool buildGzipIndex (const std::string &path, GzipIndex &index,
+		uint64_t copyFrom = 0, uint64_t copyLength = 0, unsigned char * copyTo = nullptr){
+	FILE * file = std::fopen(path.c_str(), "rb");
+	if (!file){ return false; }
+
+	z_stream stream;
+	std::memset(&stream, 0, sizeof(stream));
+	if (inflateInit2(&stream, 47) != Z_OK){	// 32 + 15: gzip or zlib header, 32K window
+		std::fclose(file);
+		return false;
+	}
+
+	std::vector<unsigned char> input(1 << 16), window(gzipWindowSize);
+	uint64_t totalIn = 0, totalOut = 0, last = 0;
+	index.points.clear();
+	addMemberStart(index, 0, 0);
+
+	bool ok = true;
+	int ret = Z_OK;
+	while (ok){
+		if (stream.avail_in == 0){
+			stream.avail_in = std::fread(&input[0], 1, input.size(), file);
+			stream.next_in = &input[0];
+			if (std::ferror(file)){ ok = false; break; }
+			if (stream.avail_in == 0){
+				ok = (ret == Z_STREAM_END);	// otherwise the file is truncated
+				break;
+			}
+		}
+		if (ret == Z_STREAM_END){
+			// another member follows, anything else is trailing garbage
+			if (stream.next_in[0] != 0x1f){ break; }
+			inflateReset(&stream);
+			addMemberStart(index, totalIn, totalOut);
+			last = totalOut;
+		}
+		if (stream.avail_out == 0){
+			stream.avail_out = gzipWindowSize;
+			stream.next_out = &window[0];
+		}
+
+		unsigned char * produced = stream.next_out;
+		totalIn += stream.avail_in;
+		totalOut += stream.avail_out;
+		ret = inflate(&stream, Z_BLOCK);
+		totalIn -= stream.avail_in;
+		totalOut -= stream.avail_out;
+
+		if (copyTo){
+			const uint64_t count = stream.next_out - produced;
+			const uint64_t start = totalOut - count;
+			const uint64_t from = std::max(start, copyFrom);
+			const uint64_t to = std::min(totalOut, copyFrom + copyLength);
+			if (from < to){ std::memcpy(copyTo + (from - copyFrom), produced + (from - start), to - from); }
+		}
+
+		if (ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR){ ok = false; break; }
+		if (ret == Z_STREAM_END){ continue; }
+
+		// at the end of a deflate header-less block boundary (not the last block)
+		if ((stream.data_type & 128) && !(stream.data_type & 64) && totalOut - last > gzipIndexSpan){
+			GzipAccessPoint point;
+			point.out = totalOut;
+			point.in = totalIn;
+			point.bits = stream.data_type & 7;
+			point.memberStart = 0;
+			point.window.resize(gzipWindowSize);
+			// window is circular, the oldest byte sits at next_out
+			const std::size_t left = stream.avail_out;
+			if (left){ std::memcpy(&point.window[0], &window[0] + gzipWindowSize - left, left); }
+			if (left < gzipWindowSize){ std::memcpy(&point.window[0] + left, &window[0], gzipWindowSize - left); }
+			index.points.push_back(point);
+			last = totalOut;
+		}
+	}
+	inflateEnd(&stream);
+	std::fclose(file);
+	index.totalOut = totalOut;
+	return ok;
+}
+
+/********** EXTRACTING **********/
+
+inline bool skipInput (FILE * file, z_stream &stream, std::vector<unsigned char> &input, std::size_t bytes){
+	while (bytes > 0){
+		if (stream.avail_in == 0){
+			stream.avail_in = std::fread(&input[0], 1, input.size(), file);
+			stream.next_in = &input[0];
+			if (stream.avail_in == 0){ return false; }
+		}
+		const std::size_t take = std::min<std::size_t>(bytes, stream.avail_in);
+		stream.next_in += take;
+		stream.avail_in -= take;
+		bytes -= take;
+	}
+	return true;
+}
+
+// inflate [offset, offset + length) starting at point, crossing member boundaries if needed
+inline bool extractFromPoint (FILE * file, const GzipAccessPoint &point, uint64_t offset, uint64_t length, unsigned char * out){
+	z_stream stream;
+	std::memset(&stream, 0, sizeof(stream));
+	bool raw = !point.memberStart;
+	if (inflateInit2(&stream, raw ? -15 : 47) != Z_OK){ return false; }
+
+	bool ok = fseeko(file, point.in - (point.bits ? 1 : 0), SEEK_SET) == 0;
+	if (ok && point.bits){
+		const int c = std::getc(file);
+		ok = (c != EOF) && inflatePrime(&stream, point.bits, c >> (8 - point.bits)) == Z_OK;
+	}
+	if (ok && raw){
+		ok = inflateSetDictionary(&stream, &point.window[0], point.window.size()) == Z_OK;
+	}
+
+	std::vector<unsigned char> input(1 << 16), discard(1 << 16);
+	uint64_t position = point.out;
+	while (ok && length > 0){
+		if (stream.avail_in == 0){
+			stream.avail_in = std::fread(&input[0], 1, input.size(), file);
+			stream.next_in = &input[0];
+			if (stream.avail_in == 0){ ok = false; break; }
+		}
+		// bytes before offset go to a scratch buffer, never past offset
+		const bool skipping = position < offset;
+		const uint64_t room = skipping ? std::min<uint64_t>(discard.size(), offset - position) : std::min<uint64_t>(length, 1u << 30);
+		stream.next_out = skipping ? &discard[0] : out;
+		stream.avail_out = room;
+		const int ret = inflate(&stream, Z_NO_FLUSH);
+		const uint64_t produced = room - stream.avail_out;
+		position += produced;
+		if (!skipping){
+			out += produced;
+			length -= produced;
+		}
+
+		if (ret == Z_STREAM_END){
+			// raw inflate leaves the 8 byte gzip trailer behind, the next member has a header
+			if (raw && !skipInput(file, stream, input, 8)){ ok = (length == 0); break; }
+			if (inflateReset2(&stream, 47) != Z_OK){ ok = false; }
+			raw = false;
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR){
+			ok = false;
+		}
+	}
+	inflateEnd(&stream);
+	return ok;
+}
+
+// [offset, offset + length) of the uncompressed file, pieces between access points in parallel
+inline bool readGzipRange (const std::string &path, const GzipIndex &index, uint64_t offset, uint64_t length,
+		unsigned char * out, unsigned int threads = workerThreads()){
+	if (offset + length > index.totalOut || index.points.empty()){ return false; }
+
+	struct Piece {
+		std::size_t point;
+		uint64_t begin, end;
+	};
+	std::vector<Piece> pieces;
+	for (std::size_t i = 0; i < index.points.size(); ++i){
+		const uint64_t begin = std::max(offset, index.points[i].out);
+		const uint64_t end = std::min(offset + length, (i + 1 < index.points.size()) ? index.points[i+1].out : index.totalOut);
+		if (begin < end){
+			Piece piece = { i, begin, end };
+			pieces.push_back(piece);
+		}
+	}
+
+	std::atomic<std::size_t> next(0);
+	std::atomic<bool> ok(true);
+	auto worker = [&](){
+		FILE * file = std::fopen(path.c_str(), "rb");
+		if (!file){ ok = false; return; }
+		for (std::size_t p = next++; p < pieces.size() && ok; p = next++){
+			const Piece &piece = pieces[p];
+			TraceSpan span("decompress", "gzip");
+			span.setBytes(piece.end - piece.begin);
+			if (!extractFromPoint(file, index.points[piece.point], piece.begin, piece.end - piece.begin, out + (piece.begin - offset))){
+				ok = false;
+			}
+		}
+		std::fclose(file);
+	};
+	const unsigned int count = std::max(1u, std::min<unsigned int>(threads, pieces.size()));
+	runWorkers(count, worker);
+	return ok;
+}
+
+/********** PERSISTENCE **********/
+
+inline std::string gzipIndexFileName (const std::string &path){
+	return path + ".gzidx";
+}
+
+template< typename T >
+inline void writeValue (FILE * file, const T &value){ std::fwrite(&value, sizeof(T), 1, file); }
+
+template< typename T >
+inline bool readValue (FILE * file, T &value){ return std::fread(&value, sizeof(T), 1, file) == 1; }
+
+// mtime in nanoseconds, so a file rewritten at the same size within one second
+// does not keep its old index
+inline int64_t modifiedNanoseconds (const struct stat &info){
+	return (int64_t)info.st_mtim.tv_sec*1000000000 + info.st_mtim.tv_nsec;
+}
+
+// windows are stored deflated, they are mostly smaller than 32K
+inline bool saveGzipIndex (const std::string &path, const GzipIndex &index){
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0){ return false; }
+	const std::string indexName = gzipIndexFileName(path);
+	const std::string temporary = indexName + ".tmp";
+	FILE * file = std::fopen(temporary.c_str(), "wb");
+	if (!file){ return false; }
+
+	writeValue(file, gzipIndexMagic);
+	writeValue(file, (uint64_t)info.st_size);
+	writeValue(file, modifiedNanoseconds(info));
+	writeValue(file, index.totalOut);
+	writeValue(file, (uint64_t)index.points.size());
+	std::vector<unsigned char> packed(compressBound(gzipWindowSize));
+	for (const GzipAccessPoint &point : index.points){
+		writeValue(file, point.out);
+		writeValue(file, point.in);
+		writeValue(file, point.bits);
+		writeValue(file, point.memberStart);
+		uLongf packedSize = packed.size();
+		if (!point.window.empty()){
+			compress2(&packed[0], &packedSize, &point.window[0], point.window.size(), 1);
+		} else {
+			packedSize = 0;
+		}
+		writeValue(file, (uint32_t)packedSize);
+		std::fwrite(&packed[0], 1, packedSize, file);
+	}
+	const bool ok = !std::ferror(file);
+	std::fclose(file);
+	return ok && std::rename(temporary.c_str(), indexName.c_str()) == 0;
+}
+
+// false when there is no index or it belongs to another version of the file
+inline bool loadGzipIndex (const std::string &path, GzipIndex &index){
+	struct stat info;
+	if (stat(path.c_str(), &info) != 0){ return false; }
+	FILE * file = std::fopen(gzipIndexFileName(path).c_str(), "rb");
+	if (!file){ return false; }
+
+	uint64_t magic = 0, fileSize = 0, count = 0;
+	int64_t modified = 0;
+	bool ok = readValue(file, magic) && readValue(file, fileSize) && readValue(file, modified)
+		&& readValue(file, index.totalOut) && readValue(file, count)
+		&& magic == gzipIndexMagic && fileSize == (uint64_t)info.st_size && modified == modifiedNanoseconds(info);
+	std::vector<unsigned char> packed(compressBound(gzipWindowSize));
+	index.points.clear();
+	for (uint64_t i = 0; ok && i < count; ++i){
+		GzipAccessPoint point;
+		uint32_t packedSize = 0;
+		ok = readValue(file, point.out) && readValue(file, point.in) && readValue(file, point.bits)
+			&& readValue(file, point.memberStart) && readValue(file, packedSize) && packedSize <= packed.size()
+			&& std::fread(&packed[0], 1, packedSize, file) == packedSize;
+		if (ok && packedSize > 0){
+			point.window.resize(gzipWindowSize);
+			uLongf windowSize = gzipWindowSize;
+			ok = uncompress(&point.window[0], &windowSize, &packed[0], packedSize) == Z_OK && windowSize == gzipWindowSize;
+		}
+		index.points.push_back(point);
+	}
+	std::fclose(file);
+	return ok && !index.points.empty();
+}
+
+// the stored index, or a fresh one (stored for next time) when there is none
+inline bool openGzipIndex (const std::string &path, GzipIndex &index){
+	if (loadGzipIndex(path, index)){ return true; }
+	if (!buildGzipIndex(path, index)){ return false; }
+	saveGzipIndex(path, index);	// read-only data directories just go without
+	return true;
+}
+
+// Read [offset, offset + length) of a gzip file. Uses the stored index, or builds it
+// while decoding (and stores it) the first time the file is read this way.
+inline bool readGzipFile (const std::string &path, uint64_t offset, uint64_t length, unsigned char * out){
+	GzipIndex index;
+	if (loadGzipIndex(path, index)){
+		return readGzipRange(path, index, offset, length, out);
+	}
+	if (!buildGzipIndex(path, index, offset, length, out) || offset + length > index.totalOut){
+		return false;
+	}
+	saveGzipIndex(path, index);	// read-only data directories just go without
+	return true;
+}
+
+#endif
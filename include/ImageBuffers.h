@@ -0,0 +1,265 @@
+// File name: 	ImageBuffers.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Where image voxels live. Every itk::Image of a scalar pixel type gets its
+// 		pixel container from an object factory registered here, so the readers,
+// 		the ITK filters and the scripts' own Allocate() calls all come through.
+// 		Buffers of 2 MB and up are anonymous mappings aligned to 2 MB with
+// 		transparent huge pages asked for (madvise, ITKSCRIPTS_HUGEPAGES=0 to
+// 		leave them off), and their pages are touched first by workerThreads()
+// 		pool threads, each on its own contiguous part, so page faults are taken in
+// 		parallel and the kernel spreads the pages over the NUMA nodes of the
+// 		threads that touched them. Freed buffers are kept for the next image up
+// 		to ITKSCRIPTS_BUFFER_POOL (MB); the batch driver keeps one job's worth,
+// 		so consecutive volumes reuse buffers that are already faulted in.
+
+#ifndef ITKSCRIPTS_IMAGEBUFFERS_H
+#define ITKSCRIPTS_IMAGEBUFFERS_H
+
+#include "itkImportImageContainer.h"
+#include "itkObjectFactoryBase.h"
+#include "itkCreateObjectFunction.h"
+#include "itkVersion.h"
+
+#include "WorkerThreads.h"
+
+#include <sys/mman.h>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <list>
+#include <mutex>
+#include <atomic>
+#include <typeinfo>
+#include <algorithm>
+#include <type_traits>
+
+constexpr std::size_t imageBufferAlignment = std::size_t(2) << 20;	// one huge page on x86-64 and arm64
+constexpr std::size_t imageBufferTouchChunk = std::size_t(64) << 20;	// per first-touch thread, at least
+
+// mapped image buffers, live and kept for reuse
+class ImageBufferPool {
+public:
+	static ImageBufferPool & instance (){
+		static ImageBufferPool pool;
+		return pool;
+	}
+
+	// A buffer of at least bytes, zeroed when zero is set. Reuses the smallest kept
+	// buffer that is large enough (its tail given back), otherwise maps a new one.
+	// Null when the mapping fails.
+	void * acquire (std::size_t bytes, bool zero){
+		const std::size_t length = roundUp(bytes);
+		void * address = nullptr;
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			auto kept = m_Kept.end();
+			for (auto buffer = m_Kept.begin(); buffer != m_Kept.end(); ++buffer){
+				if (buffer->second >= length && (kept == m_Kept.end() || buffer->second < kept->second)){ kept = buffer; }
+			}
+			if (kept != m_Kept.end()){
+				address = kept->first;
+				if (kept->second > length){ munmap(static_cast<char *>(address) + length, kept->second - length); }
+				m_KeptBytes -= kept->second;
+				m_Kept.erase(kept);
+				m_Live[address] = length;
+				++m_Reused;
+			}
+		}
+		if (address){
+			if (zero){ touch(address, length, true); }
+			return address;
+		}
+
+		address = map(length);
+		if (!address){ return nullptr; }
+		touch(address, length, false);
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Live[address] = length;
+		++m_Mapped;
+		return address;
+	}
+
+	// true when address came from acquire and is now given back
+	bool release (void * address){
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		auto live = m_Live.find(address);
+		if (live == m_Live.end()){ return false; }
+		m_Kept.push_back(*live);
+		m_KeptBytes += live->second;
+		m_Live.erase(live);
+		trim();
+		return true;
+	}
+
+	// bytes of freed buffers kept for reuse, the oldest go first past it
+	void setCapacity (std::size_t bytes){
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		m_Capacity = bytes;
+		trim();
+	}
+
+	// buffers mapped and buffers reused so far
+	std::size_t mapped () const {
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		return m_Mapped;
+	}
+	std::size_t reused () const {
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		return m_Reused;
+	}
+
+private:
+	ImageBufferPool () : m_Capacity(0), m_KeptBytes(0), m_Mapped(0), m_Reused(0) {
+		const char * pool = std::getenv("ITKSCRIPTS_BUFFER_POOL");
+		if (pool){ m_Capacity = (std::size_t)std::strtoull(pool, nullptr, 10) << 20; }
+		const char * huge = std::getenv("ITKSCRIPTS_HUGEPAGES");
+		m_HugePages = !(huge && std::strcmp(huge, "0") == 0);
+	}
+
+	static std::size_t roundUp (std::size_t bytes){
+		return (bytes + imageBufferAlignment - 1)/imageBufferAlignment*imageBufferAlignment;
+	}
+
+	// length bytes on a 2 MB boundary, the slack around it unmapped again
+	void * map (std::size_t length){
+		const std::size_t padded = length + imageBufferAlignment;
+		void * mapped = mmap(nullptr, padded, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mapped == MAP_FAILED){ return nullptr; }
+		char * start = static_cast<char *>(mapped);
+		char * aligned = reinterpret_cast<char *>(roundUp(reinterpret_cast<std::uintptr_t>(start)));
+		if (aligned > start){ munmap(start, aligned - start); }
+		if (start + padded > aligned + length){ munmap(aligned + length, start + padded - (aligned + length)); }
+#ifdef MADV_HUGEPAGE
+		if (m_HugePages){ madvise(aligned, length, MADV_HUGEPAGE); }
+#endif
+		return aligned;
+	}
+
+	// Fault in (or zero, for a reused buffer) length bytes from several threads, one
+	// contiguous part at a time, so each part lands on the NUMA node of its thread.
+	// A fresh mapping is already zero, writing one byte a page is enough there.
+	static void touch (void * address, std::size_t length, bool zero){
+		const std::size_t chunks = length/imageBufferAlignment;
+		const unsigned int threads = (unsigned int)std::max<std::size_t>(1,
+			std::min<std::size_t>(workerThreads(), length/imageBufferTouchChunk));
+		auto part = [=](unsigned int t){
+			char * begin = static_cast<char *>(address) + chunks*t/threads*imageBufferAlignment;
+			char * end = static_cast<char *>(address) + chunks*(t + 1)/threads*imageBufferAlignment;
+			if (zero){
+				std::memset(begin, 0, end - begin);
+				return;
+			}
+			for (char * page = begin; page < end; page += 4096){ *page = 0; }
+		};
+		std::atomic<unsigned int> next(0);
+		auto worker = [&](){
+			for (unsigned int t = next++; t < threads; t = next++){ part(t); }
+		};
+		runWorkers(threads, worker);
+	}
+
+	// caller holds m_Mutex
+	void trim (){
+		while (m_KeptBytes > m_Capacity && !m_Kept.empty()){
+			munmap(m_Kept.front().first, m_Kept.front().second);
+			m_KeptBytes -= m_Kept.front().second;
+			m_Kept.pop_front();
+		}
+	}
+
+	mutable std::mutex m_Mutex;
+	std::map<void *, std::size_t> m_Live;
+	std::list< std::pair<void *, std::size_t> > m_Kept;	// oldest first
+	std::size_t m_Capacity, m_KeptBytes, m_Mapped, m_Reused;
+	bool m_HugePages;
+};
+
+// Pixel container whose large buffers come from ImageBufferPool, small ones from new[] as before.
+template< typename TElement >
+class PooledImageContainer : public itk::ImportImageContainer< itk::SizeValueType, TElement > {
+public:
+	static_assert(std::is_arithmetic<TElement>::value, "pooled buffers are zeroed bytes, scalar pixels only");
+
+	typedef PooledImageContainer Self;
+	typedef itk::ImportImageContainer< itk::SizeValueType, TElement > Superclass;
+	typedef itk::SmartPointer< Self > Pointer;
+	typedef itk::SmartPointer< const Self > ConstPointer;
+	typedef typename Superclass::ElementIdentifier ElementIdentifier;
+
+	itkNewMacro(Self);
+	itkTypeMacro(PooledImageContainer, ImportImageContainer);
+
+protected:
+	PooledImageContainer() {}
+	// the base destructor would only reach the base DeallocateManagedMemory
+	~PooledImageContainer(){ DeallocateManagedMemory(); }
+
+	TElement * AllocateElements (ElementIdentifier size, bool UseDefaultConstructor = false) const override {
+		const std::size_t bytes = (std::size_t)size*sizeof(TElement);
+		if (bytes < imageBufferAlignment){ return Superclass::AllocateElements(size, UseDefaultConstructor); }
+		void * buffer = ImageBufferPool::instance().acquire(bytes, UseDefaultConstructor);
+		if (!buffer){
+			itkGenericExceptionMacro(<< "could not map " << (bytes >> 20) << " MB for an image");
+		}
+		return static_cast<TElement *>(buffer);
+	}
+
+	void DeallocateManagedMemory () override {
+		if (this->GetContainerManageMemory() && ImageBufferPool::instance().release(this->GetImportPointer())){
+			this->SetContainerManageMemory(false);	// so the base only forgets the pointer
+		}
+		Superclass::DeallocateManagedMemory();
+	}
+};
+
+// hands out PooledImageContainer wherever ITK asks for an ImportImageContainer of a scalar pixel
+class ImageBufferFactory : public itk::ObjectFactoryBase {
+public:
+	typedef ImageBufferFactory Self;
+	typedef itk::ObjectFactoryBase Superclass;
+	typedef itk::SmartPointer< Self > Pointer;
+	typedef itk::SmartPointer< const Self > ConstPointer;
+
+	itkFactorylessNewMacro(Self);
+	itkTypeMacro(ImageBufferFactory, ObjectFactoryBase);
+
+	const char * GetITKSourceVersion () const override { return ITK_SOURCE_VERSION; }
+	const char * GetDescription () const override { return "huge page, first-touch image buffers"; }
+
+protected:
+	ImageBufferFactory (){
+		overrideContainer<unsigned char>();
+		overrideContainer<char>();
+		overrideContainer<signed char>();
+		overrideContainer<unsigned short>();
+		overrideContainer<short>();
+		overrideContainer<unsigned int>();
+		overrideContainer<int>();
+		overrideContainer<unsigned long>();
+		overrideContainer<long>();
+		overrideContainer<float>();
+		overrideContainer<double>();
+	}
+
+private:
+	template< typename TElement >
+	void overrideContainer (){
+		this->RegisterOverride(typeid(itk::ImportImageContainer< itk::SizeValueType, TElement >).name(),
+			typeid(PooledImageContainer< TElement >).name(), "pooled image buffer", true,
+			itk::CreateObjectFunction< PooledImageContainer< TElement > >::New());
+	}
+};
+
+// once per process, before the first image is allocated
+inline bool registerImageBuffers (){
+	static const bool registered = itk::ObjectFactoryBase::RegisterFactory(ImageBufferFactory::New());
+	return registered;
+}
+
+// every script includes this through ImageIO.h
+static const bool imageBuffersRegistered = registerImageBuffers();
+
+#endif
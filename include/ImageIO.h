@@ -0,0 +1,227 @@
+// File name: 	ImageIO.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: One place to read and write images, so every script goes through the
+// 		same code path. Errors come out as itk::ExceptionObject like the readers/writers.
+
+#ifndef ITKSCRIPTS_IMAGEIO_H
+#define ITKSCRIPTS_IMAGEIO_H
+
+#include "itkImage.h"
+#include "itkImageFileReader.h"
+#include "itkImageFileWriter.h"
+#include "itkExtractImageFilter.h"
+
+#include "ImageBuffers.h"
+#include "SharedVolumeCache.h"
+#include "NiftiRegionReader.h"
+#include "TiffRegionReader.h"
+#include "ParallelGzip.h"
+#include "ChunkedVolume.h"
+#include "Trace.h"
+#include "FileNames.h"
+
+#include <unistd.h>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include <utility>
+
+// the buffered part of image inside region, as its own image
+template< typename TImage >
+typename TImage::Pointer cropImage (const TImage * image, const typename TImage::RegionType &region){
+	using ExtractFilter = itk::ExtractImageFilter< TImage, TImage >;
+	typename ExtractFilter::Pointer extracted = ExtractFilter::New();
+	extracted->SetDirectionCollapseToSubmatrix();
+	extracted->SetExtractionRegion( region );
+	extracted->SetInput( image );
+	extracted->Update();
+	typename TImage::Pointer output = extracted->GetOutput();
+	output->DisconnectPipeline();
+	return output;
+}
+
+// bytes and voxels of region of TImage, on a trace span
+template< typename TImage >
+void traceRegion (TraceSpan &span, const typename TImage::RegionType &region){
+	span.setVoxels(region.GetNumberOfPixels());
+	span.setBytes((double)region.GetNumberOfPixels()*sizeof(typename TImage::PixelType));
+}
+
+// extent of an image on disk, only the header is read
+template< typename TImage >
+typename TImage::RegionType readLargestRegion (const std::string &filename){
+	TraceSpan span("open", "header");
+	span.setDetail(filename);
+	if (isChunkedVolume( filename )){
+		typename TImage::Pointer image = TImage::New();
+		setChunkedGeometry(chunkedVolumeHeader( filename ), image.GetPointer());
+		return image->GetLargestPossibleRegion();
+	}
+	using ReaderType = itk::ImageFileReader< TImage >;
+	typename ReaderType::Pointer reader = ReaderType::New();
+	reader->SetFileName( filename );
+	reader->UpdateOutputInformation();
+	return reader->GetOutput()->GetLargestPossibleRegion();
+}
+
+// Decode region of filename (the whole image when region is null). .nii.gz files go
+// through the gzip index: only the part holding the region is inflated, on all cores.
+// Everything else is streamed by ITK. The result keeps the region's index.
+template< typename TImage >
+typename TImage::Pointer decodeImage (const std::string &filename, const typename TImage::RegionType * region){
+	TraceSpan span("decode", region ? "region" : "image");
+	span.setDetail(filename);
+	if (isChunkedVolume( filename )){
+		typename TImage::Pointer image = readChunkedVolume< TImage >( filename, region );
+		traceRegion< TImage >( span, image->GetBufferedRegion() );
+		return image;
+	}
+
+	using ReaderType = itk::ImageFileReader< TImage >;
+	typename ReaderType::Pointer reader = ReaderType::New();
+	reader->SetFileName( filename );
+	reader->UpdateOutputInformation();
+	const typename TImage::RegionType largest = reader->GetOutput()->GetLargestPossibleRegion();
+	const typename TImage::RegionType wanted = region ? *region : largest;
+	if (!largest.IsInside( wanted )){
+		itkGenericExceptionMacro(<< "region " << wanted << " is outside of " << filename);
+	}
+	traceRegion< TImage >( span, wanted );
+
+	if (isGzipNifti( filename )){
+		typename TImage::Pointer image = TImage::New();
+		image->CopyInformation( reader->GetOutput() );
+		image->SetRegions( wanted );
+		image->Allocate();
+		if (readNiftiGzRegion< TImage >( filename, image )){ return image; }
+	}
+	// a window of a TIFF only decodes the strips or tiles under it
+	if (isTiff( filename ) && wanted != largest){
+		typename TImage::Pointer image = TImage::New();
+		image->CopyInformation( reader->GetOutput() );
+		image->SetRegions( wanted );
+		image->Allocate();
+		if (readTiffRegion< TImage >( filename, image )){ return image; }
+	}
+
+	reader->GetOutput()->SetRequestedRegion( wanted );
+	reader->Update();
+	typename TImage::Pointer image = reader->GetOutput();
+	image->DisconnectPipeline();
+	if (image->GetBufferedRegion() == wanted){ return image; }
+	return cropImage< TImage >( image, wanted );
+}
+
+// read a whole image, the result is disconnected from the reader.
+// With ITKSCRIPTS_SHM_CACHE set, decoded voxels are shared with other processes.
+template< typename TImage >
+typename TImage::Pointer readImage (const std::string &filename){
+	const std::size_t sharedCapacity = sharedCacheCapacity();
+	std::string sharedKey;
+	if (sharedCapacity > 0){
+		sharedKey = sharedCacheKey< TImage >( filename );
+		if (!sharedKey.empty()){
+			typename TImage::Pointer shared = attachSharedVolume< TImage >( sharedKey );
+			if (shared.IsNotNull()){ return shared; }
+		}
+	}
+
+	typename TImage::Pointer image = decodeImage< TImage >( filename, nullptr );
+	if (!sharedKey.empty()){
+		publishSharedVolume< TImage >( sharedKey, image, sharedCapacity );
+	}
+	return image;
+}
+
+// read only region of an image, e.g. one slice. The result keeps the region's
+// index (and the file's origin), like a streamed ITK read.
+template< typename TImage >
+typename TImage::Pointer readImageRegion (const std::string &filename, const typename TImage::RegionType &region){
+	if (sharedCacheCapacity() > 0){
+		const std::string sharedKey = sharedCacheKey< TImage >( filename );
+		typename TImage::Pointer shared = sharedKey.empty() ? typename TImage::Pointer() : attachSharedVolume< TImage >( sharedKey );
+		if (shared.IsNotNull()){ return cropImage< TImage >( shared, region ); }
+	}
+	return decodeImage< TImage >( filename, &region );
+}
+
+// write an image, compressed by default like the scripts do.
+// The image goes to a hidden temporary next to filename and is renamed onto it once
+// complete, so filename holds the old file or the new one, never half of one, even
+// when the script is killed. .nii.gz (always compressed, the extension decides) is
+// deflated in parallel blocks (multi-member gzip) with its .gzidx written alongside:
+// scalar 2D/3D images straight from the header built in memory and the image buffer,
+// anything else from a plain NIfTI ITK writes first. .isv goes to our chunked container.
+template< typename TImage >
+void writeImage (const TImage * image, const std::string &filename, bool useCompression = true){
+	TraceSpan span("write", "image");
+	span.setDetail(filename);
+	traceRegion< TImage >( span, image->GetBufferedRegion() );
+	if (isChunkedVolume( filename )){
+		writeChunkedVolume< TImage >( image, filename );
+		return;
+	}
+	using WriterType = itk::ImageFileWriter< TImage >;
+	typename WriterType::Pointer writer = WriterType::New();
+	writer->SetInput( image );
+	if (!isGzipNifti( filename )){
+		if (writtenInPlace( filename )){
+			writer->SetFileName( filename );
+			writer->SetUseCompression( useCompression );
+			writer->Update();
+			return;
+		}
+		const std::string temporary = temporaryFileName( filename );
+		writer->SetFileName( temporary );
+		writer->SetUseCompression( useCompression );
+		try {
+			writer->Update();
+		} catch ( itk::ExceptionObject & ){
+			unlink(temporary.c_str());
+			throw;
+		}
+		if (std::rename(temporary.c_str(), filename.c_str()) != 0){
+			unlink(temporary.c_str());
+			itkGenericExceptionMacro(<< "could not write " << filename);
+		}
+		return;
+	}
+
+	const std::string temporary = temporaryFileName( filename );
+	bool compressed;
+	if (isNiftiStreamable< TImage >( image )){
+		TraceSpan encode("encode", "gzip");
+		encode.setDetail(filename);
+		const std::vector<unsigned char> header = makeNiftiHeader< TImage >( image );
+		GzipParts parts;
+		parts.push_back(std::make_pair(&header[0], header.size()));
+		parts.push_back(std::make_pair(reinterpret_cast<const unsigned char *>(image->GetBufferPointer()),
+			image->GetBufferedRegion().GetNumberOfPixels()*sizeof(typename TImage::PixelType)));
+		compressed = compressPartsParallel(parts, temporary, gzipLevel());
+	} else {
+		const std::string plain = temporaryFileName( filename.substr(0, filename.size() - 3) );
+		writer->SetFileName( plain );
+		writer->SetUseCompression( false );
+		try {
+			writer->Update();
+		} catch ( itk::ExceptionObject & ){
+			unlink(plain.c_str());
+			throw;
+		}
+		TraceSpan encode("encode", "gzip");
+		encode.setDetail(filename);
+		compressed = compressFileParallel(plain, temporary, gzipLevel());
+		unlink(plain.c_str());
+	}
+	// the index first: it names the size and mtime of the file it belongs to, which the
+	// rename keeps, so whichever pair a reader finds is either matching or rebuilt
+	std::rename(gzipIndexFileName(temporary).c_str(), gzipIndexFileName(filename).c_str());
+	if (!compressed || std::rename(temporary.c_str(), filename.c_str()) != 0){
+		unlink(temporary.c_str());
+		itkGenericExceptionMacro(<< "could not write " << filename);
+	}
+}
+
+#endif
@@ -0,0 +1,183 @@
+// File name: 	MemoryBudget.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: A memory budget for the scripts, so a job fits the memory it asked
+// 		the scheduler for. --mem-budget=<MB> on any script (or ITKSCRIPTS_MEM_BUDGET
+// 		for every script of a run) caps what a script may allocate for images.
+// 		Scripts estimate their image buffers from the file headers before
+// 		reading anything; over the budget they either go slab by slab (maximum
+// 		projections) or stop with the estimate. Peak resident memory is reported
+// 		from the kernel's high water mark (ResourceUsage.h).
+
+#ifndef ITKSCRIPTS_MEMORYBUDGET_H
+#define ITKSCRIPTS_MEMORYBUDGET_H
+
+#include "itkImage.h"
+#include "itkMaximumProjectionImageFilter.h"
+
+#include "ImageIO.h"
+#include "SliceView.h"
+#include "ResourceUsage.h"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <algorithm>
+
+// megabytes in text to bytes, 0 for anything that is not a positive number
+inline std::size_t parseMegabytes (const char * text){
+	char * end = nullptr;
+	const double megabytes = std::strtod(text, &end);
+	if (end == text || *end != '\0' || !(megabytes > 0.0)){ return 0; }
+	return (std::size_t)(megabytes*1024.0*1024.0);
+}
+
+// bytes scripts may allocate for images, 0 for no limit. Starts from
+// ITKSCRIPTS_MEM_BUDGET (MB), --mem-budget overrides it.
+inline std::size_t & memoryBudget (){
+	static std::size_t budget = std::getenv("ITKSCRIPTS_MEM_BUDGET") ? parseMegabytes(std::getenv("ITKSCRIPTS_MEM_BUDGET")) : 0;
+	return budget;
+}
+
+// Take --mem-budget=<MB> out of the arguments, wherever it is, so the scripts
+// keep their positional arguments. False (after saying why) for a bad value.
+inline bool takeMemoryBudget (int &argc, char * argv []){
+	const char * flag = "--mem-budget=";
+	int kept = 1;
+	bool ok = true;
+	for (int i = 1; i < argc; ++i){
+		if (std::strncmp(argv[i], flag, std::strlen(flag)) != 0){
+			argv[kept++] = argv[i];
+			continue;
+		}
+		memoryBudget() = parseMegabytes(argv[i] + std::strlen(flag));
+		if (memoryBudget() == 0){
+			std::cout << "--mem-budget takes megabytes, got " << argv[i] + std::strlen(flag) << std::endl;
+			ok = false;
+		}
+	}
+	argc = kept;
+	argv[argc] = nullptr;
+	return ok;
+}
+
+inline std::string megabytes (double bytes){
+	char text[32];
+	std::snprintf(text, sizeof(text), "%.0f MB", bytes/(1024.0*1024.0));
+	return text;
+}
+
+inline bool fitsMemoryBudget (double bytes){
+	return memoryBudget() == 0 || bytes <= (double)memoryBudget();
+}
+
+// stop before allocating when bytes (made of what) do not fit the budget
+inline void requireMemory (double bytes, const std::string &what){
+	if (!fitsMemoryBudget(bytes)){
+		itkGenericExceptionMacro(<< "needs about " << megabytes(bytes) << " for " << what << ", over the "
+			<< megabytes(memoryBudget()) << " memory budget (--mem-budget=<MB> or ITKSCRIPTS_MEM_BUDGET)");
+	}
+}
+
+// peak resident memory so far, after the last resetPeakRss
+inline void printPeakMemory (std::ostream &out, const std::string &when = "so far"){
+	const unsigned long long peak = peakRssBytes();
+	if (peak > 0){ out << "peak memory " << when << ": " << megabytes(peak) << std::endl; }
+}
+
+template< typename TImage >
+double regionBytes (const typename TImage::RegionType &region){
+	return (double)region.GetNumberOfPixels()*sizeof(typename TImage::PixelType);
+}
+
+// bytes of filename read whole as TImage, only the header is read
+template< typename TImage >
+double imageFileBytes (const std::string &filename){
+	return regionBytes< TImage >( readLargestRegion< TImage >( filename ) );
+}
+
+// Give projection, one voxel thick along direction, the geometry that
+// itk::MaximumProjectionImageFilter gives the projection of input: index 0, spacing
+// times size and the filter's origin along direction. Only input's information is used.
+template< typename TImage >
+void setProjectionGeometry (const TImage * input, int direction, TImage * projection){
+	typename TImage::Pointer information = TImage::New();
+	information->CopyInformation( input );
+	information->SetRegions( input->GetLargestPossibleRegion() );
+	using ProjectionType = itk::MaximumProjectionImageFilter< TImage, TImage >;
+	typename ProjectionType::Pointer filter = ProjectionType::New();
+	filter->SetInput( information );
+	filter->SetProjectionDimension( direction );
+	filter->UpdateOutputInformation();
+	projection->CopyInformation( filter->GetOutput() );
+	projection->SetRegions( filter->GetOutput()->GetLargestPossibleRegion() );
+}
+
+// Maximum projection of filename along direction, read slab by slab so that no more
+// than about budget bytes are held: a slab, the projection and the slab's projection.
+// The result has the geometry itk::MaximumProjectionImageFilter would give it.
+// Slabs stay small for .nii.gz, .isv, TIFF and uncompressed NIfTI/NRRD/MetaImage;
+// ITK reads other formats whole.
+template< typename TImage >
+typename TImage::Pointer readMaximumProjection (const std::string &filename, int direction, std::size_t budget){
+	const typename TImage::RegionType largest = readLargestRegion< TImage >( filename );
+	typename TImage::RegionType plane = largest;
+	typename TImage::SizeType planeSize = largest.GetSize();
+	planeSize[direction] = 1;
+	plane.SetSize( planeSize );
+	const double planeBytes = regionBytes< TImage >( plane );
+	const std::size_t depth = largest.GetSize()[direction];
+	if (budget > 0 && (double)budget < 3.0*planeBytes){
+		itkGenericExceptionMacro(<< "needs at least " << megabytes(3.0*planeBytes) << " to project " << filename
+			<< " one slice at a time, over the " << megabytes(budget) << " memory budget");
+	}
+	const std::size_t thickness = budget == 0 ? depth
+		: std::max<std::size_t>(1, std::min<std::size_t>(depth, (std::size_t)(((double)budget - 2.0*planeBytes)/planeBytes)));
+
+	typename TImage::Pointer projection, information;
+	std::vector<typename TImage::PixelType> slabMaximum;
+	for (std::size_t first = 0; first < depth; first += thickness){
+		typename TImage::RegionType slabRegion = largest;
+		typename TImage::IndexType slabStart = largest.GetIndex();
+		typename TImage::SizeType slabSize = largest.GetSize();
+		slabStart[direction] += first;
+		slabSize[direction] = std::min(thickness, depth - first);
+		slabRegion.SetIndex( slabStart );
+		slabRegion.SetSize( slabSize );
+		const typename TImage::Pointer slab = readImageRegion< TImage >( filename, slabRegion );
+		const VolumeView<typename TImage::PixelType> slabView = imageView(slab.GetPointer());
+
+		if (projection.IsNull()){
+			information = TImage::New();
+			information->CopyInformation( slab );
+			information->SetRegions( largest );
+			projection = TImage::New();
+			projection->CopyInformation( slab );
+			projection->SetRegions( plane );
+			projection->Allocate();
+			viewMaximum(slabView, direction, imageView(projection.GetPointer()).slice(direction, 0));
+			continue;
+		}
+		// the slab's own maximum, folded into what the earlier slabs gave
+		const SliceView<typename TImage::PixelType> out = imageView(projection.GetPointer()).slice(direction, 0);
+		slabMaximum.resize(out.pixels());
+		SliceView<typename TImage::PixelType> partial = out;
+		partial.data = slabMaximum.data();
+		partial.stride[0] = 1;
+		partial.stride[1] = out.size[0];
+		viewMaximum(slabView, direction, partial);
+		for (std::size_t v = 0; v < out.size[1]; ++v){
+			for (std::size_t u = 0; u < out.size[0]; ++u){
+				out(u, v) = std::max(out(u, v), partial(u, v));
+			}
+		}
+	}
+	setProjectionGeometry< TImage >( information, direction, projection );
+	return projection;
+}
+
+#endif
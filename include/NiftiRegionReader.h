@@ -0,0 +1,275 @@
+// File name: 	NiftiRegionReader.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Reads a region of a single file .nii.gz through the gzip index, so a
+// 		slice costs about one slice of inflating instead of the whole volume.
+// 		Only the voxel layout is parsed here (dims, datatype, vox_offset, scaling);
+// 		spacing, origin and direction still come from ITK's NIfTI reader.
+// 		The writer side builds the header ITK's NIfTI writer would, so a .nii.gz
+// 		can be deflated straight from the image buffer.
+
+#ifndef ITKSCRIPTS_NIFTIREGIONREADER_H
+#define ITKSCRIPTS_NIFTIREGIONREADER_H
+
+#include "GzipIndex.h"
+
+#include <cstdint>
+#include <cstring>
+#include <cmath>
+
+#include <string>
+#include <vector>
+#include <algorithm>
+
+constexpr std::size_t niftiHeaderBytes = 348;
+
+struct NiftiLayout {
+	uint64_t size[3];
+	int datatype;
+	int bytesPerVoxel;
+	uint64_t voxOffset;
+	double slope, intercept;
+	bool swapped;
+};
+
+template< typename T >
+inline T niftiField (const unsigned char * header, std::size_t offset, bool swapped){
+	T value;
+	unsigned char bytes[sizeof(T)];
+	std::memcpy(bytes, header + offset, sizeof(T));
+	if (swapped){ std::reverse(bytes, bytes + sizeof(T)); }
+	std::memcpy(&value, bytes, sizeof(T));
+	return value;
+}
+
+// false for anything this reader does not handle (NIfTI-2, 4D data, complex/RGB voxels)
+inline bool parseNiftiHeader (const unsigned char * header, NiftiLayout &layout){
+	layout.swapped = false;
+	if (niftiField<int32_t>(header, 0, false) != (int32_t)niftiHeaderBytes){
+		layout.swapped = true;
+		if (niftiField<int32_t>(header, 0, true) != (int32_t)niftiHeaderBytes){ return false; }
+	}
+	if (std::memcmp(header + 344, "n+1", 4) != 0){ return false; }	// data must follow the header
+
+	const int dimensions = niftiField<int16_t>(header, 40, layout.swapped);
+	if (dimensions < 1 || dimensions > 7){ return false; }
+	for (int d = 0; d < 7; ++d){
+		const int64_t extent = (d < dimensions) ? niftiField<int16_t>(header, 42 + 2*d, layout.swapped) : 1;
+		if (extent < 1 || (d >= 3 && extent != 1)){ return false; }
+		if (d < 3){ layout.size[d] = extent; }
+	}
+
+	layout.datatype = niftiField<int16_t>(header, 70, layout.swapped);
+	switch (layout.datatype){
+		case 2: case 256: layout.bytesPerVoxel = 1; break;		// uint8, int8
+		case 4: case 512: layout.bytesPerVoxel = 2; break;		// int16, uint16
+		case 8: case 768: case 16: layout.bytesPerVoxel = 4; break;	// int32, uint32, float32
+		case 64: layout.bytesPerVoxel = 8; break;			// float64
+		default: return false;
+	}
+	layout.voxOffset = (uint64_t)niftiField<float>(header, 108, layout.swapped);
+	layout.slope = niftiField<float>(header, 112, layout.swapped);
+	layout.intercept = niftiField<float>(header, 116, layout.swapped);
+	if (layout.slope == 0.0 || !std::isfinite(layout.slope)){	// 0 means no scaling
+		layout.slope = 1.0;
+		layout.intercept = 0.0;
+	}
+	return layout.voxOffset >= niftiHeaderBytes + 4;
+}
+
+template< typename TStored, typename TPixel >
+void convertNiftiRow (const unsigned char * in, std::size_t count, const NiftiLayout &layout, TPixel * out){
+	const bool scaled = layout.slope != 1.0 || layout.intercept != 0.0;
+	for (std::size_t i = 0; i < count; ++i){
+		unsigned char bytes[sizeof(TStored)];
+		std::memcpy(bytes, in + i*sizeof(TStored), sizeof(TStored));
+		if (layout.swapped){ std::reverse(bytes, bytes + sizeof(TStored)); }
+		TStored value;
+		std::memcpy(&value, bytes, sizeof(TStored));
+		out[i] = scaled ? static_cast<TPixel>(value*layout.slope + layout.intercept) : static_cast<TPixel>(value);
+	}
+}
+
+template< typename TPixel >
+void convertNiftiVoxels (const unsigned char * in, std::size_t count, const NiftiLayout &layout, TPixel * out){
+	switch (layout.datatype){
+		case 2: convertNiftiRow< uint8_t >(in, count, layout, out); break;
+		case 256: convertNiftiRow< int8_t >(in, count, layout, out); break;
+		case 4: convertNiftiRow< int16_t >(in, count, layout, out); break;
+		case 512: convertNiftiRow< uint16_t >(in, count, layout, out); break;
+		case 8: convertNiftiRow< int32_t >(in, count, layout, out); break;
+		case 768: convertNiftiRow< uint32_t >(in, count, layout, out); break;
+		case 16: convertNiftiRow< float >(in, count, layout, out); break;
+		case 64: convertNiftiRow< double >(in, count, layout, out); break;
+	}
+}
+
+inline bool isGzipNifti (const std::string &filename){
+	return filename.size() > 7 && filename.compare(filename.size() - 7, 7, ".nii.gz") == 0;
+}
+
+// Fill the buffered region of image (3D, already allocated) from filename.
+// Only the bytes between the first and last voxel of the region are inflated.
+// Returns false when the file is not something this reader handles.
+template< typename TImage >
+bool readNiftiGzRegion (const std::string &filename, TImage * image){
+	GzipIndex index;
+	if (TImage::ImageDimension != 3 || !openGzipIndex(filename, index)){ return false; }
+
+	unsigned char header[niftiHeaderBytes];
+	NiftiLayout layout;
+	if (!readGzipRange(filename, index, 0, niftiHeaderBytes, header, 1) || !parseNiftiHeader(header, layout)){
+		return false;
+	}
+
+	const typename TImage::RegionType region = image->GetBufferedRegion();
+	uint64_t start[3], count[3];
+	for (int d = 0; d < 3; ++d){
+		start[d] = region.GetIndex(d);
+		count[d] = region.GetSize(d);
+		if (start[d] + count[d] > layout.size[d]){ return false; }
+	}
+	if (count[0]*count[1]*count[2] == 0){ return true; }
+
+	const uint64_t rowBytes = count[0]*layout.bytesPerVoxel;
+	auto rowOffset = [&](uint64_t y, uint64_t z){
+		return ((z*layout.size[1] + y)*layout.size[0] + start[0])*layout.bytesPerVoxel;
+	};
+	const uint64_t first = rowOffset(start[1], start[2]);
+	const uint64_t last = rowOffset(start[1] + count[1] - 1, start[2] + count[2] - 1) + rowBytes;
+	std::vector<unsigned char> slab(last - first);
+	if (!readGzipRange(filename, index, layout.voxOffset + first, slab.size(), &slab[0])){
+		return false;
+	}
+
+	typename TImage::PixelType * out = image->GetBufferPointer();
+	for (uint64_t z = 0; z < count[2]; ++z){
+		for (uint64_t y = 0; y < count[1]; ++y){
+			convertNiftiVoxels(&slab[0] + rowOffset(start[1] + y, start[2] + z) - first, count[0], layout, out);
+			out += count[0];
+		}
+	}
+	return true;
+}
+
+// NIfTI datatype per pixel type; 0 means the image has to go through ITK's writer
+template< typename T > struct NiftiPixel { static const int16_t datatype = 0; };
+template<> struct NiftiPixel< unsigned char > { static const int16_t datatype = 2; };
+template<> struct NiftiPixel< signed char > { static const int16_t datatype = 256; };
+template<> struct NiftiPixel< char > { static const int16_t datatype = 256; };
+template<> struct NiftiPixel< short > { static const int16_t datatype = 4; };
+template<> struct NiftiPixel< unsigned short > { static const int16_t datatype = 512; };
+template<> struct NiftiPixel< int > { static const int16_t datatype = 8; };
+template<> struct NiftiPixel< unsigned int > { static const int16_t datatype = 768; };
+template<> struct NiftiPixel< float > { static const int16_t datatype = 16; };
+template<> struct NiftiPixel< double > { static const int16_t datatype = 64; };
+
+template< typename T >
+inline void setNiftiField (unsigned char * header, std::size_t offset, T value){
+	std::memcpy(header + offset, &value, sizeof(T));
+}
+
+// whether makeNiftiHeader can describe image and its buffer is the whole image
+template< typename TImage >
+bool isNiftiStreamable (const TImage * image){
+	return NiftiPixel< typename TImage::PixelType >::datatype != 0
+		&& (TImage::ImageDimension == 2 || TImage::ImageDimension == 3)
+		&& image->GetBufferedRegion() == image->GetLargestPossibleRegion();
+}
+
+// The single file header (with its 4 empty extension bytes) that puts the buffer of
+// image right behind it, in this machine's byte order. Like ITK's NIfTI writer the
+// geometry goes from LPS to RAS and is stored as both sform and qform, in mm.
+template< typename TImage >
+std::vector<unsigned char> makeNiftiHeader (const TImage * image){
+	using PixelType = typename TImage::PixelType;
+	const unsigned int dimension = TImage::ImageDimension;
+	std::vector<unsigned char> bytes(niftiHeaderBytes + 4, 0);
+	unsigned char * header = &bytes[0];
+
+	const typename TImage::RegionType region = image->GetBufferedRegion();
+	setNiftiField<int32_t>(header, 0, niftiHeaderBytes);
+	setNiftiField<int16_t>(header, 40, dimension);
+	for (unsigned int d = 0; d < 7; ++d){
+		setNiftiField<int16_t>(header, 42 + 2*d, d < dimension ? region.GetSize(d) : 1);
+	}
+	setNiftiField<int16_t>(header, 70, NiftiPixel< PixelType >::datatype);
+	setNiftiField<int16_t>(header, 72, 8*sizeof(PixelType));
+
+	// a 2D image lies in the z = 0 plane
+	double rotation[3][3] = {{1, 0, 0}, {0, 1, 0}, {0, 0, 1}};
+	double spacing[3] = {1, 1, 1}, origin[3] = {0, 0, 0};
+	typename TImage::PointType corner;
+	image->TransformIndexToPhysicalPoint(region.GetIndex(), corner);
+	for (unsigned int r = 0; r < dimension; ++r){
+		spacing[r] = image->GetSpacing()[r];
+		origin[r] = corner[r];
+		for (unsigned int c = 0; c < dimension; ++c){ rotation[r][c] = image->GetDirection()[r][c]; }
+	}
+	for (int r = 0; r < 2; ++r){	// LPS to RAS
+		origin[r] = -origin[r];
+		for (int c = 0; c < 3; ++c){ rotation[r][c] = -rotation[r][c]; }
+	}
+	for (int r = 0; r < 3; ++r){
+		for (int c = 0; c < 3; ++c){ setNiftiField<float>(header, 280 + 16*r + 4*c, rotation[r][c]*spacing[c]); }
+		setNiftiField<float>(header, 280 + 16*r + 12, origin[r]);
+	}
+
+	// quaternion as nifti_mat44_to_quatern does it, a flipped z goes into qfac
+	const double determinant =
+		rotation[0][0]*(rotation[1][1]*rotation[2][2] - rotation[1][2]*rotation[2][1])
+		- rotation[0][1]*(rotation[1][0]*rotation[2][2] - rotation[1][2]*rotation[2][0])
+		+ rotation[0][2]*(rotation[1][0]*rotation[2][1] - rotation[1][1]*rotation[2][0]);
+	const double qfac = determinant > 0 ? 1.0 : -1.0;
+	for (int r = 0; r < 3; ++r){ rotation[r][2] *= qfac; }
+	const double (&m)[3][3] = rotation;
+	double a = m[0][0] + m[1][1] + m[2][2] + 1.0, b, c, d;
+	if (a > 0.5){
+		a = 0.5*std::sqrt(a);
+		b = 0.25*(m[2][1] - m[1][2])/a;
+		c = 0.25*(m[0][2] - m[2][0])/a;
+		d = 0.25*(m[1][0] - m[0][1])/a;
+	} else {
+		const double xd = 1.0 + m[0][0] - (m[1][1] + m[2][2]);
+		const double yd = 1.0 + m[1][1] - (m[0][0] + m[2][2]);
+		const double zd = 1.0 + m[2][2] - (m[0][0] + m[1][1]);
+		if (xd > 1.0){
+			b = 0.5*std::sqrt(xd);
+			c = 0.25*(m[0][1] + m[1][0])/b;
+			d = 0.25*(m[0][2] + m[2][0])/b;
+			a = 0.25*(m[2][1] - m[1][2])/b;
+		} else if (yd > 1.0){
+			c = 0.5*std::sqrt(yd);
+			b = 0.25*(m[0][1] + m[1][0])/c;
+			d = 0.25*(m[1][2] + m[2][1])/c;
+			a = 0.25*(m[0][2] - m[2][0])/c;
+		} else {
+			d = 0.5*std::sqrt(zd);
+			b = 0.25*(m[0][2] + m[2][0])/d;
+			c = 0.25*(m[1][2] + m[2][1])/d;
+			a = 0.25*(m[1][0] - m[0][1])/d;
+		}
+		if (a < 0.0){
+			b = -b;
+			c = -c;
+			d = -d;
+		}
+	}
+
+	setNiftiField<float>(header, 76, qfac);	// pixdim[0]
+	for (int i = 1; i < 8; ++i){ setNiftiField<float>(header, 76 + 4*i, i <= 3 ? spacing[i - 1] : 1.0f); }
+	setNiftiField<float>(header, 108, niftiHeaderBytes + 4);	// vox_offset
+	setNiftiField<float>(header, 112, 1.0f);	// scl_slope, scl_inter stays 0
+	header[123] = 2 | 8;	// xyzt_units: mm and s
+	setNiftiField<int16_t>(header, 252, 1);	// qform_code and sform_code: scanner anatomical
+	setNiftiField<int16_t>(header, 254, 1);
+	setNiftiField<float>(header, 256, b);
+	setNiftiField<float>(header, 260, c);
+	setNiftiField<float>(header, 264, d);
+	for (int r = 0; r < 3; ++r){ setNiftiField<float>(header, 268 + 4*r, origin[r]); }
+	std::memcpy(header + 344, "n+1", 4);
+	return bytes;
+}
+
+#endif
@@ -0,0 +1,189 @@
+// File name: 	OutputCache.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Outputs kept by content, so re-running a script on inputs that did not
+// 		change costs a few hard links. Opt in with ITKSCRIPTS_CACHE_DIR=<dir>. A run
+// 		is keyed by XXH64 of the script's executable, its parameters, the content of
+// 		every input and the extension of every output; input hashes are kept in
+// 		<dir>/inputs and trusted while the file's size, mtime and inode stay the
+// 		same. On a hit the outputs (and their .gzidx) are linked from <dir>/<key>,
+// 		on a miss the script runs and its outputs are linked in afterwards. Runs
+// 		that print their result instead of writing it are not cached, nor runs that
+// 		read or write a header plus data file pair (.mhd/.raw, .hdr/.img).
+
+#ifndef ITKSCRIPTS_OUTPUTCACHE_H
+#define ITKSCRIPTS_OUTPUTCACHE_H
+
+#include "ContentHash.h"
+#include "FileNames.h"
+
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+
+// ITKSCRIPTS_CACHE_DIR without a trailing '/', empty when the cache is off
+inline std::string outputCacheDirectory (){
+	const char * value = std::getenv("ITKSCRIPTS_CACHE_DIR");
+	std::string directory = value ? value : "";
+	while (directory.size() > 1 && directory[directory.size() - 1] == '/'){ directory.erase(directory.size() - 1); }
+	return directory;
+}
+
+// src to dst through a temporary next to dst, so dst is whole or untouched. A hard
+// link where both are on one file system, a copy otherwise.
+inline bool linkOrCopy (const std::string &source, const std::string &target){
+	const std::string temporary = target + ".tmp" + std::to_string((long long)getpid());
+	unlink(temporary.c_str());
+	if (link(source.c_str(), temporary.c_str()) != 0){
+		std::ifstream in(source.c_str(), std::ios::binary);
+		std::ofstream out(temporary.c_str(), std::ios::binary);
+		out << in.rdbuf();
+		out.close();
+		if (!in || !out){
+			unlink(temporary.c_str());
+			return false;
+		}
+	}
+	const bool renamed = rename(temporary.c_str(), target.c_str()) == 0;
+	unlink(temporary.c_str());	// left behind when target already was the same file
+	return renamed;
+}
+
+// XXH64 of path's content, from <directory>/inputs while the file looks the same
+inline bool cachedContentHash (const std::string &directory, const std::string &path, uint64_t &hash){
+	char resolved[PATH_MAX];
+	struct stat info;
+	if (!realpath(path.c_str(), resolved) || stat(resolved, &info) != 0 || !S_ISREG(info.st_mode)){ return false; }
+	const std::string identity = std::string(resolved) + "|" + std::to_string((long long)info.st_size)
+		+ "|" + std::to_string((long long)info.st_mtim.tv_sec) + "." + std::to_string((long long)info.st_mtim.tv_nsec)
+		+ "|" + std::to_string((unsigned long long)info.st_ino);
+	const std::string memo = directory + "/inputs/" + hexHash(xxh64(resolved, std::strlen(resolved)));
+
+	std::ifstream in(memo.c_str());
+	std::string line;
+	if (std::getline(in, line) && line == identity && std::getline(in, line) && line.size() == 16){
+		hash = std::strtoull(line.c_str(), nullptr, 16);
+		return true;
+	}
+	if (!hashFile(resolved, hash)){ return false; }
+	mkdir((directory + "/inputs").c_str(), 0755);
+	const std::string temporary = memo + ".tmp" + std::to_string((long long)getpid());
+	std::ofstream out(temporary.c_str());
+	out << identity << "\n" << hexHash(hash) << "\n";
+	out.close();
+	if (!out || rename(temporary.c_str(), memo.c_str()) != 0){ unlink(temporary.c_str()); }
+	return true;
+}
+
+// The outputs of one run of a script. Off (restore() false, store() nothing) without
+// ITKSCRIPTS_CACHE_DIR, when an input cannot be read (the script then fails as usual),
+// or when a file comes as a header plus data pair.
+class OutputCache {
+public:
+	OutputCache () {}
+
+	// parameters are whatever changes the outputs besides the inputs' content: not the
+	// file names, which may move, but the options and the output types
+	OutputCache (const std::string &script, const std::vector<std::string> &parameters,
+			const std::vector<std::string> &inputs, const std::vector<std::string> &outputs)
+			: m_Outputs(outputs) {
+		const std::string directory = outputCacheDirectory();
+		if (directory.empty() || outputs.empty()){ return; }
+		for (const std::vector<std::string> * files : { &inputs, &outputs }){
+			for (const std::string &file : *files){
+				if (writtenInPlace(file)){ return; }	// the data file would go unhashed and unlinked
+			}
+		}
+		mkdir(directory.c_str(), 0755);
+
+		Xxh64 key;
+		uint64_t hash;
+		if (!cachedContentHash(directory, "/proc/self/exe", hash)){ return; }
+		key.update(script + '\0' + hexHash(hash) + '\0');
+		for (const std::string &parameter : parameters){ key.update(parameter + '\0'); }
+		key.update("inputs\0", 7);
+		for (const std::string &input : inputs){
+			if (!cachedContentHash(directory, input, hash)){ return; }
+			key.update(hexHash(hash) + '\0');
+		}
+		key.update("outputs\0", 8);
+		for (const std::string &output : outputs){ key.update(fileExtension(output) + '\0'); }
+		m_Entry = directory + "/" + hexHash(key.digest());
+	}
+
+	bool enabled () const { return !m_Entry.empty(); }
+
+	// true when every output was linked from the cache. On a miss, outputs that are
+	// still linked to an entry are unlinked first, so the run writes new files
+	// instead of overwriting the cached ones in place.
+	bool restore (){
+		if (!enabled()){ return false; }
+		struct stat info;
+		bool hit = stat(m_Entry.c_str(), &info) == 0;
+		for (std::size_t i = 0; i < m_Outputs.size() && hit; ++i){
+			hit = linkOrCopy(entryFile(i), m_Outputs[i]);
+			if (hit && stat((entryFile(i) + ".gzidx").c_str(), &info) == 0){
+				hit = linkOrCopy(entryFile(i) + ".gzidx", m_Outputs[i] + ".gzidx");
+			}
+		}
+		if (hit){
+			std::cout << "unchanged inputs, " << m_Outputs.size() << " output" << (m_Outputs.size() > 1 ? "s" : "")
+				<< " linked from " << m_Entry << std::endl;
+			return true;
+		}
+		for (const std::string &output : m_Outputs){
+			for (const std::string &path : { output, output + ".gzidx" }){
+				if (stat(path.c_str(), &info) == 0 && info.st_nlink > 1){ unlink(path.c_str()); }
+			}
+		}
+		return false;
+	}
+
+	// after a run that succeeded: the outputs (and .gzidx) go into the entry, all or none
+	void store (){
+		if (!enabled()){ return; }
+		const std::string temporary = m_Entry + ".tmp" + std::to_string((long long)getpid());
+		if (mkdir(temporary.c_str(), 0755) != 0){ return; }
+		bool ok = true;
+		struct stat info;
+		for (std::size_t i = 0; i < m_Outputs.size() && ok; ++i){
+			ok = linkOrCopy(m_Outputs[i], temporary + "/" + std::to_string((unsigned long long)i));
+			if (ok && stat((m_Outputs[i] + ".gzidx").c_str(), &info) == 0){
+				ok = linkOrCopy(m_Outputs[i] + ".gzidx", temporary + "/" + std::to_string((unsigned long long)i) + ".gzidx");
+			}
+		}
+		// another run may have stored the same entry meanwhile, its copy is as good
+		if (!ok || rename(temporary.c_str(), m_Entry.c_str()) != 0){ removeDirectory(temporary); }
+	}
+
+private:
+	std::string entryFile (std::size_t i) const {
+		return m_Entry + "/" + std::to_string((unsigned long long)i);
+	}
+
+	static void removeDirectory (const std::string &path){
+		DIR * directory = opendir(path.c_str());
+		if (!directory){ return; }
+		while (struct dirent * entry = readdir(directory)){
+			const std::string name = entry->d_name;
+			if (name != "." && name != ".."){ unlink((path + "/" + name).c_str()); }
+		}
+		closedir(directory);
+		rmdir(path.c_str());
+	}
+
+	std::vector<std::string> m_Outputs;
+	std::string m_Entry;
+};
+
+#endif
@@ -0,0 +1,148 @@
+// File name: 	ParallelGzip.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: pigz style compression. The input is cut into fixed blocks that are
+// 		deflated on all cores, each into a complete gzip member, and the members
+// 		are concatenated in order. gzip, zlib's gzread and so every NIfTI reader
+// 		read multi-member files as one stream. Member starts are exactly the
+// 		access points GzipIndex.h needs, so the index comes for free.
+
+#ifndef ITKSCRIPTS_PARALLELGZIP_H
+#define ITKSCRIPTS_PARALLELGZIP_H
+
+#include "itk_zlib.h"
+#include "GzipIndex.h"
+#include "WorkerThreads.h"
+#include "Trace.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstdio>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+#include <utility>
+
+constexpr std::size_t gzipBlockSize = 4 << 20;	// same spacing as the index points
+
+// one complete gzip member holding in[0, length)
+inline bool deflateMember (const unsigned char * in, std::size_t length, int level, std::vector<unsigned char> &out){
+	z_stream stream;
+	std::memset(&stream, 0, sizeof(stream));
+	if (deflateInit2(&stream, level, Z_DEFLATED, 31, 8, Z_DEFAULT_STRATEGY) != Z_OK){ return false; }	// 16 + 15: gzip wrapper
+	out.resize(deflateBound(&stream, length));
+	stream.next_in = const_cast<unsigned char *>(in);
+	stream.avail_in = length;
+	stream.next_out = &out[0];
+	stream.avail_out = out.size();
+	const int ret = deflate(&stream, Z_FINISH);
+	out.resize(out.size() - stream.avail_out);
+	deflateEnd(&stream);
+	return ret == Z_STREAM_END;
+}
+
+// ITKSCRIPTS_GZIP_LEVEL=1..9 for the .nii.gz the scripts write, zlib's default otherwise
+inline int gzipLevel (){
+	const char * value = std::getenv("ITKSCRIPTS_GZIP_LEVEL");
+	const int level = value ? std::atoi(value) : 0;
+	return (level >= 1 && level <= 9) ? level : Z_DEFAULT_COMPRESSION;
+}
+
+// A byte stream made of pieces that already sit in memory, e.g. a file header
+// followed by an image buffer, so neither has to be copied into one block.
+using GzipParts = std::vector< std::pair<const unsigned char *, std::size_t> >;
+
+// stream[begin, begin + size) as one pointer: straight into the piece holding it,
+// or gathered into scratch when the range spans pieces
+inline const unsigned char * gzipPartsRange (const GzipParts &parts, std::size_t begin, std::size_t size,
+		std::vector<unsigned char> &scratch){
+	std::size_t start = 0, p = 0;
+	while (p < parts.size() && begin >= start + parts[p].second){ start += parts[p++].second; }
+	if (p == parts.size() || begin + size <= start + parts[p].second){
+		return size ? parts[p].first + (begin - start) : nullptr;
+	}
+	scratch.resize(size);
+	for (std::size_t copied = 0; copied < size; start += parts[p++].second){
+		const std::size_t offset = begin + copied - start;
+		const std::size_t n = std::min(size - copied, parts[p].second - offset);
+		std::memcpy(&scratch[copied], parts[p].first + offset, n);
+		copied += n;
+	}
+	return &scratch[0];
+}
+
+// Compress the concatenation of parts into outputPath and store the matching .gzidx.
+// Blocks are done in rounds of a few per thread so memory stays bounded on big volumes.
+inline bool compressPartsParallel (const GzipParts &parts, const std::string &outputPath,
+		int level = Z_DEFAULT_COMPRESSION, unsigned int threads = workerThreads()){
+	FILE * file = std::fopen(outputPath.c_str(), "wb");
+	if (!file){ return false; }
+
+	std::size_t length = 0;
+	for (const auto &part : parts){ length += part.second; }
+	threads = std::max(1u, threads);
+	const std::size_t blocks = std::max<std::size_t>(1, (length + gzipBlockSize - 1)/gzipBlockSize);
+	const std::size_t round = 4*threads;
+	std::vector< std::vector<unsigned char> > members(std::min(round, blocks));
+	std::vector< std::vector<unsigned char> > scratch(members.size());
+	GzipIndex index;
+	index.totalOut = length;
+	uint64_t written = 0;
+	std::atomic<bool> ok(true);
+
+	for (std::size_t first = 0; first < blocks && ok; first += round){
+		const std::size_t count = std::min(round, blocks - first);
+		std::atomic<std::size_t> next(0);
+		auto worker = [&](){
+			for (std::size_t b = next++; b < count && ok; b = next++){
+				const std::size_t begin = (first + b)*gzipBlockSize;
+				const std::size_t size = std::min(gzipBlockSize, length - begin);
+				TraceSpan span("compress", "gzip");
+				span.setBytes(size);
+				const unsigned char * in = gzipPartsRange(parts, begin, size, scratch[b]);
+				if (!deflateMember(in, size, level, members[b])){ ok = false; }
+			}
+		};
+		runWorkers(std::min<std::size_t>(threads, count), worker);
+
+		for (std::size_t b = 0; b < count && ok; ++b){
+			addMemberStart(index, written, (first + b)*gzipBlockSize);
+			if (std::fwrite(&members[b][0], 1, members[b].size(), file) != members[b].size()){ ok = false; }
+			written += members[b].size();
+		}
+	}
+
+	if (std::fclose(file) != 0){ ok = false; }
+	if (ok){ saveGzipIndex(outputPath, index); }
+	return ok;
+}
+
+// compressPartsParallel over the mapped contents of inputPath
+inline bool compressFileParallel (const std::string &inputPath, const std::string &outputPath,
+		int level = Z_DEFAULT_COMPRESSION, unsigned int threads = workerThreads()){
+	int fd = open(inputPath.c_str(), O_RDONLY);
+	if (fd < 0){ return false; }
+	struct stat info;
+	if (fstat(fd, &info) != 0){
+		close(fd);
+		return false;
+	}
+	const std::size_t length = info.st_size;
+	void * mapped = length ? mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0) : nullptr;
+	close(fd);
+	if (mapped == MAP_FAILED){ return false; }
+	const GzipParts parts(1, std::make_pair(static_cast<const unsigned char *>(mapped), length));
+	const bool ok = compressPartsParallel(parts, outputPath, level, threads);
+	if (mapped){ munmap(mapped, length); }
+	return ok;
+}
+
+#endif
@@ -0,0 +1,246 @@
+// File name: 	PerfCounters.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Hardware counters around a stage, to tell whether it is bound by memory,
+// 		branches or compute. With ITKSCRIPTS_PERF=1 a group of cycles,
+// 		instructions, last level cache misses and branch misses is opened with
+// 		perf_event_open (user space only, so perf_event_paranoid up to 2 is fine)
+// 		and the stage timings get IPC, misses per thousand instructions and bytes
+// 		per cycle next to them. Where the counters are not permitted or there is
+// 		no PMU (containers, most VMs) the reason is printed once and the timings
+// 		come out as before. Work a stage hands to the WorkerThreads.h pool is
+// 		counted too: every pool thread keeps a group of its own and adds what it
+// 		counted while working for the stage to the stage's sample. Linux only.
+
+#ifndef ITKSCRIPTS_PERFCOUNTERS_H
+#define ITKSCRIPTS_PERFCOUNTERS_H
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+#include <string>
+#include <fstream>
+#include <iostream>
+#include <atomic>
+#include <mutex>
+
+struct PerfSample {
+	bool valid;	// every counter was scheduled at some point
+	double cycles, instructions, cacheMisses, branchMisses;
+
+	PerfSample & operator+= (const PerfSample &other){
+		valid = valid && other.valid;
+		cycles += other.cycles;
+		instructions += other.instructions;
+		cacheMisses += other.cacheMisses;
+		branchMisses += other.branchMisses;
+		return *this;
+	}
+};
+
+inline PerfSample emptyPerfSample (){
+	PerfSample sample = { true, 0.0, 0.0, 0.0, 0.0 };
+	return sample;
+}
+
+inline PerfSample operator- (PerfSample later, const PerfSample &earlier){
+	later.valid = later.valid && earlier.valid;
+	later.cycles -= earlier.cycles;
+	later.instructions -= earlier.instructions;
+	later.cacheMisses -= earlier.cacheMisses;
+	later.branchMisses -= earlier.branchMisses;
+	return later;
+}
+
+// counts of pool threads, gathered for the counters of the thread they work for
+struct PerfSink {
+	PerfSink () : total(emptyPerfSample()) {}
+	void add (const PerfSample &sample){
+		std::lock_guard<std::mutex> lock(mutex);
+		total += sample;
+	}
+	std::mutex mutex;
+	PerfSample total;
+};
+
+// the sink of the counters running on this thread, null when nothing counts it
+inline PerfSink *& perfSink (){
+	static thread_local PerfSink * sink = nullptr;
+	return sink;
+}
+
+// ITKSCRIPTS_PERF set to anything but 0
+inline bool perfCountersRequested (){
+	const char * value = std::getenv("ITKSCRIPTS_PERF");
+	return value && *value && std::strcmp(value, "0") != 0;
+}
+
+// one group of the four counters
+class PerfCounters {
+public:
+	// Counts the calling thread, and with inherit also the threads it starts
+	// afterwards (their counts arrive when they exit, so join them before stop).
+	// Pool threads exist before and outlive a stage, they add their own counts
+	// through the sink instead. Nothing is opened unless ITKSCRIPTS_PERF asks for it.
+	explicit PerfCounters (bool inherit = true) : m_Previous(nullptr) {
+		for (int &fd : m_Fds){ fd = -1; }
+		if (!perfCountersRequested()){ return; }
+		const uint64_t configs[Count] = { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+			PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES };
+		for (int c = 0; c < Count; ++c){
+			perf_event_attr attr;
+			std::memset(&attr, 0, sizeof(attr));
+			attr.size = sizeof(attr);
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = configs[c];
+			attr.disabled = (c == 0);	// the leader starts and stops the group
+			attr.inherit = inherit;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+			m_Fds[c] = syscall(__NR_perf_event_open, &attr, 0, -1, c == 0 ? -1 : m_Fds[0], PERF_FLAG_FD_CLOEXEC);
+			if (m_Fds[c] < 0){
+				m_Error = std::strerror(errno);
+				close();
+				reportUnavailable(m_Error);
+				return;
+			}
+		}
+	}
+
+	~PerfCounters (){ close(); }
+	PerfCounters (const PerfCounters &) = delete;
+	PerfCounters & operator= (const PerfCounters &) = delete;
+
+	bool available () const { return m_Fds[0] >= 0; }
+
+	void start (){
+		if (!available()){ return; }
+		m_Sink.total = emptyPerfSample();
+		m_Previous = perfSink();
+		perfSink() = &m_Sink;
+		ioctl(m_Fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+		ioctl(m_Fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+	}
+
+	// counts since start, the pool threads' included, scaled up where the kernel
+	// had to multiplex the PMU
+	PerfSample stop (){
+		if (!available()){ return read(); }
+		ioctl(m_Fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+		perfSink() = m_Previous;
+		PerfSample sample = read();
+		std::lock_guard<std::mutex> lock(m_Sink.mutex);
+		sample += m_Sink.total;
+		return sample;
+	}
+
+	// counts so far, without stopping
+	PerfSample read () const {
+		PerfSample sample = emptyPerfSample();
+		if (!available()){
+			sample.valid = false;
+			return sample;
+		}
+		double values[Count];
+		for (int c = 0; c < Count; ++c){
+			uint64_t read3[3];	// value, time enabled, time running
+			if (::read(m_Fds[c], read3, sizeof(read3)) != (ssize_t)sizeof(read3) || read3[2] == 0){
+				sample.valid = false;
+				values[c] = 0.0;
+			} else {
+				values[c] = (double)read3[0]*read3[1]/read3[2];
+			}
+		}
+		sample.cycles = values[0];
+		sample.instructions = values[1];
+		sample.cacheMisses = values[2];
+		sample.branchMisses = values[3];
+		return sample;
+	}
+
+private:
+	enum { Count = 4 };
+
+	void close (){
+		for (int c = Count - 1; c >= 0; --c){
+			if (m_Fds[c] >= 0){ ::close(m_Fds[c]); }
+			m_Fds[c] = -1;
+		}
+	}
+
+	// once per process, every stage would fail the same way
+	static void reportUnavailable (const std::string &error){
+		static std::atomic<bool> reported(false);
+		if (reported.exchange(true)){ return; }
+		std::ifstream paranoid("/proc/sys/kernel/perf_event_paranoid");
+		int level = 0;
+		std::cout << "hardware counters unavailable (" << error;
+		if (paranoid >> level){ std::cout << ", perf_event_paranoid is " << level; }
+		std::cout << "), timings only" << std::endl;
+	}
+
+	int m_Fds[Count];
+	std::string m_Error;
+	PerfSink m_Sink;
+	PerfSink * m_Previous;
+};
+
+// While a pool thread works for a counted thread: the pool thread's own counts over
+// the work go to that thread's sink. Each pool thread opens its group once, the
+// first time it works for a counted thread, and leaves it running.
+class PerfSinkScope {
+public:
+	explicit PerfSinkScope (PerfSink * sink) : m_Sink(sink), m_Previous(perfSink()) {
+		if (m_Sink){ m_Before = threadCounters().read(); }
+		perfSink() = sink;
+	}
+
+	~PerfSinkScope (){
+		if (m_Sink){ m_Sink->add(threadCounters().read() - m_Before); }
+		perfSink() = m_Previous;
+	}
+
+	PerfSinkScope (const PerfSinkScope &) = delete;
+	PerfSinkScope & operator= (const PerfSinkScope &) = delete;
+
+private:
+	static PerfCounters & threadCounters (){
+		static thread_local PerfCounters counters(false);
+		static thread_local bool started = false;
+		if (!started){
+			PerfSink * current = perfSink();
+			counters.start();
+			perfSink() = current;	// start installed the group's own sink, nothing reads that one
+			started = true;
+		}
+		return counters;
+	}
+
+	PerfSink * m_Sink;
+	PerfSink * m_Previous;
+	PerfSample m_Before;
+};
+
+// ", IPC 1.85, 2.1 LLC / 4.3 branch misses per kinstr, 0.83 bytes/cycle" to follow a
+// timing, empty for an invalid sample. bytes is what the stage read or wrote, 0 to leave it out.
+inline std::string describePerfSample (const PerfSample &sample, double bytes = 0.0){
+	if (!sample.valid || sample.cycles <= 0.0 || sample.instructions <= 0.0){ return ""; }
+	char text[160];
+	const double kilo = sample.instructions/1000.0;
+	int length = std::snprintf(text, sizeof(text), ", IPC %.2f, %.2f LLC / %.2f branch misses per kinstr",
+		sample.instructions/sample.cycles, sample.cacheMisses/kilo, sample.branchMisses/kilo);
+	if (bytes > 0.0 && length > 0 && length < (int)sizeof(text)){
+		std::snprintf(text + length, sizeof(text) - length, ", %.2f bytes/cycle", bytes/sample.cycles);
+	}
+	return text;
+}
+
+#endif
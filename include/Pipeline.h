@@ -0,0 +1,689 @@
+// File name: 	Pipeline.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: In-memory pipeline of stages (read, extract, normalize, project, ...).
+// 		One float volume is handed from stage to stage, nothing touches ../output/
+// 		until a write stage. Intensity stages (normalize, rescale) do not touch the
+// 		buffer: they stack up a per-slice affine that is applied in one pass by the
+// 		next stage that needs real voxels, so chains of them cost one sweep.
+
+#ifndef ITKSCRIPTS_PIPELINE_H
+#define ITKSCRIPTS_PIPELINE_H
+
+#include "itkImage.h"
+
+#include "ImageIO.h"
+#include "FileNames.h"
+#include "Transpose.h"
+#include "SliceView.h"
+#include "StackAssembler.h"
+#include "SliceSeries.h"
+#include "Trace.h"
+#include "PerfCounters.h"
+#include "MemoryBudget.h"
+#include "OutputCache.h"
+
+#include <string>
+#include <vector>
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <limits>
+
+using PipelinePixelType = float;
+using PipelineImageType = itk::Image< PipelinePixelType, 3 >;
+using PipelineSliceType = itk::Image< PipelinePixelType, 2 >;
+
+// the two in-slice axes for a slicing direction, in increasing order
+inline void sliceAxes (int direction, int &axisU, int &axisV){
+	axisU = (direction == 0) ? 1 : 0;
+	axisV = (direction == 2) ? 1 : 2;
+}
+
+// v -> scale[k]*v + shift[k] for slice k along axis, not applied to the buffer yet.
+// axis == -1 means a single global scale/shift stored at [0].
+struct PendingAffine {
+	int axis;
+	std::vector<double> scale;
+	std::vector<double> shift;
+
+	PendingAffine() : axis(-1), scale(1, 1.0), shift(1, 0.0) {}
+
+	bool isIdentity() const {
+		for (std::size_t k = 0; k < scale.size(); ++k){
+			if (scale[k] != 1.0 || shift[k] != 0.0){ return false; }
+		}
+		return true;
+	}
+	double scaleAt (std::size_t k) const { return axis < 0 ? scale[0] : scale[k]; }
+	double shiftAt (std::size_t k) const { return axis < 0 ? shift[0] : shift[k]; }
+
+	// turn a global affine into a per-slice one with n slices along newAxis
+	void expand (int newAxis, std::size_t n){
+		if (axis >= 0){ return; }
+		axis = newAxis;
+		scale.assign(n, scale[0]);
+		shift.assign(n, shift[0]);
+	}
+};
+
+// what flows between stages
+struct PipelineState {
+	PipelineImageType::Pointer image;
+	PendingAffine pending;
+
+	// apply the pending affine to the buffer in one pass
+	void materialize (){
+		if (image.IsNull() || pending.isIdentity()){ pending = PendingAffine(); return; }
+		const PipelineImageType::SizeType size = image->GetBufferedRegion().GetSize();
+		PipelinePixelType * buffer = image->GetBufferPointer();
+		const std::size_t n = (std::size_t)size[0]*size[1]*size[2];
+		if (pending.axis < 0){
+			const float s = pending.scale[0], t = pending.shift[0];
+			for (std::size_t k = 0; k < n; ++k){ buffer[k] = s*buffer[k] + t; }
+		} else {
+			std::size_t k = 0;
+			for (std::size_t z = 0; z < size[2]; ++z){
+				for (std::size_t y = 0; y < size[1]; ++y){
+					for (std::size_t x = 0; x < size[0]; ++x, ++k){
+						const std::size_t slice = (pending.axis == 0) ? x : (pending.axis == 1) ? y : z;
+						buffer[k] = (float)(pending.scale[slice]*buffer[k] + pending.shift[slice]);
+					}
+				}
+			}
+		}
+		pending = PendingAffine();
+	}
+};
+
+// a stage as typed on the command line: name and its arguments
+struct PipelineStage {
+	std::string name;
+	std::vector<std::string> args;
+};
+
+using StageFunction = void (*)(PipelineState &, const std::vector<std::string> &);
+
+struct StageInfo {
+	const char * name;
+	unsigned int minArgs;
+	unsigned int maxArgs;
+	const char * usage;
+	StageFunction run;
+};
+
+/********** HELPERS **********/
+
+inline int stageInt (const std::string &value, const char * what){
+	char * end = nullptr;
+	long result = std::strtol(value.c_str(), &end, 10);
+	if (value.empty() || *end != '\0'){
+		itkGenericExceptionMacro(<< "expected an integer for " << what << ", got '" << value << "'");
+	}
+	return (int)result;
+}
+
+inline double stageDouble (const std::string &value, const char * what){
+	char * end = nullptr;
+	double result = std::strtod(value.c_str(), &end);
+	if (value.empty() || *end != '\0'){
+		itkGenericExceptionMacro(<< "expected a number for " << what << ", got '" << value << "'");
+	}
+	return result;
+}
+
+inline int stageDirection (const std::string &value){
+	int direction = stageInt(value, "direction");
+	if (direction < 0 || direction > 2){
+		itkGenericExceptionMacro(<< "direction must be 0, 1 or 2, got " << direction);
+	}
+	return direction;
+}
+
+inline void requireImage (const PipelineState &state, const char * stage){
+	if (state.image.IsNull()){
+		itkGenericExceptionMacro(<< stage << " needs an image, start the pipeline with read");
+	}
+}
+
+// the axis of size 1 (a single slice), or fallback if the image is a real volume
+inline int singletonAxis (const PipelineImageType * image, int fallback){
+	const PipelineImageType::SizeType size = image->GetBufferedRegion().GetSize();
+	for (int d = 2; d >= 0; --d){
+		if (size[d] == 1){ return d; }
+	}
+	return fallback;
+}
+
+// new image with the geometry of region inside image, starting at index 0
+inline PipelineImageType::Pointer allocateLike (const PipelineImageType * image, const PipelineImageType::RegionType &region){
+	PipelineImageType::PointType origin;
+	image->TransformIndexToPhysicalPoint( region.GetIndex(), origin );
+	PipelineImageType::RegionType outRegion;
+	outRegion.SetSize( region.GetSize() );
+	PipelineImageType::IndexType start;
+	start.Fill(0);
+	outRegion.SetIndex( start );
+
+	PipelineImageType::Pointer output = PipelineImageType::New();
+	output->SetRegions( outRegion );
+	output->SetSpacing( image->GetSpacing() );
+	output->SetDirection( image->GetDirection() );
+	output->SetOrigin( origin );
+	output->Allocate();
+	return output;
+}
+
+// copy region (in buffer coordinates) of image into a new image, row by row
+inline PipelineImageType::Pointer copyRegion (const PipelineImageType * image, const PipelineImageType::RegionType &region){
+	PipelineImageType::Pointer output = allocateLike(image, region);
+	const PipelineImageType::SizeType size = image->GetBufferedRegion().GetSize();
+	const PipelineImageType::IndexType bufferStart = image->GetBufferedRegion().GetIndex();
+	const PipelineImageType::SizeType outSize = region.GetSize();
+	const PipelineImageType::IndexType start = region.GetIndex();
+	const PipelinePixelType * in = image->GetBufferPointer();
+	PipelinePixelType * out = output->GetBufferPointer();
+	for (std::size_t z = 0; z < outSize[2]; ++z){
+		for (std::size_t y = 0; y < outSize[1]; ++y){
+			const std::size_t inOffset = (start[0]-bufferStart[0])
+				+ size[0]*((start[1]-bufferStart[1]+y) + size[1]*(start[2]-bufferStart[2]+z));
+			std::memcpy(out + outSize[0]*(y + outSize[1]*z), in + inOffset, outSize[0]*sizeof(PipelinePixelType));
+		}
+	}
+	return output;
+}
+
+// statistics of the raw voxels in a (2*step+1)^2 window of slice k, read through a view
+inline RegionStatistics sliceRoiStatistics (const PipelineImageType * image, int direction, std::size_t k, int x, int y, int step){
+	const SliceView<const PipelinePixelType> slice = imageView(image).slice(direction, k);
+	if ((x-step) < 0 || (x+step) >= (int)slice.size[0]){ itkGenericExceptionMacro(<< "step is out of bound x"); }
+	if ((y-step) < 0 || (y+step) >= (int)slice.size[1]){ itkGenericExceptionMacro(<< "step is out of bound y"); }
+	return viewStatistics(slice.window(x-step, y-step, 2*step+1, 2*step+1));
+}
+
+/********** STAGES **********/
+
+// the part of a file read <path> [<direction> <first>[:<last>]] decodes, only the header is read
+inline PipelineImageType::RegionType readStageRegion (const std::vector<std::string> &args){
+	PipelineImageType::RegionType region = readLargestRegion< PipelineImageType >( args[0] );
+	if (args.size() == 1){ return region; }
+	if (args.size() < 3){ itkGenericExceptionMacro(<< "read needs slices after the direction"); }
+	const int direction = stageDirection(args[1]);
+	const std::size_t colon = args[2].find(":");
+	const int first = stageInt(args[2].substr(0, colon), "first slice");
+	const int last = (colon == std::string::npos) ? first : stageInt(args[2].substr(colon+1), "last slice");
+
+	PipelineImageType::SizeType size = region.GetSize();
+	PipelineImageType::IndexType start = region.GetIndex();
+	if (first < 0 || last < first || last >= (int)size[direction]){
+		itkGenericExceptionMacro(<< "slices " << first << ":" << last << " out of range along direction " << direction);
+	}
+	start[direction] += first;
+	size[direction] = last - first + 1;
+	region.SetIndex( start );
+	region.SetSize( size );
+	return region;
+}
+
+// read <path> [<direction> <first>[:<last>]], with slices only those are decoded.
+// A series pattern (slice%03d.tif) is a virtual volume along z: read <pattern> 2 <first>:<last>
+inline void readStage (PipelineState &state, const std::vector<std::string> &args){
+	state.pending = PendingAffine();
+	if (isSeriesPattern(args[0])){
+		if (args.size() < 3 || stageDirection(args[1]) != 2){ itkGenericExceptionMacro(<< "a series is read as read <pattern> 2 <first>[:<last>]"); }
+		const std::size_t colon = args[2].find(":");
+		const int first = stageInt(args[2].substr(0, colon), "first slice");
+		const int last = (colon == std::string::npos) ? first : stageInt(args[2].substr(colon+1), "last slice");
+		SliceSeries< PipelinePixelType > series( args[0], first, last );
+		state.image = series.extract< PipelineImageType >( 0, series.slices() - 1 );
+		return;
+	}
+	if (args.size() == 1){
+		state.image = readImage< PipelineImageType >( args[0] );
+		return;
+	}
+	state.image = readImageRegion< PipelineImageType >( args[0], readStageRegion(args) );
+}
+
+// stack <pattern> <first>:<last> [direction] [spacing], c3d -tile: the slices
+// seriesFileName(pattern, first..last) become one volume, decoded in parallel
+inline void stackStage (PipelineState &state, const std::vector<std::string> &args){
+	if (!isSeriesPattern(args[0])){ itkGenericExceptionMacro(<< "stack needs a pattern with one %d, like slice%03d.tif"); }
+	const std::size_t colon = args[1].find(":");
+	if (colon == std::string::npos){ itkGenericExceptionMacro(<< "stack needs slices as <first>:<last>"); }
+	const int first = stageInt(args[1].substr(0, colon), "first slice");
+	const int last = stageInt(args[1].substr(colon+1), "last slice");
+	if (first < 0 || last < first){ itkGenericExceptionMacro(<< "slices " << first << ":" << last << " are not a range"); }
+	const int direction = (args.size() > 2) ? stageDirection(args[2]) : 2;
+	const double spacing = (args.size() > 3) ? stageDouble(args[3], "spacing") : 1.0;
+
+	state.pending = PendingAffine();
+	state.image = assembleStack< PipelineImageType >( seriesFileNames(args[0], first, last), direction, spacing );
+}
+
+// 2D-only formats get the singleton axis collapsed before writing
+inline bool isSliceFormat (const std::string &filename){
+	const std::string extension = fileExtension(filename);
+	return extension == ".tif" || extension == ".tiff" || extension == ".png"
+		|| extension == ".jpg" || extension == ".jpeg" || extension == ".bmp";
+}
+
+// image with the pixels of image as TOutImage's, clamped to that type's range and
+// truncated, the way a script's own pixel type holds its results
+template< typename TOutImage, typename TInImage >
+typename TOutImage::Pointer castImage (const TInImage * image){
+	using OutPixel = typename TOutImage::PixelType;
+	const double lowest = std::numeric_limits<OutPixel>::lowest(), highest = std::numeric_limits<OutPixel>::max();
+	typename TOutImage::Pointer output = TOutImage::New();
+	output->CopyInformation( image );
+	output->SetRegions( image->GetBufferedRegion() );
+	output->Allocate();
+	const typename TInImage::PixelType * in = image->GetBufferPointer();
+	OutPixel * out = output->GetBufferPointer();
+	const std::size_t count = image->GetBufferedRegion().GetNumberOfPixels();
+	for (std::size_t i = 0; i < count; ++i){
+		out[i] = static_cast<OutPixel>(std::min(highest, std::max(lowest, (double)in[i])));
+	}
+	return output;
+}
+
+// image as TPixel, the slice across axis in 2D (a volume for axis -1)
+template< typename TPixel >
+void writePipelineImage (const PipelineImageType * image, int axis, const std::string &path, bool compressed){
+	using VolumeType = itk::Image< TPixel, 3 >;
+	using SliceType = itk::Image< TPixel, 2 >;
+	if (axis < 0){
+		writeImage< VolumeType >( castImage< VolumeType >( image ), path, compressed );
+		return;
+	}
+	const PipelineSliceType::Pointer slice = materializeSlice< PipelineSliceType >( imageView(image).slice(axis, 0) );
+	writeImage< SliceType >( castImage< SliceType >( slice.GetPointer() ), path, compressed );
+}
+
+// write <path> [option]..., for .isv the option is the brick edge or "slab". Otherwise
+// options are a pixel type (uchar, short, ushort; float by default), slice=<direction>
+// to write a one slice thick image as 2D in any format (slice formats always are) and
+// uncompressed, so the script subcommands write what the scripts write.
+inline void writeStage (PipelineState &state, const std::vector<std::string> &args){
+	requireImage(state, "write");
+	state.materialize();
+	if (isChunkedVolume(args[0])){
+		if (args.size() > 2){ itkGenericExceptionMacro(<< "an .isv output takes a chunk shape only"); }
+		writeChunkedVolume< PipelineImageType >( state.image, args[0], args.size() > 1 ? args[1] : "" );
+		return;
+	}
+	std::string pixel = "float";
+	int axis = isSliceFormat(args[0]) ? singletonAxis(state.image, -1) : -1;
+	bool compressed = true;
+	for (std::size_t i = 1; i < args.size(); ++i){
+		if (args[i] == "uchar" || args[i] == "short" || args[i] == "ushort" || args[i] == "float"){
+			pixel = args[i];
+		} else if (args[i].compare(0, 6, "slice=") == 0){
+			axis = stageDirection(args[i].substr(6));
+			if (state.image->GetBufferedRegion().GetSize()[axis] != 1){
+				itkGenericExceptionMacro(<< "write " << args[i] << " needs an image one slice thick along " << axis);
+			}
+		} else if (args[i] == "uncompressed"){
+			compressed = false;
+		} else {
+			itkGenericExceptionMacro(<< "unknown write option " << args[i] << " (a chunk shape only applies to .isv outputs)");
+		}
+	}
+	if (pixel == "float" && axis < 0){
+		writeImage< PipelineImageType >( state.image, args[0], compressed );
+	} else if (pixel == "float"){
+		writeImage< PipelineSliceType >( materializeSlice< PipelineSliceType >( imageView(state.image.GetPointer()).slice(axis, 0) ), args[0], compressed );
+	} else if (pixel == "uchar"){
+		writePipelineImage< unsigned char >( state.image, axis, args[0], compressed );
+	} else if (pixel == "short"){
+		writePipelineImage< short >( state.image, axis, args[0], compressed );
+	} else {
+		writePipelineImage< unsigned short >( state.image, axis, args[0], compressed );
+	}
+}
+
+// extract <direction> <first>[:<last>], keeps a 3D image. A pending per-slice
+// affine along the same direction is cut down with it instead of being applied.
+inline void extractStage (PipelineState &state, const std::vector<std::string> &args){
+	requireImage(state, "extract");
+	const int direction = stageDirection(args[0]);
+	const std::size_t colon = args[1].find(":");
+	const int first = stageInt(args[1].substr(0, colon), "first slice");
+	const int last = (colon == std::string::npos) ? first : stageInt(args[1].substr(colon+1), "last slice");
+
+	PipelineImageType::RegionType region = state.image->GetBufferedRegion();
+	PipelineImageType::SizeType size = region.GetSize();
+	if (first < 0 || last < first || last >= (int)size[direction]){
+		itkGenericExceptionMacro(<< "slices " << first << ":" << last << " out of range along direction " << direction);
+	}
+	// a pending affine along another axis stays valid, the extracted part keeps all of its slices
+	if (state.pending.axis == direction){
+		state.pending.scale = std::vector<double>(state.pending.scale.begin()+first, state.pending.scale.begin()+last+1);
+		state.pending.shift = std::vector<double>(state.pending.shift.begin()+first, state.pending.shift.begin()+last+1);
+	}
+
+	PipelineImageType::IndexType start = region.GetIndex();
+	start[direction] += first;
+	size[direction] = last - first + 1;
+	region.SetIndex( start );
+	region.SetSize( size );
+	state.image = copyRegion(state.image, region);
+}
+
+// project <direction>, maximum intensity projection. An increasing affine commutes
+// with max when it is global or constant along every projected line.
+inline void projectStage (PipelineState &state, const std::vector<std::string> &args){
+	requireImage(state, "project");
+	const int direction = stageDirection(args[0]);
+
+	bool fuse = state.pending.axis != direction;
+	for (std::size_t k = 0; k < state.pending.scale.size() && fuse; ++k){
+		fuse = state.pending.scale[k] > 0.0;
+	}
+	if (!fuse){ state.materialize(); }
+
+	// one slice at the position of the first, the maximum is taken through views, then
+	// the slice gets the geometry of itk::MaximumProjectionImageFilter like the script
+	PipelineImageType::RegionType region = state.image->GetBufferedRegion();
+	PipelineImageType::SizeType size = region.GetSize();
+	size[direction] = 1;
+	region.SetSize( size );
+	PipelineImageType::Pointer projection = allocateLike(state.image, region);
+	viewMaximum(imageView(state.image.GetPointer()), direction, imageView(projection.GetPointer()).slice(direction, 0));
+	setProjectionGeometry< PipelineImageType >( state.image, direction, projection );
+	state.image = projection;
+}
+
+// readproject <path> <direction>, read + project without holding the volume: the file
+// is read slab by slab, as thick as the memory budget allows
+inline void readprojectStage (PipelineState &state, const std::vector<std::string> &args){
+	state.pending = PendingAffine();
+	state.image = readMaximumProjection< PipelineImageType >( args[0], stageDirection(args[1]), memoryBudget() );
+}
+
+// normalize <x> <y> <step> [direction], NormalizeIntense on every slice along direction:
+// (v - mean) / stdDev of the window around (x, y). Only the window is read.
+inline void normalizeStage (PipelineState &state, const std::vector<std::string> &args){
+	requireImage(state, "normalize");
+	const int x = stageInt(args[0], "x");
+	const int y = stageInt(args[1], "y");
+	const int step = stageInt(args[2], "step");
+	const int direction = (args.size() > 3) ? stageDirection(args[3]) : singletonAxis(state.image, 2);
+
+	// window statistics are only cheap to correct when the affine is constant over the slice
+	if (state.pending.axis >= 0 && state.pending.axis != direction){ state.materialize(); }
+	const std::size_t slices = state.image->GetBufferedRegion().GetSize()[direction];
+	state.pending.expand(direction, slices);
+
+	std::size_t flat = 0;
+	for (std::size_t k = 0; k < slices; ++k){
+		const RegionStatistics stats = sliceRoiStatistics(state.image, direction, k, x, y, step);
+		const double mean = stats.sum/stats.count;
+		const double variance = (stats.squareSum - stats.sum*mean)/(stats.count - 1);
+		const double s = state.pending.scale[k], t = state.pending.shift[k];
+		const double stdDev = std::fabs(s)*std::sqrt(std::max(variance, 0.0));
+		if (!(stdDev > 0.0)){ ++flat; continue; }
+		const double shiftedMean = s*mean + t;
+		state.pending.scale[k] = s/stdDev;
+		state.pending.shift[k] = (t - shiftedMean)/stdDev;
+	}
+	if (flat > 0){
+		std::cout << flat << " slices have a flat window and were left unnormalized\n";
+	}
+}
+
+// rescale <min> <max>, linear map of the whole image onto [min, max]
+inline void rescaleStage (PipelineState &state, const std::vector<std::string> &args){
+	requireImage(state, "rescale");
+	const double outMin = stageDouble(args[0], "min");
+	const double outMax = stageDouble(args[1], "max");
+
+	// min/max of the raw values per pending slice, then through the pending affine
+	const PipelineImageType::SizeType size = state.image->GetBufferedRegion().GetSize();
+	const std::size_t slices = state.pending.axis < 0 ? 1 : size[state.pending.axis];
+	std::vector<double> rawMin(slices, std::numeric_limits<double>::max());
+	std::vector<double> rawMax(slices, -std::numeric_limits<double>::max());
+	const PipelinePixelType * buffer = state.image->GetBufferPointer();
+	std::size_t k = 0;
+	for (std::size_t z = 0; z < size[2]; ++z){
+		for (std::size_t yy = 0; yy < size[1]; ++yy){
+			for (std::size_t xx = 0; xx < size[0]; ++xx, ++k){
+				const std::size_t slice = (state.pending.axis < 0) ? 0 : (state.pending.axis == 0) ? xx : (state.pending.axis == 1) ? yy : z;
+				rawMin[slice] = std::min(rawMin[slice], (double)buffer[k]);
+				rawMax[slice] = std::max(rawMax[slice], (double)buffer[k]);
+			}
+		}
+	}
+	double inMin = std::numeric_limits<double>::max(), inMax = -std::numeric_limits<double>::max();
+	for (std::size_t s = 0; s < slices; ++s){
+		const double a = state.pending.scaleAt(s)*rawMin[s] + state.pending.shiftAt(s);
+		const double b = state.pending.scaleAt(s)*rawMax[s] + state.pending.shiftAt(s);
+		inMin = std::min(inMin, std::min(a, b));
+		inMax = std::max(inMax, std::max(a, b));
+	}
+
+	const double scale = (inMax > inMin) ? (outMax - outMin)/(inMax - inMin) : 0.0;
+	const double shift = outMin - scale*inMin;
+	for (std::size_t s = 0; s < state.pending.scale.size(); ++s){
+		state.pending.scale[s] = scale*state.pending.scale[s];
+		state.pending.shift[s] = scale*state.pending.shift[s] + shift;
+	}
+}
+
+// histmatch <direction>, HistogramSlice: match every slice to the middle slice.
+// Slices along x or y are taken from a slice-major copy, so every slice is one
+// contiguous plane, and the copy is transposed back once at the end. Slices are
+// matched in place through views, none is copied out.
+inline void histmatchStage (PipelineState &state, const std::vector<std::string> &args){
+	requireImage(state, "histmatch");
+	const int direction = stageDirection(args[0]);
+	state.materialize();
+
+	PipelineImageType::Pointer work = (direction == 2) ? state.image : sliceMajorImage(state.image.GetPointer(), direction);
+	const VolumeView<PipelinePixelType> volume = imageView(work.GetPointer());
+	const HistogramMatch match(volume.slice(2, volume.size[2]/2));
+	for (std::size_t k = 0; k < volume.size[2]; ++k){
+		match.apply(volume.slice(2, k));
+	}
+
+	if (direction != 2){
+		int order[3], inverse[3];
+		sliceMajorOrder(direction, order);
+		inverseOrder(order, inverse);
+		const uint64_t workSize[3] = { volume.size[0], volume.size[1], volume.size[2] };
+		transposeBuffer(volume.data, workSize, inverse, state.image->GetBufferPointer());
+	}
+}
+
+// stats <x> <y> <step> [direction], IntenseSlice window statistics for every slice
+inline void statsStage (PipelineState &state, const std::vector<std::string> &args){
+	requireImage(state, "stats");
+	const int x = stageInt(args[0], "x");
+	const int y = stageInt(args[1], "y");
+	const int step = stageInt(args[2], "step");
+	const int direction = (args.size() > 3) ? stageDirection(args[3]) : singletonAxis(state.image, 2);
+	if (state.pending.axis >= 0 && state.pending.axis != direction){ state.materialize(); }
+
+	const std::size_t slices = state.image->GetBufferedRegion().GetSize()[direction];
+	std::cout << "slice,sum,mean,min,max\n";
+	for (std::size_t k = 0; k < slices; ++k){
+		const RegionStatistics stats = sliceRoiStatistics(state.image, direction, k, x, y, step);
+		const double s = state.pending.axis < 0 ? state.pending.scale[0] : state.pending.scale[k];
+		const double t = state.pending.axis < 0 ? state.pending.shift[0] : state.pending.shift[k];
+		const double a = s*stats.min + t, b = s*stats.max + t;
+		std::cout << k << "," << s*stats.sum + t*stats.count << "," << s*stats.sum/stats.count + t
+			<< "," << std::min(a, b) << "," << std::max(a, b) << "\n";
+	}
+}
+
+/********** REGISTRY AND DRIVER **********/
+
+inline const std::vector<StageInfo> & pipelineStages (){
+	static const std::vector<StageInfo> stages = {
+		{ "read", 1, 3, "read <path> [<direction> <first>[:<last>]]", &readStage },
+		{ "stack", 2, 4, "stack <pattern> <first>:<last> [direction] [spacing]", &stackStage },
+		{ "write", 1, 4, "write <path> [chunk | uchar|short|ushort] [slice=<direction>] [uncompressed]", &writeStage },
+		{ "extract", 2, 2, "extract <direction> <first>[:<last>]", &extractStage },
+		{ "project", 1, 1, "project <direction>", &projectStage },
+		{ "readproject", 2, 2, "readproject <path> <direction>", &readprojectStage },
+		{ "normalize", 3, 4, "normalize <x> <y> <step> [direction]", &normalizeStage },
+		{ "rescale", 2, 2, "rescale <min> <max>", &rescaleStage },
+		{ "histmatch", 1, 1, "histmatch <direction>", &histmatchStage },
+		{ "stats", 3, 4, "stats <x> <y> <step> [direction]", &statsStage },
+	};
+	return stages;
+}
+
+inline const StageInfo * findStage (const std::string &name){
+	for (const StageInfo &info : pipelineStages()){
+		if (name == info.name){ return &info; }
+	}
+	return nullptr;
+}
+
+// split "read a.nii + extract 0 3 + write b.tif" at the '+' tokens
+inline std::vector<PipelineStage> parsePipeline (const std::vector<std::string> &tokens){
+	std::vector<PipelineStage> stages;
+	PipelineStage current;
+	for (std::size_t i = 0; i <= tokens.size(); ++i){
+		if (i == tokens.size() || tokens[i] == "+"){
+			if (current.name.empty()){ itkGenericExceptionMacro(<< "empty stage in pipeline"); }
+			stages.push_back(current);
+			current = PipelineStage();
+		} else if (current.name.empty()){
+			current.name = tokens[i];
+		} else {
+			current.args.push_back(tokens[i]);
+		}
+	}
+	for (const PipelineStage &stage : stages){
+		const StageInfo * info = findStage(stage.name);
+		if (!info){ itkGenericExceptionMacro(<< "unknown stage '" << stage.name << "'"); }
+		if (stage.args.size() < info->minArgs || stage.args.size() > info->maxArgs){
+			itkGenericExceptionMacro(<< "usage: " << info->usage);
+		}
+	}
+	return stages;
+}
+
+// Memory a pipeline holds at its peak: the float volume of the largest read and one
+// working copy of it (a transpose, the reader's buffer), or what a readproject holds.
+// Inputs that cannot be looked at now count as nothing, the stage reports them when it runs.
+inline double estimatePipelineBytes (const std::vector<PipelineStage> &stages){
+	double bytes = 0.0;
+	for (const PipelineStage &stage : stages){
+		if ((stage.name != "read" && stage.name != "readproject") || isSeriesPattern(stage.args[0])){ continue; }
+		try {
+			if (stage.name == "read"){
+				bytes = std::max(bytes, 2.0*regionBytes< PipelineImageType >( readStageRegion(stage.args) ));
+				continue;
+			}
+			const PipelineImageType::RegionType largest = readLargestRegion< PipelineImageType >( stage.args[0] );
+			const double whole = regionBytes< PipelineImageType >( largest );
+			const double plane = whole/largest.GetSize()[stageDirection(stage.args[1])];
+			bytes = std::max(bytes, memoryBudget() == 0 ? whole + 2.0*plane
+				: std::min(whole + 2.0*plane, std::max((double)memoryBudget(), 3.0*plane)));
+		} catch ( itk::ExceptionObject & ){
+		}
+	}
+	return bytes;
+}
+
+// Under a memory budget, reading a whole volume to project it becomes readproject,
+// and a pipeline that still does not fit stops here, before anything is read.
+inline void fitPipelineToBudget (std::vector<PipelineStage> &stages){
+	if (memoryBudget() == 0){ return; }
+	if (stages.size() >= 2 && stages[0].name == "read" && stages[0].args.size() == 1 && !isSeriesPattern(stages[0].args[0])
+			&& stages[1].name == "project" && !fitsMemoryBudget(estimatePipelineBytes(stages))){
+		PipelineStage fused;
+		fused.name = "readproject";
+		fused.args = { stages[0].args[0], stages[1].args[0] };
+		stages.erase(stages.begin());
+		stages[0] = fused;
+		std::cout << "over the memory budget, projecting " << fused.args[0] << " slab by slab" << std::endl;
+	}
+	requireMemory(estimatePipelineBytes(stages), "the largest volume read and a working copy");
+}
+
+// The output cache of a pipeline (ITKSCRIPTS_CACHE_DIR), keyed by the files it reads,
+// the stages with their paths left out, and what it writes. Off for a pipeline that
+// prints its result (stats) or writes nothing. readproject is keyed as read + project.
+inline OutputCache pipelineCache (const std::vector<PipelineStage> &stages){
+	std::vector<std::string> parameters, inputs, outputs;
+	for (const PipelineStage &stage : stages){
+		if (stage.name == "stats"){ return OutputCache(); }
+		std::vector<std::string> args = stage.args;
+		std::string name = stage.name;
+		if (name == "read" || name == "readproject" || name == "stack"){
+			const std::string range = (name == "stack") ? args[1] : (name == "read" && args.size() > 2) ? args[2] : "";
+			const std::size_t colon = range.find(":");
+			if (isSeriesPattern(args[0]) && !range.empty()){
+				const int first = stageInt(range.substr(0, colon), "first slice");
+				const int last = (colon == std::string::npos) ? first : stageInt(range.substr(colon+1), "last slice");
+				const std::vector<std::string> slices = seriesFileNames(args[0], first, last);
+				inputs.insert(inputs.end(), slices.begin(), slices.end());
+			} else {
+				inputs.push_back(args[0]);
+			}
+			args[0] = "<input>";
+			if (name == "readproject"){
+				parameters.insert(parameters.end(), { "read", "<input>", "+" });
+				name = "project";
+				args.erase(args.begin());
+			}
+		} else if (name == "write"){
+			outputs.push_back(args[0]);
+			args[0] = "<output>";
+		}
+		parameters.push_back(name);
+		parameters.insert(parameters.end(), args.begin(), args.end());
+		parameters.push_back("+");
+	}
+	return OutputCache("itkscripts", parameters, inputs, outputs);
+}
+
+// the files a pipeline writes, in order
+inline std::vector<std::string> pipelineOutputs (const std::vector<PipelineStage> &stages){
+	std::vector<std::string> outputs;
+	for (const PipelineStage &stage : stages){
+		if (stage.name == "write"){ outputs.push_back(stage.args[0]); }
+	}
+	return outputs;
+}
+
+// bytes of the volume a stage hands on, 0 before the first read
+inline double pipelineBytes (const PipelineState &state){
+	return state.image.IsNull() ? 0.0 : (double)state.image->GetBufferedRegion().GetNumberOfPixels()*sizeof(PipelinePixelType);
+}
+
+// Run every stage in order and time each one, with hardware counters under ITKSCRIPTS_PERF.
+// With peaks, the peak resident memory of every stage is reported too; it is a
+// process-wide figure, so not for pipelines running side by side.
+inline PipelineState runPipeline (const std::vector<PipelineStage> &stages, bool peaks = true){
+	PipelineState state;
+	PerfCounters counters;
+	for (const PipelineStage &stage : stages){
+		const double bytesIn = pipelineBytes(state);
+		const bool peak = peaks && resetPeakRss();
+		auto begin = std::chrono::high_resolution_clock::now();
+		counters.start();
+		{
+			TraceSpan span("stage", stage.name);
+			findStage(stage.name)->run(state, stage.args);
+		}
+		const PerfSample sample = counters.stop();
+		auto stop = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(stop - begin);
+		std::cout << duration.count() << " milliseconds for " << stage.name
+			<< describePerfSample(sample, std::max(bytesIn, pipelineBytes(state)));
+		if (peak){ std::cout << ", peak " << megabytes(peakRssBytes()); }
+		std::cout << std::endl;
+	}
+	return state;
+}
+
+#endif
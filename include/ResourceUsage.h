@@ -0,0 +1,79 @@
+// File name: 	ResourceUsage.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: What a process has cost so far, for the benchmarks: CPU seconds of
+// 		the process and of its reaped children, I/O counters from /proc/self/io
+// 		(children are added in once they are waited for) and the peak resident
+// 		set, which can be reset between measurements. Linux only.
+
+#ifndef ITKSCRIPTS_RESOURCEUSAGE_H
+#define ITKSCRIPTS_RESOURCEUSAGE_H
+
+#include <sys/resource.h>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <fstream>
+
+// rchar/wchar count every read()/write(), cached or not, but not mmap;
+// readBytes/writeBytes are what went to or came from storage
+struct IoCounters {
+	unsigned long long rchar, wchar, readBytes, writeBytes;
+};
+
+inline IoCounters readProcessIo (){
+	IoCounters counters = { 0, 0, 0, 0 };
+	std::ifstream io("/proc/self/io");
+	std::string name;
+	unsigned long long value;
+	while (io >> name >> value){
+		if (name == "rchar:"){ counters.rchar = value; }
+		else if (name == "wchar:"){ counters.wchar = value; }
+		else if (name == "read_bytes:"){ counters.readBytes = value; }
+		else if (name == "write_bytes:"){ counters.writeBytes = value; }
+	}
+	return counters;
+}
+
+inline IoCounters operator- (const IoCounters &after, const IoCounters &before){
+	IoCounters delta = { after.rchar - before.rchar, after.wchar - before.wchar,
+		after.readBytes - before.readBytes, after.writeBytes - before.writeBytes };
+	return delta;
+}
+
+inline double rusageCpuSeconds (const rusage &usage){
+	return usage.ru_utime.tv_sec + 1e-6*usage.ru_utime.tv_usec + usage.ru_stime.tv_sec + 1e-6*usage.ru_stime.tv_usec;
+}
+
+// user + system seconds of this process, plus its reaped children with children
+inline double cpuSeconds (bool children = false){
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	double seconds = rusageCpuSeconds(usage);
+	if (children){
+		getrusage(RUSAGE_CHILDREN, &usage);
+		seconds += rusageCpuSeconds(usage);
+	}
+	return seconds;
+}
+
+// VmHWM, the peak resident set since start or the last resetPeakRss
+inline unsigned long long peakRssBytes (){
+	std::ifstream status("/proc/self/status");
+	std::string line;
+	while (std::getline(status, line)){
+		if (line.compare(0, 6, "VmHWM:") == 0){ return 1024ULL*std::strtoull(line.c_str() + 6, nullptr, 10); }
+	}
+	return 0;
+}
+
+// start the peak over from the current resident set (Linux 4.0 and later)
+inline bool resetPeakRss (){
+	FILE * refs = std::fopen("/proc/self/clear_refs", "w");
+	if (!refs){ return false; }
+	const bool reset = std::fputs("5", refs) >= 0;
+	return (std::fclose(refs) == 0) && reset;
+}
+
+#endif
@@ -0,0 +1,246 @@
+// File name: 	SharedVolumeCache.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Decoded volumes shared between processes through POSIX shared memory
+// 		(/dev/shm/itkscripts-*). Opt in with ITKSCRIPTS_SHM_CACHE=<MB>. The first
+// 		process to read a file publishes its voxels, later ones map them without
+// 		decoding or copying. Entries are keyed by path, size, mtime and pixel type;
+// 		the least recently attached ones are unlinked past the size cap.
+
+#ifndef ITKSCRIPTS_SHAREDVOLUMECACHE_H
+#define ITKSCRIPTS_SHAREDVOLUMECACHE_H
+
+#include "itkImage.h"
+#include "itkImportImageContainer.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <string>
+#include <vector>
+#include <typeinfo>
+#include <algorithm>
+
+constexpr uint64_t sharedVolumeMagic = 0x454d554c4f5653ULL;	// "SVOLUME"
+constexpr std::size_t sharedVolumeDataOffset = 4096;		// voxels start on their own page
+const char * const sharedVolumeDirectory = "/dev/shm/";
+const char * const sharedVolumePrefix = "itkscripts-";
+
+struct SharedVolumeHeader {
+	uint64_t magic;
+	uint32_t dimension;
+	uint32_t pixelSize;
+	uint64_t size[3];
+	double spacing[3];
+	double origin[3];
+	double direction[9];
+	uint64_t dataBytes;
+	char key[3072];		// full key, guards against hash collisions
+};
+static_assert(sizeof(SharedVolumeHeader) <= sharedVolumeDataOffset, "shared volume header must fit in one page");
+
+// Pixel container over a mapped segment, unmapped when the image goes away.
+// The mapping is private copy-on-write, so an in-place filter never writes to the shared copy.
+template< typename TElement >
+class MappedImageContainer : public itk::ImportImageContainer< itk::SizeValueType, TElement > {
+public:
+	typedef MappedImageContainer Self;
+	typedef itk::ImportImageContainer< itk::SizeValueType, TElement > Superclass;
+	typedef itk::SmartPointer< Self > Pointer;
+	typedef itk::SmartPointer< const Self > ConstPointer;
+
+	itkNewMacro(Self);
+	itkTypeMacro(MappedImageContainer, ImportImageContainer);
+
+	void SetMapping (void * address, std::size_t length, itk::SizeValueType elements){
+		m_Address = address;
+		m_Length = length;
+		this->SetImportPointer(reinterpret_cast<TElement *>(static_cast<char *>(address) + sharedVolumeDataOffset), elements, false);
+	}
+
+protected:
+	MappedImageContainer() : m_Address(nullptr), m_Length(0) {}
+	~MappedImageContainer(){
+		if (m_Address){ munmap(m_Address, m_Length); }
+	}
+
+private:
+	void * m_Address;
+	std::size_t m_Length;
+};
+
+// cap in bytes from ITKSCRIPTS_SHM_CACHE (MB), 0 when the cache is off
+inline std::size_t sharedCacheCapacity (){
+	const char * value = std::getenv("ITKSCRIPTS_SHM_CACHE");
+	if (!value){ return 0; }
+	return (std::size_t)std::strtoull(value, nullptr, 10) << 20;
+}
+
+inline uint64_t fnv1aHash (const std::string &text){
+	uint64_t hash = 0xcbf29ce484222325ULL;
+	for (unsigned char c : text){
+		hash ^= c;
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+// key for a file read as TImage, empty when the file cannot be stat'ed
+template< typename TImage >
+std::string sharedCacheKey (const std::string &filename){
+	char resolved[PATH_MAX];
+	struct stat info;
+	if (!realpath(filename.c_str(), resolved) || stat(resolved, &info) != 0){ return ""; }
+	return std::string(resolved) + "|" + std::to_string((long long)info.st_size)
+		+ "|" + std::to_string((long long)info.st_mtim.tv_sec) + "." + std::to_string((long long)info.st_mtim.tv_nsec)
+		+ "|" + typeid(typename TImage::PixelType).name() + "|" + std::to_string(TImage::ImageDimension);
+}
+
+inline std::string sharedSegmentName (const std::string &key){
+	char hex[17];
+	std::snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)fnv1aHash(key));
+	return std::string(sharedVolumePrefix) + hex;
+}
+
+// map a published volume, null on a miss
+template< typename TImage >
+typename TImage::Pointer attachSharedVolume (const std::string &key){
+	const std::string name = "/" + sharedSegmentName(key);
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd < 0){ return typename TImage::Pointer(); }
+
+	struct stat info;
+	void * address = MAP_FAILED;
+	if (fstat(fd, &info) == 0 && (std::size_t)info.st_size >= sharedVolumeDataOffset){
+		address = mmap(nullptr, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	}
+	if (address != MAP_FAILED){
+		futimens(fd, nullptr);	// mtime marks the last attach for eviction
+	}
+	close(fd);
+	if (address == MAP_FAILED){ return typename TImage::Pointer(); }
+
+	const SharedVolumeHeader * header = static_cast<const SharedVolumeHeader *>(address);
+	const std::size_t length = info.st_size;
+	if (header->magic != sharedVolumeMagic || header->dimension != TImage::ImageDimension
+			|| header->pixelSize != sizeof(typename TImage::PixelType)
+			|| sharedVolumeDataOffset + header->dataBytes > length
+			|| std::strncmp(header->key, key.c_str(), sizeof(header->key)) != 0){
+		munmap(address, length);
+		return typename TImage::Pointer();
+	}
+
+	typename TImage::RegionType region;
+	typename TImage::SpacingType spacing;
+	typename TImage::PointType origin;
+	typename TImage::DirectionType direction;
+	for (unsigned int d = 0; d < TImage::ImageDimension; ++d){
+		region.SetSize(d, header->size[d]);
+		region.SetIndex(d, 0);
+		spacing[d] = header->spacing[d];
+		origin[d] = header->origin[d];
+		for (unsigned int e = 0; e < TImage::ImageDimension; ++e){
+			direction[d][e] = header->direction[3*d + e];
+		}
+	}
+
+	typedef MappedImageContainer< typename TImage::PixelType > ContainerType;
+	typename ContainerType::Pointer container = ContainerType::New();
+	container->SetMapping(address, length, region.GetNumberOfPixels());
+
+	typename TImage::Pointer image = TImage::New();
+	image->SetRegions( region );
+	image->SetSpacing( spacing );
+	image->SetOrigin( origin );
+	image->SetDirection( direction );
+	image->SetPixelContainer( container );
+	return image;
+}
+
+// unlink the least recently attached segments until incoming more bytes fit under capacity
+inline bool evictSharedVolumes (std::size_t incoming, std::size_t capacity){
+	struct Segment {
+		std::string name;
+		std::size_t bytes;
+		time_t used;
+	};
+	std::vector<Segment> segments;
+	std::size_t total = 0;
+	DIR * directory = opendir(sharedVolumeDirectory);
+	if (!directory){ return false; }
+	while (dirent * entry = readdir(directory)){
+		const std::string name = entry->d_name;
+		if (name.compare(0, std::strlen(sharedVolumePrefix), sharedVolumePrefix) != 0 || name.find('.') != std::string::npos){ continue; }
+		struct stat info;
+		if (stat((sharedVolumeDirectory + name).c_str(), &info) != 0){ continue; }
+		Segment segment = { name, (std::size_t)info.st_size, info.st_mtime };
+		segments.push_back(segment);
+		total += segment.bytes;
+	}
+	closedir(directory);
+
+	std::sort(segments.begin(), segments.end(), [](const Segment &a, const Segment &b){ return a.used < b.used; });
+	for (std::size_t i = 0; i < segments.size() && total + incoming > capacity; ++i){
+		// processes that still map it keep their pages until they exit
+		if (shm_unlink(("/" + segments[i].name).c_str()) == 0){ total -= segments[i].bytes; }
+	}
+	return total + incoming <= capacity;
+}
+
+// publish a decoded volume: fill a private segment, then rename it into place
+template< typename TImage >
+void publishSharedVolume (const std::string &key, const TImage * image, std::size_t capacity){
+	const typename TImage::RegionType region = image->GetBufferedRegion();
+	const std::size_t dataBytes = region.GetNumberOfPixels()*sizeof(typename TImage::PixelType);
+	const std::size_t length = sharedVolumeDataOffset + dataBytes;
+	// a volume larger than the whole cache is not shared, and costs the others nothing
+	if (key.size() >= sizeof(SharedVolumeHeader().key) || length > capacity){ return; }
+	if (!evictSharedVolumes(length, capacity)){ return; }
+
+	const std::string name = sharedSegmentName(key);
+	const std::string temporary = name + ".tmp." + std::to_string((long long)getpid());
+	int fd = shm_open(("/" + temporary).c_str(), O_CREAT | O_EXCL | O_RDWR, 0644);
+	if (fd < 0){ return; }
+	void * address = MAP_FAILED;
+	if (ftruncate(fd, length) == 0){
+		address = mmap(nullptr, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	}
+	close(fd);
+	if (address == MAP_FAILED){
+		shm_unlink(("/" + temporary).c_str());
+		return;
+	}
+
+	SharedVolumeHeader * header = static_cast<SharedVolumeHeader *>(address);
+	std::memset(header, 0, sizeof(SharedVolumeHeader));
+	header->magic = sharedVolumeMagic;
+	header->dimension = TImage::ImageDimension;
+	header->pixelSize = sizeof(typename TImage::PixelType);
+	for (unsigned int d = 0; d < TImage::ImageDimension; ++d){
+		header->size[d] = region.GetSize(d);
+		header->spacing[d] = image->GetSpacing()[d];
+		header->origin[d] = image->GetOrigin()[d];
+		for (unsigned int e = 0; e < TImage::ImageDimension; ++e){
+			header->direction[3*d + e] = image->GetDirection()[d][e];
+		}
+	}
+	header->dataBytes = dataBytes;
+	std::strncpy(header->key, key.c_str(), sizeof(header->key) - 1);
+	std::memcpy(static_cast<char *>(address) + sharedVolumeDataOffset, image->GetBufferPointer(), dataBytes);
+	munmap(address, length);
+
+	if (std::rename((sharedVolumeDirectory + temporary).c_str(), (sharedVolumeDirectory + name).c_str()) != 0){
+		shm_unlink(("/" + temporary).c_str());
+	}
+}
+
+#endif
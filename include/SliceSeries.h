@@ -0,0 +1,251 @@
+// File name: 	SliceSeries.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: A series of slice files (slice%03d.tif, first..last) as a virtual volume
+// 		along z. A slice is decoded the first time it is asked for and kept in a
+// 		least recently used cache of a bounded number of slices, so a window
+// 		statistic over ten slices decodes ten files, not the whole series.
+// 		ITKSCRIPTS_SERIES_CACHE sets the number of slices kept (default 64).
+
+#ifndef ITKSCRIPTS_SLICESERIES_H
+#define ITKSCRIPTS_SLICESERIES_H
+
+#include "itkImage.h"
+
+#include "FileNames.h"
+#include "SliceView.h"
+#include "StackAssembler.h"
+#include "WorkerThreads.h"
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <list>
+#include <memory>
+#include <iterator>
+#include <unordered_map>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+inline std::size_t seriesCacheSlices (){
+	const char * value = std::getenv("ITKSCRIPTS_SERIES_CACHE");
+	const long slices = value ? std::atol(value) : 0;
+	return slices > 0 ? slices : 64;
+}
+
+template< typename TPixel >
+class SliceSeries {
+public:
+	using SliceBuffer = std::vector<TPixel>;
+
+	// only the first slice is opened here, for the size and geometry of the series
+	SliceSeries (const std::string &pattern, int first, int last, std::size_t capacity = seriesCacheSlices())
+		: m_Pattern(pattern), m_First(first), m_Capacity(std::max<std::size_t>(1, capacity)), m_Decodes(0) {
+		if (!isSeriesPattern(pattern)){ itkGenericExceptionMacro(<< pattern << " is not a series pattern like slice%03d.tif"); }
+		if (first < 0 || last < first){ itkGenericExceptionMacro(<< "slices " << first << ":" << last << " are not a range"); }
+		m_Slices = last - first + 1;
+		openSliceIO(seriesFileName(pattern, first), m_Information);
+	}
+
+	std::size_t width () const { return m_Information.size[0]; }
+	std::size_t height () const { return m_Information.size[1]; }
+	std::size_t slices () const { return m_Slices; }
+	std::size_t decodes () const { return m_Decodes; }
+	std::string fileName (std::size_t k) const { return seriesFileName(m_Pattern, m_First + k); }
+
+	// slice k (0 is the first file), decoded on a miss. The buffer stays valid for
+	// as long as the caller holds it, even after it leaves the cache.
+	std::shared_ptr<const SliceBuffer> slice (std::size_t k){
+		if (k >= m_Slices){ itkGenericExceptionMacro(<< "slice " << k << " is outside the series of " << m_Slices); }
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		auto found = m_Index.find(k);
+		if (found != m_Index.end()){
+			m_Entries.splice(m_Entries.begin(), m_Entries, found->second);
+			return found->second->second;
+		}
+		lock.unlock();
+
+		// decode without the lock, other slices stay servable
+		std::shared_ptr<const SliceBuffer> buffer = decode(k);
+		lock.lock();
+		++m_Decodes;
+		found = m_Index.find(k);
+		if (found != m_Index.end()){ return found->second->second; }
+		m_Entries.push_front(std::make_pair(k, buffer));
+		m_Index[k] = m_Entries.begin();
+		while (m_Entries.size() > m_Capacity){
+			m_Index.erase(m_Entries.back().first);
+			m_Entries.pop_back();
+		}
+		return buffer;
+	}
+
+	// a view of a slice buffer, with the geometry slice k has in the virtual volume
+	SliceView<const TPixel> view (const SliceBuffer &buffer, std::size_t k) const {
+		SliceView<const TPixel> view;
+		view.data = buffer.data();
+		view.size[0] = width();
+		view.size[1] = height();
+		view.stride[0] = 1;
+		view.stride[1] = width();
+		view.axis[0] = 0;
+		view.axis[1] = 1;
+		view.geometry = geometry();
+		view.geometry.origin[2] += view.geometry.spacing[2]*k;
+		return view;
+	}
+
+	// statistics of the (2*step+1)^2 window around (x, y) of slice k
+	RegionStatistics roiStatistics (std::size_t k, int x, int y, int step){
+		if ((x-step) < 0 || (x+step) >= (int)width()){ itkGenericExceptionMacro(<< "step is out of bound x"); }
+		if ((y-step) < 0 || (y+step) >= (int)height()){ itkGenericExceptionMacro(<< "step is out of bound y"); }
+		const std::shared_ptr<const SliceBuffer> buffer = slice(k);
+		return viewStatistics(view(*buffer, k).window(x-step, y-step, 2*step+1, 2*step+1));
+	}
+
+	// slices first..last as a volume, the series spacing along z is 1 like assembleStack
+	template< typename TImage >
+	typename TImage::Pointer extract (std::size_t first, std::size_t last){
+		if (last < first || last >= m_Slices){ itkGenericExceptionMacro(<< "slices " << first << ":" << last << " are outside the series"); }
+		typename TImage::Pointer volume = allocate< TImage >( first, last - first + 1 );
+		const VolumeView<typename TImage::PixelType> target = imageView(volume.GetPointer());
+		parallelSlices(first, last, [&](std::size_t k, const SliceView<const TPixel> &source){
+			copySlice(source, target.slice(2, k - first));
+		});
+		return volume;
+	}
+
+	// maximum intensity projection of slices first..last along z, one slice thick
+	template< typename TImage >
+	typename TImage::Pointer maximum (std::size_t first, std::size_t last){
+		if (last < first || last >= m_Slices){ itkGenericExceptionMacro(<< "slices " << first << ":" << last << " are outside the series"); }
+		typename TImage::Pointer projection = allocate< TImage >( first, 1 );
+		const SliceView<typename TImage::PixelType> target = imageView(projection.GetPointer()).slice(2, 0);
+		std::mutex mergeMutex;
+		bool started = false;
+		parallelSlices(first, last, [&](std::size_t, const SliceView<const TPixel> &source){
+			std::lock_guard<std::mutex> lock(mergeMutex);
+			if (!started){
+				copySlice(source, target);
+				started = true;
+				return;
+			}
+			for (std::size_t v = 0; v < target.size[1]; ++v){
+				for (std::size_t u = 0; u < target.size[0]; ++u){
+					target(u, v) = std::max<typename TImage::PixelType>(target(u, v), source(u, v));
+				}
+			}
+		});
+		return projection;
+	}
+
+private:
+	using Entry = std::pair< std::size_t, std::shared_ptr<const SliceBuffer> >;
+	using EntryList = std::list<Entry>;
+
+	ViewGeometry geometry () const {
+		ViewGeometry geometry;
+		for (int d = 0; d < 3; ++d){
+			geometry.origin[d] = (d < 2) ? m_Information.origin[d] : 0.0;
+			geometry.spacing[d] = (d < 2) ? m_Information.spacing[d] : 1.0;
+			for (int e = 0; e < 3; ++e){
+				geometry.direction[3*d + e] = (d < 2 && e < 2) ? m_Information.direction[2*d + e] : (d == e ? 1.0 : 0.0);
+			}
+		}
+		return geometry;
+	}
+
+	std::shared_ptr<const SliceBuffer> decode (std::size_t k) const {
+		const std::string filename = fileName(k);
+		SliceInformation information;
+		itk::ImageIOBase::Pointer io = openSliceIO(filename, information);
+		checkSliceInformation(m_Information, information, filename);
+		std::shared_ptr<SliceBuffer> buffer = std::make_shared<SliceBuffer>(width()*height());
+		if (information.component == itk::ImageIOBase::MapPixelType<TPixel>::CType){
+			io->Read( buffer->data() );
+			return buffer;
+		}
+		std::vector<char> raw(io->GetImageSizeInBytes());
+		io->Read( raw.data() );
+		SliceView<TPixel> target;
+		target.data = buffer->data();
+		target.size[0] = width();
+		target.size[1] = height();
+		target.stride[0] = 1;
+		target.stride[1] = width();
+		convertSlice(raw.data(), information.component, target);
+		return buffer;
+	}
+
+	template< typename TImage >
+	typename TImage::Pointer allocate (std::size_t first, std::size_t count) const {
+		static_assert(TImage::ImageDimension == 3, "the series is a volume");
+		const ViewGeometry geometry = this->geometry();
+		typename TImage::RegionType region;
+		typename TImage::SpacingType spacing;
+		typename TImage::PointType origin;
+		typename TImage::DirectionType direction;
+		for (int d = 0; d < 3; ++d){
+			region.SetIndex(d, 0);
+			spacing[d] = geometry.spacing[d];
+			origin[d] = geometry.origin[d];
+			for (int e = 0; e < 3; ++e){ direction[d][e] = geometry.direction[3*d + e]; }
+		}
+		region.SetSize(0, width());
+		region.SetSize(1, height());
+		region.SetSize(2, count);
+		origin[2] += spacing[2]*first;
+
+		typename TImage::Pointer image = TImage::New();
+		image->SetRegions( region );
+		image->SetSpacing( spacing );
+		image->SetOrigin( origin );
+		image->SetDirection( direction );
+		image->Allocate();
+		return image;
+	}
+
+	template< typename TOutput >
+	static void copySlice (const SliceView<const TPixel> &source, const SliceView<TOutput> &target){
+		for (std::size_t v = 0; v < target.size[1]; ++v){
+			for (std::size_t u = 0; u < target.size[0]; ++u){ target(u, v) = source(u, v); }
+		}
+	}
+
+	// work(k, view of slice k) for k in first..last, slices decoded on all cores
+	template< typename TWork >
+	void parallelSlices (std::size_t first, std::size_t last, TWork work){
+		std::atomic<std::size_t> next(first);
+		std::mutex errorMutex;
+		std::string error;
+		auto worker = [&](){
+			for (std::size_t k = next++; k <= last; k = next++){
+				try {
+					const std::shared_ptr<const SliceBuffer> buffer = slice(k);
+					work(k, view(*buffer, k));
+				} catch ( itk::ExceptionObject & err ){
+					std::lock_guard<std::mutex> lock(errorMutex);
+					if (error.empty()){ error = err.GetDescription(); }
+					next = last + 1;
+				}
+			}
+		};
+		const unsigned int threads = std::max<unsigned int>(1, std::min<std::size_t>(workerThreads(), last - first + 1));
+		runWorkers(threads, worker);
+		if (!error.empty()){ itkGenericExceptionMacro(<< error); }
+	}
+
+	std::string m_Pattern;
+	int m_First;
+	std::size_t m_Slices;
+	std::size_t m_Capacity;
+	std::size_t m_Decodes;
+	SliceInformation m_Information;
+	EntryList m_Entries;
+	std::unordered_map<std::size_t, typename EntryList::iterator> m_Index;
+	std::mutex m_Mutex;
+};
+
+#endif
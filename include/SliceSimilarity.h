@@ -0,0 +1,140 @@
+// File name: 	SliceSimilarity.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Dense local NCC / SSIM between two slices. All local moments come from
+// 		separable box filters (running column sums then running row sums), so the
+// 		cost per pixel does not depend on the window radius.
+
+#ifndef ITKSCRIPTS_SLICESIMILARITY_H
+#define ITKSCRIPTS_SLICESIMILARITY_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+
+// scores for one slice pair
+struct SimilarityScores {
+	double meanNCC;		// average of the local NCC map
+	double meanSSIM;	// average of the local SSIM map
+	double globalNCC;	// Pearson correlation of the two whole slices
+};
+
+// Box mean of radius r, window clipped at the border and normalized by the clipped count.
+// Vertical pass keeps one running sum per column (contiguous, vectorizes across x),
+// horizontal pass is a running sum over that row of column sums.
+template< typename TIn >
+void boxMean(const TIn * in, double * out, int width, int height, int radius,
+		std::vector<double> &colSum, std::vector<double> &rowBuffer){
+	colSum.assign(width, 0.0);
+	rowBuffer.resize(width + 1);
+
+	// prime the column sums with rows [0, radius-1]
+	for (int j = 0; j < std::min(radius, height); ++j){
+		const TIn * row = in + (size_t)j*width;
+		for (int i = 0; i < width; ++i){ colSum[i] += row[i]; }
+	}
+
+	for (int j = 0; j < height; ++j){
+		const int addRow = j + radius;
+		const int subRow = j - radius - 1;
+		if (addRow < height){
+			const TIn * row = in + (size_t)addRow*width;
+			for (int i = 0; i < width; ++i){ colSum[i] += row[i]; }
+		}
+		if (subRow >= 0){
+			const TIn * row = in + (size_t)subRow*width;
+			for (int i = 0; i < width; ++i){ colSum[i] -= row[i]; }
+		}
+		const int rows = std::min(height-1, j+radius) - std::max(0, j-radius) + 1;
+
+		// prefix sum of the column sums gives every horizontal window in O(1)
+		rowBuffer[0] = 0.0;
+		for (int i = 0; i < width; ++i){ rowBuffer[i+1] = rowBuffer[i] + colSum[i]; }
+
+		double * outRow = out + (size_t)j*width;
+		for (int i = 0; i < width; ++i){
+			const int lo = std::max(0, i-radius);
+			const int hi = std::min(width-1, i+radius);
+			outRow[i] = (rowBuffer[hi+1] - rowBuffer[lo]) / ((hi-lo+1)*rows);
+		}
+	}
+}
+
+// max - min of the n values of data (and of other, when given), 1 for constant data:
+// the SSIM dynamic range of images read as float, whatever their type on disk
+inline float dataRange(const float * data, size_t n, const float * other = nullptr){
+	if (n == 0){ return 1.0f; }
+	const auto range = std::minmax_element(data, data + n);
+	float lo = *range.first, hi = *range.second;
+	if (other){
+		const auto otherRange = std::minmax_element(other, other + n);
+		lo = std::min(lo, *otherRange.first);
+		hi = std::max(hi, *otherRange.second);
+	}
+	return hi > lo ? hi - lo : 1.0f;
+}
+
+// Fill nccMap and ssimMap (each width*height, may be null) for slices a and b.
+// dynamicRange is L in the usual SSIM constants C1 = (0.01L)^2, C2 = (0.03L)^2.
+// Products and moments are double: with 16 bit intensities the squares reach 1e9,
+// where float rounding of E[a^2] - E[a]^2 is larger than the variance of a flat region.
+inline SimilarityScores computeSimilarityMaps(const float * a, const float * b, int width, int height,
+		int radius, float dynamicRange, float * nccMap, float * ssimMap){
+	const size_t n = (size_t)width*height;
+	std::vector<double> aa(n), bb(n), ab(n);
+	for (size_t k = 0; k < n; ++k){
+		aa[k] = (double)a[k]*a[k];
+		bb[k] = (double)b[k]*b[k];
+		ab[k] = (double)a[k]*b[k];
+	}
+
+	std::vector<double> meanA(n), meanB(n), meanAA(n), meanBB(n), meanAB(n);
+	std::vector<double> colSum, rowBuffer;
+	boxMean(a, &meanA[0], width, height, radius, colSum, rowBuffer);
+	boxMean(b, &meanB[0], width, height, radius, colSum, rowBuffer);
+	boxMean(&aa[0], &meanAA[0], width, height, radius, colSum, rowBuffer);
+	boxMean(&bb[0], &meanBB[0], width, height, radius, colSum, rowBuffer);
+	boxMean(&ab[0], &meanAB[0], width, height, radius, colSum, rowBuffer);
+
+	const double c1 = (0.01*dynamicRange)*(0.01*dynamicRange);
+	const double c2 = (0.03*dynamicRange)*(0.03*dynamicRange);
+	const double epsilon = 1e-12;
+
+	double sumNCC = 0.0, sumSSIM = 0.0;
+	for (size_t k = 0; k < n; ++k){
+		const double ma = meanA[k];
+		const double mb = meanB[k];
+		const double varA = std::max(meanAA[k] - ma*ma, 0.0);
+		const double varB = std::max(meanBB[k] - mb*mb, 0.0);
+		const double cov = meanAB[k] - ma*mb;
+
+		const double denom = std::sqrt(varA*varB);
+		const double ncc = denom > epsilon ? cov/denom : 0.0;
+		const double ssim = ((2.0*ma*mb + c1)*(2.0*cov + c2)) / ((ma*ma + mb*mb + c1)*(varA + varB + c2));
+
+		if (nccMap){ nccMap[k] = (float)ncc; }
+		if (ssimMap){ ssimMap[k] = (float)ssim; }
+		sumNCC += ncc;
+		sumSSIM += ssim;
+	}
+
+	// global correlation over the whole slice
+	double sa = 0.0, sb = 0.0, saa = 0.0, sbb = 0.0, sab = 0.0;
+	for (size_t k = 0; k < n; ++k){
+		sa += a[k]; sb += b[k];
+		saa += aa[k]; sbb += bb[k]; sab += ab[k];
+	}
+	const double ga = sa/n, gb = sb/n;
+	const double gVarA = saa/n - ga*ga;
+	const double gVarB = sbb/n - gb*gb;
+	const double gDenom = std::sqrt(std::max(gVarA*gVarB, 0.0));
+
+	SimilarityScores scores;
+	scores.meanNCC = sumNCC/n;
+	scores.meanSSIM = sumSSIM/n;
+	scores.globalNCC = gDenom > epsilon ? (sab/n - ga*gb)/gDenom : 0.0;
+	return scores;
+}
+
+#endif
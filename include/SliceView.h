@@ -0,0 +1,386 @@
+// File name: 	SliceView.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Strided views into the buffer of an itk::Image. A slice or slab view
+// 		is a pointer, sizes and strides plus the geometry of the voxel it starts
+// 		at, so taking one costs nothing. Statistics, histograms, remaps and
+// 		projections run on views in place; an image is only made from a view
+// 		(materializeSlice, materializeVolume) when it has to be written out.
+
+#ifndef ITKSCRIPTS_SLICEVIEW_H
+#define ITKSCRIPTS_SLICEVIEW_H
+
+#include "itkImage.h"
+
+#include <cstddef>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <type_traits>
+
+// 3D geometry shared by views: origin is the physical point of voxel (0, 0[, 0])
+struct ViewGeometry {
+	double origin[3];
+	double spacing[3];
+	double direction[9];	// row major, like itk::Image::GetDirection()
+};
+
+// plane of a volume: voxel (u, v) is data[u*stride[0] + v*stride[1]], u runs along
+// volume axis axis[0] and v along axis[1]
+template< typename TPixel >
+struct SliceView {
+	TPixel * data;
+	std::size_t size[2];
+	std::ptrdiff_t stride[2];
+	int axis[2];
+	ViewGeometry geometry;
+
+	TPixel & operator() (std::size_t u, std::size_t v) const { return data[u*stride[0] + v*stride[1]]; }
+	std::size_t pixels () const { return size[0]*size[1]; }
+
+	// the w x h part starting at (u, v), bounds are the caller's business
+	SliceView window (std::size_t u, std::size_t v, std::size_t w, std::size_t h) const {
+		SliceView part = *this;
+		part.data = &(*this)(u, v);
+		part.size[0] = w;
+		part.size[1] = h;
+		for (int e = 0; e < 3; ++e){
+			part.geometry.origin[e] += geometry.direction[3*e + axis[0]]*geometry.spacing[axis[0]]*u
+				+ geometry.direction[3*e + axis[1]]*geometry.spacing[axis[1]]*v;
+		}
+		return part;
+	}
+};
+
+// box of a volume: voxel (i, j, k) is data[i*stride[0] + j*stride[1] + k*stride[2]]
+template< typename TPixel >
+struct VolumeView {
+	TPixel * data;
+	std::size_t size[3];
+	std::ptrdiff_t stride[3];
+	ViewGeometry geometry;
+
+	TPixel & operator() (std::size_t i, std::size_t j, std::size_t k) const {
+		return data[i*stride[0] + j*stride[1] + k*stride[2]];
+	}
+
+	// slices first..first+count-1 along direction
+	VolumeView slab (int direction, std::size_t first, std::size_t count) const {
+		VolumeView part = *this;
+		part.data = data + first*stride[direction];
+		part.size[direction] = count;
+		for (int e = 0; e < 3; ++e){
+			part.geometry.origin[e] += geometry.direction[3*e + direction]*geometry.spacing[direction]*first;
+		}
+		return part;
+	}
+
+	// slice k along direction, in-slice axes in increasing order (like sliceAxes)
+	SliceView<TPixel> slice (int direction, std::size_t k) const {
+		const VolumeView part = slab(direction, k, 1);
+		SliceView<TPixel> view;
+		view.data = part.data;
+		view.axis[0] = (direction == 0) ? 1 : 0;
+		view.axis[1] = (direction == 2) ? 1 : 2;
+		for (int d = 0; d < 2; ++d){
+			view.size[d] = size[view.axis[d]];
+			view.stride[d] = stride[view.axis[d]];
+		}
+		view.geometry = part.geometry;
+		return view;
+	}
+};
+
+/********** VIEWS OF IMAGES **********/
+
+template< typename TImage >
+void viewGeometry (const TImage * image, ViewGeometry &geometry){
+	constexpr unsigned int Dimension = TImage::ImageDimension;
+	typename TImage::PointType origin;
+	image->TransformIndexToPhysicalPoint( image->GetBufferedRegion().GetIndex(), origin );
+	for (unsigned int d = 0; d < 3; ++d){
+		geometry.origin[d] = (d < Dimension) ? origin[d] : 0.0;
+		geometry.spacing[d] = (d < Dimension) ? image->GetSpacing()[d] : 1.0;
+		for (unsigned int e = 0; e < 3; ++e){
+			geometry.direction[3*d + e] = (d < Dimension && e < Dimension) ? image->GetDirection()[d][e] : (d == e ? 1.0 : 0.0);
+		}
+	}
+}
+
+// the whole buffered region of a volume, or of a 2D image as one slice along z
+template< typename TImage >
+VolumeView< typename std::remove_pointer< decltype(std::declval<TImage *>()->GetBufferPointer()) >::type >
+		imageView (TImage * image){
+	static_assert(TImage::ImageDimension == 2 || TImage::ImageDimension == 3, "views are over 2D or 3D images");
+	VolumeView< typename std::remove_pointer< decltype(image->GetBufferPointer()) >::type > view;
+	const typename TImage::SizeType size = image->GetBufferedRegion().GetSize();
+	view.data = image->GetBufferPointer();
+	view.size[0] = size[0];
+	view.size[1] = size[1];
+	view.size[2] = (TImage::ImageDimension == 3) ? size[TImage::ImageDimension - 1] : 1;
+	view.stride[0] = 1;
+	view.stride[1] = size[0];
+	view.stride[2] = (std::ptrdiff_t)size[0]*size[1];
+	viewGeometry(image, view.geometry);
+	return view;
+}
+
+/********** KERNELS **********/
+
+// sum, sum of squares, min and max of the voxels of a view
+struct RegionStatistics {
+	double sum, squareSum, min, max;
+	std::size_t count;
+};
+
+template< typename TPixel >
+RegionStatistics viewStatistics (const SliceView<TPixel> &view){
+	RegionStatistics stats = { 0.0, 0.0, std::numeric_limits<double>::max(), -std::numeric_limits<double>::max(), 0 };
+	for (std::size_t v = 0; v < view.size[1]; ++v){
+		const TPixel * row = view.data + v*view.stride[1];
+		for (std::size_t u = 0; u < view.size[0]; ++u){
+			const double curPix = row[u*view.stride[0]];
+			stats.sum += curPix;
+			stats.squareSum += curPix*curPix;
+			stats.min = std::min(stats.min, curPix);
+			stats.max = std::max(stats.max, curPix);
+		}
+	}
+	stats.count = view.pixels();
+	return stats;
+}
+
+// bins equal bins over [lower, upper], voxels outside are not counted, upper
+// itself goes to the last bin
+template< typename TPixel >
+std::vector<double> viewHistogram (const SliceView<TPixel> &view, std::size_t bins, double lower, double upper){
+	std::vector<double> histogram(bins, 0.0);
+	const double scale = (upper > lower) ? bins/(upper - lower) : 0.0;
+	for (std::size_t v = 0; v < view.size[1]; ++v){
+		const TPixel * row = view.data + v*view.stride[1];
+		for (std::size_t u = 0; u < view.size[0]; ++u){
+			const double curPix = row[u*view.stride[0]];
+			if (curPix < lower || curPix > upper){ continue; }
+			histogram[std::min<std::size_t>((curPix - lower)*scale, bins - 1)] += 1.0;
+		}
+	}
+	return histogram;
+}
+
+// v -> map(v) for every voxel of the view, in place
+template< typename TPixel, typename TMap >
+void viewRemap (const SliceView<TPixel> &view, TMap map){
+	for (std::size_t v = 0; v < view.size[1]; ++v){
+		TPixel * row = view.data + v*view.stride[1];
+		for (std::size_t u = 0; u < view.size[0]; ++u){
+			row[u*view.stride[0]] = map(row[u*view.stride[0]]);
+		}
+	}
+}
+
+// maximum along direction of volume into out, which has the size of one slice
+template< typename TPixel, typename TOutput >
+void viewMaximum (const VolumeView<TPixel> &volume, int direction, const SliceView<TOutput> &out){
+	for (std::size_t k = 0; k < volume.size[direction]; ++k){
+		const SliceView<TPixel> slice = volume.slice(direction, k);
+		for (std::size_t v = 0; v < out.size[1]; ++v){
+			const TPixel * in = slice.data + v*slice.stride[1];
+			TOutput * row = out.data + v*out.stride[1];
+			for (std::size_t u = 0; u < out.size[0]; ++u){
+				const TOutput value = in[u*slice.stride[0]];
+				if (k == 0 || value > row[u*out.stride[0]]){ row[u*out.stride[0]] = value; }
+			}
+		}
+	}
+}
+
+// mean along direction of volume into out, summed in double so that long lines of
+// integer voxels neither overflow nor lose the small ones
+template< typename TPixel, typename TOutput >
+void viewMean (const VolumeView<TPixel> &volume, int direction, const SliceView<TOutput> &out){
+	std::vector<double> sums(out.pixels(), 0.0);
+	for (std::size_t k = 0; k < volume.size[direction]; ++k){
+		const SliceView<TPixel> slice = volume.slice(direction, k);
+		double * sum = sums.data();
+		for (std::size_t v = 0; v < out.size[1]; ++v){
+			const TPixel * in = slice.data + v*slice.stride[1];
+			for (std::size_t u = 0; u < out.size[0]; ++u){ *sum++ += in[u*slice.stride[0]]; }
+		}
+	}
+	const double scale = volume.size[direction] > 0 ? 1.0/volume.size[direction] : 0.0;
+	const double * sum = sums.data();
+	for (std::size_t v = 0; v < out.size[1]; ++v){
+		TOutput * row = out.data + v*out.stride[1];
+		for (std::size_t u = 0; u < out.size[0]; ++u){ row[u*out.stride[0]] = static_cast<TOutput>(scale*(*sum++)); }
+	}
+}
+
+// itk::Histogram::Quantile on the bins of viewHistogram, interpolated inside the bin
+inline double histogramQuantile (const std::vector<double> &histogram, double lower, double upper, double p){
+	double total = 0.0;
+	for (double f : histogram){ total += f; }
+	const double interval = (upper - lower)/histogram.size();
+	if (!(total > 0.0)){ return lower; }
+
+	double cumulated = 0.0, p_n = (p < 0.5) ? 0.0 : 1.0, p_n_prev = p_n, f_n = 0.0;
+	if (p < 0.5){
+		std::size_t n = 0;
+		do {
+			f_n = histogram[n++];
+			cumulated += f_n;
+			p_n_prev = p_n;
+			p_n = cumulated/total;
+		} while (n < histogram.size() && p_n < p);
+		const double binMin = lower + (n - 1)*interval;
+		return (f_n > 0.0) ? binMin + ((p - p_n_prev)/(f_n/total))*interval : binMin;
+	}
+	std::size_t n = histogram.size();
+	do {
+		f_n = histogram[--n];
+		cumulated += f_n;
+		p_n_prev = p_n;
+		p_n = 1.0 - cumulated/total;
+	} while (n > 0 && p_n > p);
+	const double binMax = lower + (n + 1)*interval;
+	return (f_n > 0.0) ? binMax - ((p_n_prev - p)/(f_n/total))*interval : binMax;
+}
+
+// HistogramMatchingImageFilter with ThresholdAtMeanIntensity on, as a view kernel:
+// quantiles of the voxels at or above the mean of a slice are mapped piecewise
+// linearly onto the same quantiles of the reference, below the mean the map runs
+// linearly down to the minimums. The reference table is made once.
+class HistogramMatch {
+public:
+	template< typename TPixel >
+	HistogramMatch (const SliceView<TPixel> &reference, std::size_t levels = 100, std::size_t matchPoints = 15)
+		: m_Levels(levels), m_MatchPoints(matchPoints) {
+		m_Reference = quantiles(reference);
+	}
+
+	template< typename TPixel >
+	void apply (const SliceView<TPixel> &slice) const {
+		const Quantiles source = quantiles(slice);
+		const std::size_t last = m_MatchPoints + 1;
+		std::vector<double> gradients(last);
+		for (std::size_t j = 0; j < last; ++j){
+			gradients[j] = ratio(m_Reference.table[j+1] - m_Reference.table[j], source.table[j+1] - source.table[j]);
+		}
+		const double lowerGradient = ratio(m_Reference.table[0] - m_Reference.min, source.table[0] - source.min);
+		const double upperGradient = ratio(m_Reference.max - m_Reference.table[last], source.max - source.table[last]);
+		const double lowest = std::numeric_limits<TPixel>::lowest(), highest = std::numeric_limits<TPixel>::max();
+
+		viewRemap(slice, [&](TPixel value){
+			const double curPix = value;
+			std::size_t j = 0;
+			while (j <= last && curPix >= source.table[j]){ ++j; }
+			double mapped;
+			if (j == 0){
+				mapped = m_Reference.table[0] + (curPix - source.table[0])*lowerGradient;
+			} else if (j > last){
+				mapped = m_Reference.table[last] + (curPix - source.table[last])*upperGradient;
+			} else {
+				mapped = m_Reference.table[j-1] + (curPix - source.table[j-1])*gradients[j-1];
+			}
+			return static_cast<TPixel>(std::min(highest, std::max(lowest, mapped)));
+		});
+	}
+
+private:
+	struct Quantiles {
+		double min, max;
+		std::vector<double> table;	// threshold, match points, max
+	};
+
+	static double ratio (double numerator, double denominator){
+		return (denominator != 0.0) ? numerator/denominator : 0.0;
+	}
+
+	template< typename TPixel >
+	Quantiles quantiles (const SliceView<TPixel> &view) const {
+		const RegionStatistics stats = viewStatistics(view);
+		const double mean = stats.sum/stats.count;
+		const std::vector<double> histogram = viewHistogram(view, m_Levels, mean, stats.max);
+		Quantiles result;
+		result.min = stats.min;
+		result.max = stats.max;
+		result.table.resize(m_MatchPoints + 2);
+		result.table[0] = mean;
+		result.table[m_MatchPoints + 1] = stats.max;
+		for (std::size_t j = 1; j <= m_MatchPoints; ++j){
+			result.table[j] = histogramQuantile(histogram, mean, stats.max, (double)j/(m_MatchPoints + 1));
+		}
+		return result;
+	}
+
+	std::size_t m_Levels;
+	std::size_t m_MatchPoints;
+	Quantiles m_Reference;
+};
+
+/********** MATERIALIZATION **********/
+
+// 2D image of a slice view, geometry collapsed to the in-slice axes like
+// ExtractImageFilter::SetDirectionCollapseToSubmatrix
+template< typename TSliceImage, typename TPixel >
+typename TSliceImage::Pointer materializeSlice (const SliceView<TPixel> &view){
+	static_assert(TSliceImage::ImageDimension == 2, "materializeSlice makes 2D images");
+	typename TSliceImage::RegionType region;
+	typename TSliceImage::SpacingType spacing;
+	typename TSliceImage::PointType origin;
+	typename TSliceImage::DirectionType direction;
+	for (int d = 0; d < 2; ++d){
+		region.SetIndex(d, 0);
+		region.SetSize(d, view.size[d]);
+		spacing[d] = view.geometry.spacing[view.axis[d]];
+		origin[d] = view.geometry.origin[view.axis[d]];
+		for (int e = 0; e < 2; ++e){ direction[d][e] = view.geometry.direction[3*view.axis[d] + view.axis[e]]; }
+	}
+
+	typename TSliceImage::Pointer image = TSliceImage::New();
+	image->SetRegions( region );
+	image->SetSpacing( spacing );
+	image->SetOrigin( origin );
+	image->SetDirection( direction );
+	image->Allocate();
+	typename TSliceImage::PixelType * out = image->GetBufferPointer();
+	for (std::size_t v = 0; v < view.size[1]; ++v){
+		const TPixel * row = view.data + v*view.stride[1];
+		for (std::size_t u = 0; u < view.size[0]; ++u){ *out++ = row[u*view.stride[0]]; }
+	}
+	return image;
+}
+
+// 3D image of a volume view, starting at index 0
+template< typename TImage, typename TPixel >
+typename TImage::Pointer materializeVolume (const VolumeView<TPixel> &view){
+	static_assert(TImage::ImageDimension == 3, "materializeVolume makes volumes");
+	typename TImage::RegionType region;
+	typename TImage::SpacingType spacing;
+	typename TImage::PointType origin;
+	typename TImage::DirectionType direction;
+	for (int d = 0; d < 3; ++d){
+		region.SetIndex(d, 0);
+		region.SetSize(d, view.size[d]);
+		spacing[d] = view.geometry.spacing[d];
+		origin[d] = view.geometry.origin[d];
+		for (int e = 0; e < 3; ++e){ direction[d][e] = view.geometry.direction[3*d + e]; }
+	}
+
+	typename TImage::Pointer image = TImage::New();
+	image->SetRegions( region );
+	image->SetSpacing( spacing );
+	image->SetOrigin( origin );
+	image->SetDirection( direction );
+	image->Allocate();
+	typename TImage::PixelType * out = image->GetBufferPointer();
+	for (std::size_t k = 0; k < view.size[2]; ++k){
+		for (std::size_t j = 0; j < view.size[1]; ++j){
+			const TPixel * row = view.data + j*view.stride[1] + k*view.stride[2];
+			for (std::size_t i = 0; i < view.size[0]; ++i){ *out++ = row[i*view.stride[0]]; }
+		}
+	}
+	return image;
+}
+
+#endif
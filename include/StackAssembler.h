@@ -0,0 +1,182 @@
+// File name: 	StackAssembler.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Stack a series of 2D slices (slice%03d.tif, ...) into one volume, the
+// 		in-tree c3d -tile. The volume is allocated once from the first slice and
+// 		every slice is decoded by its own ImageIO on a pool of threads; along z a
+// 		slice is read straight into its plane of the volume. Every slice must
+// 		have the size, spacing and pixel type of the first.
+
+#ifndef ITKSCRIPTS_STACKASSEMBLER_H
+#define ITKSCRIPTS_STACKASSEMBLER_H
+
+#include "itkImage.h"
+#include "itkImageIOBase.h"
+#include "itkImageIOFactory.h"
+
+#include "SliceView.h"
+#include "WorkerThreads.h"
+
+#include <cmath>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <algorithm>
+
+// what a slice file says about itself, the first one sets what all must match
+struct SliceInformation {
+	std::size_t size[2];
+	double spacing[2];
+	double origin[2];
+	double direction[4];
+	itk::ImageIOBase::IOComponentType component;
+};
+
+// an ImageIO for filename with its information read, 2D or a 3D file of one slice
+inline itk::ImageIOBase::Pointer openSliceIO (const std::string &filename, SliceInformation &information){
+	itk::ImageIOBase::Pointer io = itk::ImageIOFactory::CreateImageIO( filename.c_str(), itk::ImageIOFactory::ReadMode );
+	if (io.IsNull()){ itkGenericExceptionMacro(<< "no ImageIO can read " << filename); }
+	io->SetFileName( filename );
+	io->ReadImageInformation();
+
+	const unsigned int dimensions = io->GetNumberOfDimensions();
+	if (dimensions < 2 || (dimensions > 2 && io->GetDimensions(2) != 1) || dimensions > 3){
+		itkGenericExceptionMacro(<< filename << " is not a 2D slice");
+	}
+	if (io->GetNumberOfComponents() != 1){
+		itkGenericExceptionMacro(<< filename << " has " << io->GetNumberOfComponents() << " components per pixel, slices must be scalar");
+	}
+	for (unsigned int d = 0; d < 2; ++d){
+		information.size[d] = io->GetDimensions(d);
+		information.spacing[d] = io->GetSpacing(d);
+		information.origin[d] = io->GetOrigin(d);
+		const std::vector<double> axis = io->GetDirection(d);
+		for (unsigned int e = 0; e < 2; ++e){ information.direction[2*e + d] = (e < axis.size()) ? axis[e] : (d == e ? 1.0 : 0.0); }
+	}
+	information.component = io->GetComponentType();
+
+	itk::ImageIORegion region( dimensions );
+	for (unsigned int d = 0; d < dimensions; ++d){
+		region.SetIndex(d, 0);
+		region.SetSize(d, io->GetDimensions(d));
+	}
+	io->SetIORegion( region );
+	return io;
+}
+
+// slices that do not match the first would make a volume that is silently wrong
+inline void checkSliceInformation (const SliceInformation &first, const SliceInformation &slice, const std::string &filename){
+	if (slice.size[0] != first.size[0] || slice.size[1] != first.size[1]){
+		itkGenericExceptionMacro(<< filename << " is " << slice.size[0] << "x" << slice.size[1]
+			<< ", the first slice is " << first.size[0] << "x" << first.size[1]);
+	}
+	for (int d = 0; d < 2; ++d){
+		if (std::fabs(slice.spacing[d] - first.spacing[d]) > 1e-6*std::fabs(first.spacing[d])){
+			itkGenericExceptionMacro(<< filename << " has spacing " << slice.spacing[0] << "x" << slice.spacing[1]
+				<< ", the first slice has " << first.spacing[0] << "x" << first.spacing[1]);
+		}
+	}
+	if (slice.component != first.component){
+		itkGenericExceptionMacro(<< filename << " has pixel type " << itk::ImageIOBase::GetComponentTypeAsString(slice.component)
+			<< ", the first slice has " << itk::ImageIOBase::GetComponentTypeAsString(first.component));
+	}
+}
+
+template< typename TInput, typename TPixel >
+void convertSliceRow (const TInput * in, std::size_t count, TPixel * out, std::ptrdiff_t stride){
+	for (std::size_t i = 0; i < count; ++i){ out[i*stride] = static_cast<TPixel>(in[i]); }
+}
+
+// raw decoded pixels of component type into a slice view
+template< typename TPixel >
+void convertSlice (const char * raw, itk::ImageIOBase::IOComponentType component, const SliceView<TPixel> &slice){
+	for (std::size_t v = 0; v < slice.size[1]; ++v){
+		TPixel * out = slice.data + v*slice.stride[1];
+		const std::size_t n = slice.size[0], first = v*n;
+		switch (component){
+			case itk::ImageIOBase::UCHAR: convertSliceRow(reinterpret_cast<const unsigned char *>(raw) + first, n, out, slice.stride[0]); break;
+			case itk::ImageIOBase::CHAR: convertSliceRow(reinterpret_cast<const signed char *>(raw) + first, n, out, slice.stride[0]); break;
+			case itk::ImageIOBase::USHORT: convertSliceRow(reinterpret_cast<const unsigned short *>(raw) + first, n, out, slice.stride[0]); break;
+			case itk::ImageIOBase::SHORT: convertSliceRow(reinterpret_cast<const short *>(raw) + first, n, out, slice.stride[0]); break;
+			case itk::ImageIOBase::UINT: convertSliceRow(reinterpret_cast<const unsigned int *>(raw) + first, n, out, slice.stride[0]); break;
+			case itk::ImageIOBase::INT: convertSliceRow(reinterpret_cast<const int *>(raw) + first, n, out, slice.stride[0]); break;
+			case itk::ImageIOBase::FLOAT: convertSliceRow(reinterpret_cast<const float *>(raw) + first, n, out, slice.stride[0]); break;
+			case itk::ImageIOBase::DOUBLE: convertSliceRow(reinterpret_cast<const double *>(raw) + first, n, out, slice.stride[0]); break;
+			default: itkGenericExceptionMacro(<< "unsupported pixel type " << itk::ImageIOBase::GetComponentTypeAsString(component));
+		}
+	}
+}
+
+// filenames[k] becomes slice k along direction. The in-slice geometry is the first
+// slice's, spacing is the slice distance and the stack starts at 0 along direction.
+template< typename TImage >
+typename TImage::Pointer assembleStack (const std::vector<std::string> &filenames, int direction = 2,
+		double spacing = 1.0, unsigned int threads = workerThreads()){
+	static_assert(TImage::ImageDimension == 3, "slices are stacked into volumes");
+	using PixelType = typename TImage::PixelType;
+	if (filenames.empty()){ itkGenericExceptionMacro(<< "no slices to assemble"); }
+
+	SliceInformation first;
+	openSliceIO(filenames[0], first);
+
+	// in-slice axes in increasing order, like sliceAxes
+	const int axes[2] = { (direction == 0) ? 1 : 0, (direction == 2) ? 1 : 2 };
+	typename TImage::RegionType region;
+	typename TImage::SpacingType volumeSpacing;
+	typename TImage::PointType origin;
+	typename TImage::DirectionType volumeDirection;
+	volumeDirection.SetIdentity();
+	for (int d = 0; d < 2; ++d){
+		region.SetSize(axes[d], first.size[d]);
+		volumeSpacing[axes[d]] = first.spacing[d];
+		origin[axes[d]] = first.origin[d];
+		for (int e = 0; e < 2; ++e){ volumeDirection[axes[e]][axes[d]] = first.direction[2*e + d]; }
+	}
+	region.SetSize(direction, filenames.size());
+	volumeSpacing[direction] = spacing;
+	origin[direction] = 0.0;
+	for (int d = 0; d < 3; ++d){ region.SetIndex(d, 0); }
+
+	typename TImage::Pointer volume = TImage::New();
+	volume->SetRegions( region );
+	volume->SetSpacing( volumeSpacing );
+	volume->SetOrigin( origin );
+	volume->SetDirection( volumeDirection );
+	volume->Allocate();
+	const VolumeView<PixelType> view = imageView(volume.GetPointer());
+
+	// slices are handed out one at a time, the first error stops the others
+	std::atomic<std::size_t> next(0);
+	std::mutex errorMutex;
+	std::string error;
+	auto worker = [&](){
+		std::vector<char> raw;
+		for (std::size_t k = next++; k < filenames.size(); k = next++){
+			try {
+				SliceInformation information;
+				itk::ImageIOBase::Pointer io = openSliceIO(filenames[k], information);
+				checkSliceInformation(first, information, filenames[k]);
+				const SliceView<PixelType> slice = view.slice(direction, k);
+				if (direction == 2 && information.component == itk::ImageIOBase::MapPixelType<PixelType>::CType){
+					io->Read( slice.data );
+					continue;
+				}
+				raw.resize(io->GetImageSizeInBytes());
+				io->Read( raw.data() );
+				convertSlice(raw.data(), information.component, slice);
+			} catch ( itk::ExceptionObject & err ){
+				std::lock_guard<std::mutex> lock(errorMutex);
+				if (error.empty()){ error = err.GetDescription(); }
+				next = filenames.size();
+			}
+		}
+	};
+	threads = std::max<unsigned int>(1, std::min<std::size_t>(threads, filenames.size()));
+	runWorkers(threads, worker);
+	if (!error.empty()){ itkGenericExceptionMacro(<< error); }
+	return volume;
+}
+
+#endif
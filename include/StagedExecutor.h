@@ -0,0 +1,201 @@
+// File name: 	StagedExecutor.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Run items (slices, files) through stages such as read, compute and write,
+// 		every stage on its own threads, so decoding, math and compression overlap
+// 		and throughput follows the slowest stage instead of the sum of all.
+// 		Stages are joined by bounded lock-free single-producer/single-consumer
+// 		rings: thread t of a stage of n threads takes items k with k % n == t, and
+// 		item k goes from its thread in one stage to its thread in the next through
+// 		the ring of that pair. Each thread handles its items in increasing order,
+// 		so the oldest unfinished item can always move and the rings never deadlock.
+
+#ifndef ITKSCRIPTS_STAGEDEXECUTOR_H
+#define ITKSCRIPTS_STAGEDEXECUTOR_H
+
+#include "itkImage.h"
+
+#include "Trace.h"
+#include "PerfCounters.h"
+
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <memory>
+#include <sstream>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+
+// bounded ring with one pushing and one popping thread, no locks
+template< typename T >
+class SpscRing {
+public:
+	explicit SpscRing (std::size_t capacity) : m_Slots(capacity + 1), m_Head(0), m_Tail(0) {}
+
+	bool tryPush (T &value){
+		const std::size_t tail = m_Tail.load(std::memory_order_relaxed);
+		const std::size_t next = (tail + 1) % m_Slots.size();
+		if (next == m_Head.load(std::memory_order_acquire)){ return false; }
+		m_Slots[tail] = std::move(value);
+		m_Tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	bool tryPop (T &value){
+		const std::size_t head = m_Head.load(std::memory_order_relaxed);
+		if (head == m_Tail.load(std::memory_order_acquire)){ return false; }
+		value = std::move(m_Slots[head]);
+		m_Head.store((head + 1) % m_Slots.size(), std::memory_order_release);
+		return true;
+	}
+
+private:
+	std::vector<T> m_Slots;
+	alignas(64) std::atomic<std::size_t> m_Head;	// own cache lines, producer and consumer don't share
+	alignas(64) std::atomic<std::size_t> m_Tail;
+};
+
+// ITKSCRIPTS_STAGE_THREADS="2,1,2" overrides the thread budget of stage 0, 1, 2, ...
+inline unsigned int stageThreadBudget (std::size_t stage, unsigned int fallback){
+	const char * value = std::getenv("ITKSCRIPTS_STAGE_THREADS");
+	if (!value){ return fallback; }
+	std::stringstream budgets(value);
+	std::string budget;
+	for (std::size_t s = 0; std::getline(budgets, budget, ','); ++s){
+		if (s == stage){
+			const int threads = std::atoi(budget.c_str());
+			return threads > 0 ? threads : fallback;
+		}
+	}
+	return fallback;
+}
+
+template< typename TItem >
+class StagedExecutor {
+public:
+	// work(k, item) for item k, the first stage gets a default constructed item
+	using StageWork = std::function< void (std::size_t, TItem &) >;
+
+	explicit StagedExecutor (std::size_t queueDepth = 4) : m_QueueDepth(std::max<std::size_t>(1, queueDepth)) {}
+
+	void addStage (const std::string &name, unsigned int threads, StageWork work){
+		Stage stage;
+		stage.name = name;
+		stage.threads = std::max(1u, stageThreadBudget(m_Stages.size(), threads));
+		stage.work = work;
+		stage.busy = 0;
+		stage.counters = emptyPerfSample();
+		m_Stages.push_back(std::move(stage));
+	}
+
+	// items 0..count-1 through every stage. The first exception stops all stages
+	// and is thrown again here once every thread has stopped.
+	void run (std::size_t count){
+		if (m_Stages.empty() || count == 0){ return; }
+		const std::size_t stages = m_Stages.size();
+
+		// rings[s][p*consumers + c] carries items from thread p of stage s to thread c of stage s+1
+		std::vector< std::vector< std::unique_ptr< SpscRing<TItem> > > > rings(stages - 1);
+		for (std::size_t s = 0; s + 1 < stages; ++s){
+			for (unsigned int r = 0; r < m_Stages[s].threads*m_Stages[s+1].threads; ++r){
+				rings[s].push_back(std::unique_ptr< SpscRing<TItem> >(new SpscRing<TItem>(m_QueueDepth)));
+			}
+		}
+
+		m_Abort = false;
+		m_Error.clear();
+		for (Stage &stage : m_Stages){
+			stage.busy = 0;
+			stage.counters = emptyPerfSample();
+		}
+
+		auto worker = [&](std::size_t s, unsigned int t){
+			Stage &stage = m_Stages[s];
+			const unsigned int threads = stage.threads;
+			std::chrono::nanoseconds::rep busy = 0;
+			PerfCounters counters;	// per thread and what it starts, summed over the stage's threads
+			PerfSample counted = emptyPerfSample();
+			try {
+				for (std::size_t k = t; k < count && !m_Abort; k += threads){
+					TItem item;
+					if (s > 0 && !wait([&](){ return rings[s-1][(k % m_Stages[s-1].threads)*threads + t]->tryPop(item); })){ break; }
+					auto begin = std::chrono::steady_clock::now();
+					counters.start();
+					{
+						TraceSpan span("stage", stage.name);
+						if (traceEnabled()){ span.setDetail("item " + std::to_string(k)); }
+						stage.work(k, item);
+					}
+					counted += counters.stop();
+					busy += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - begin).count();
+					if (s + 1 < stages && !wait([&](){ return rings[s][t*m_Stages[s+1].threads + k % m_Stages[s+1].threads]->tryPush(item); })){ break; }
+				}
+			} catch ( itk::ExceptionObject & err ){
+				fail(stage.name + ": " + err.GetDescription());
+			} catch ( std::exception & err ){
+				fail(stage.name + ": " + err.what());
+			}
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			stage.busy += busy;
+			stage.counters += counted;
+		};
+
+		std::vector<std::thread> workers;
+		for (std::size_t s = 0; s < stages; ++s){
+			for (unsigned int t = 0; t < m_Stages[s].threads; ++t){ workers.push_back(std::thread(worker, s, t)); }
+		}
+		for (auto &w : workers){ w.join(); }
+		if (m_Abort){ itkGenericExceptionMacro(<< m_Error); }
+	}
+
+	// thread budget and busy time of every stage of the last run, the busiest
+	// stage per thread is the one to give more threads. With ITKSCRIPTS_PERF the
+	// counters tell whether it waits on memory or computes.
+	void report (std::ostream &out) const {
+		for (const Stage &stage : m_Stages){
+			out << stage.name << ": " << stage.threads << " threads, " << stage.busy/1000000 << " milliseconds busy"
+				<< describePerfSample(stage.counters) << "\n";
+		}
+	}
+
+private:
+	struct Stage {
+		std::string name;
+		unsigned int threads;
+		StageWork work;
+		std::chrono::nanoseconds::rep busy;
+		PerfSample counters;
+	};
+
+	// spin, then yield, then sleep until ready() or an abort
+	template< typename TReady >
+	bool wait (TReady ready){
+		for (unsigned int tries = 0; !ready(); ++tries){
+			if (m_Abort){ return false; }
+			if (tries < 64){ continue; }
+			if (tries < 256){ std::this_thread::yield(); continue; }
+			std::this_thread::sleep_for(std::chrono::microseconds(100));
+		}
+		return true;
+	}
+
+	void fail (const std::string &error){
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		if (!m_Abort){ m_Error = error; }
+		m_Abort = true;
+	}
+
+	std::size_t m_QueueDepth;
+	std::vector<Stage> m_Stages;
+	std::atomic<bool> m_Abort;
+	std::string m_Error;
+	std::mutex m_Mutex;
+};
+
+#endif
@@ -0,0 +1,147 @@
+// File name: 	SyntheticVolume.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Deterministic OCT-like volumes for benchmarks, so numbers can be
+// 		compared before and after a change without patient data. Depth runs
+// 		along y: dark vitreous, retinal layers of different reflectivity that
+// 		dip at a foveal pit in the middle of the (x, z) plane, then choroid
+// 		fading out. Every voxel is multiplied by speckle, the mean of `looks`
+// 		exponentials (1 look is fully developed speckle, more looks are smoother).
+// 		The random numbers are our own (splitmix64), seeded per slice along z,
+// 		so a seed gives the same voxels on every machine and thread count.
+
+#ifndef ITKSCRIPTS_SYNTHETICVOLUME_H
+#define ITKSCRIPTS_SYNTHETICVOLUME_H
+
+#include "itkImage.h"
+
+#include "WorkerThreads.h"
+
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <limits>
+#include <atomic>
+#include <algorithm>
+
+struct SyntheticVolumeParameters {
+	std::size_t size[3];
+	unsigned int looks;	// speckle looks, 1 = fully developed
+	double brightness;	// mean of the brightest layer, as a fraction of the pixel range
+	uint64_t seed;
+
+	SyntheticVolumeParameters () : looks(4), brightness(0.6), seed(1) {
+		size[0] = 500;
+		size[1] = 500;
+		size[2] = 200;
+	}
+};
+
+class SplitMix64 {
+public:
+	explicit SplitMix64 (uint64_t seed) : m_State(seed) {}
+
+	uint64_t next (){
+		uint64_t z = (m_State += 0x9E3779B97F4A7C15ULL);
+		z = (z ^ (z >> 30))*0xBF58476D1CE4E5B9ULL;
+		z = (z ^ (z >> 27))*0x94D049BB133111EBULL;
+		return z ^ (z >> 31);
+	}
+
+	// uniform in (0, 1]
+	double uniform (){
+		return ((next() >> 11) + 1)*(1.0/9007199254740992.0);
+	}
+
+private:
+	uint64_t m_State;
+};
+
+// reflectivity at depth t below the inner retinal surface, t in fractions of the height
+inline double retinaReflectivity (double t){
+	// nerve fiber, ganglion cell, inner plexiform, inner nuclear, outer plexiform,
+	// outer nuclear, ellipsoid zone, retinal pigment epithelium
+	static const double thickness[] = { 0.04, 0.05, 0.04, 0.04, 0.03, 0.08, 0.015, 0.03 };
+	static const double reflectivity[] = { 0.9, 0.45, 0.65, 0.3, 0.6, 0.2, 1.0, 0.95 };
+	if (t < 0.0){ return 0.03; }	// vitreous
+	for (int layer = 0; layer < 8; ++layer){
+		if (t < thickness[layer]){ return reflectivity[layer]; }
+		t -= thickness[layer];
+	}
+	return 0.03 + 0.5*std::exp(-t/0.08);	// choroid, fading with depth
+}
+
+// pixel range the brightness is a fraction of: the type's range for integers, 255 for floats
+template< typename TPixel >
+double syntheticRange (){
+	return std::numeric_limits<TPixel>::is_integer ? (double)std::numeric_limits<TPixel>::max() : 255.0;
+}
+
+template< typename TImage >
+typename TImage::Pointer makeSyntheticVolume (const SyntheticVolumeParameters &parameters){
+	static_assert(TImage::ImageDimension == 3, "synthetic volumes are 3D");
+	using PixelType = typename TImage::PixelType;
+
+	typename TImage::RegionType region;
+	for (int d = 0; d < 3; ++d){
+		region.SetIndex(d, 0);
+		region.SetSize(d, parameters.size[d]);
+	}
+	typename TImage::Pointer image = TImage::New();
+	image->SetRegions( region );
+	image->Allocate();
+
+	const std::size_t width = parameters.size[0], height = parameters.size[1], depth = parameters.size[2];
+	const double range = syntheticRange<PixelType>();
+	const double top = std::numeric_limits<PixelType>::is_integer ? range : std::numeric_limits<PixelType>::max();
+	const double bottom = std::numeric_limits<PixelType>::is_integer ? (double)std::numeric_limits<PixelType>::min() : 0.0;
+	const unsigned int looks = std::max(1u, parameters.looks);
+	PixelType * buffer = image->GetBufferPointer();
+
+	std::atomic<std::size_t> next(0);
+	auto worker = [&](){
+		std::vector<double> surface(width);
+		for (std::size_t z = next++; z < depth; z = next++){
+			SplitMix64 random(parameters.seed*0x9E3779B97F4A7C15ULL + z);
+			PixelType * slice = buffer + z*width*height;
+
+			// inner surface at a third of the height, bowed and with a pit in the middle
+			const double dz = depth > 1 ? (double)z/(depth - 1) - 0.5 : 0.0;
+			for (std::size_t x = 0; x < width; ++x){
+				const double dx = width > 1 ? (double)x/(width - 1) - 0.5 : 0.0;
+				surface[x] = 0.3 + 0.05*(dx*dx + dz*dz) + 0.06*std::exp(-(dx*dx + dz*dz)/0.01);
+			}
+			for (std::size_t y = 0; y < height; ++y){
+				PixelType * row = slice + y*width;
+				for (std::size_t x = 0; x < width; ++x){
+					double speckle = 0.0;
+					for (unsigned int l = 0; l < looks; ++l){ speckle -= std::log(random.uniform()); }
+					const double value = range*parameters.brightness*retinaReflectivity((double)y/height - surface[x])*speckle/looks;
+					row[x] = static_cast<PixelType>(std::min(top, std::max(bottom, value)));
+				}
+			}
+		}
+	};
+	const unsigned int threads = std::max<unsigned int>(1, std::min<std::size_t>(workerThreads(), depth));
+	runWorkers(threads, worker);
+	return image;
+}
+
+// "500x500x200" into size, false when it is not three positive numbers
+inline bool parseVolumeSize (const std::string &text, std::size_t size[3]){
+	std::size_t start = 0;
+	for (int d = 0; d < 3; ++d){
+		const std::size_t end = (d < 2) ? text.find('x', start) : text.size();
+		if (end == std::string::npos || end == start){ return false; }
+		const std::string number = text.substr(start, end - start);
+		if (number.find_first_not_of("0123456789") != std::string::npos){ return false; }
+		size[d] = std::stoul(number);
+		if (size[d] == 0){ return false; }
+		start = end + 1;
+	}
+	return true;
+}
+
+#endif
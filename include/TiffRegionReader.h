@@ -0,0 +1,165 @@
+// File name: 	TiffRegionReader.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Region reads of single-page grayscale TIFF, straight through ITK's
+// 		libtiff (itk_tiff.h). TIFFImageIO in ITK 4.12 decodes the whole page for
+// 		any requested region; here only the strips or tiles the region touches
+// 		are decoded, so a 31x31 window of a large en-face mosaic costs a strip
+// 		or a tile, not the page. Blocks are spread over threads, each with its
+// 		own TIFF handle. Anything unusual (palettes, several samples, several
+// 		pages, odd bit depths or orientations) is left to ITK.
+
+#ifndef ITKSCRIPTS_TIFFREGIONREADER_H
+#define ITKSCRIPTS_TIFFREGIONREADER_H
+
+#include "itkImage.h"
+#include "itk_tiff.h"
+
+#include "FileNames.h"
+#include "WorkerThreads.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+inline bool isTiff (const std::string &filename){
+	const std::string extension = fileExtension(filename);
+	return extension == ".tif" || extension == ".tiff";
+}
+
+// the part of a TIFF page layout the region reader needs
+struct TiffLayout {
+	uint32_t width, height;
+	uint16_t bits, format;
+	bool tiled;
+	uint32_t blockWidth, blockHeight;	// tile size, or width x rows per strip
+};
+
+// false when the page is not a plain grayscale image this reader handles
+inline bool readTiffLayout (TIFF * tif, TiffLayout &layout){
+	uint16_t samples = 1, photometric = PHOTOMETRIC_MINISBLACK, orientation = ORIENTATION_TOPLEFT;
+	layout.bits = 1;
+	layout.format = SAMPLEFORMAT_UINT;
+	if (!TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &layout.width) || !TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &layout.height)){
+		return false;
+	}
+	TIFFGetField(tif, TIFFTAG_SAMPLESPERPIXEL, &samples);
+	TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &layout.bits);
+	TIFFGetField(tif, TIFFTAG_SAMPLEFORMAT, &layout.format);
+	TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &photometric);
+	TIFFGetField(tif, TIFFTAG_ORIENTATION, &orientation);
+	if (samples != 1 || photometric != PHOTOMETRIC_MINISBLACK || orientation != ORIENTATION_TOPLEFT){ return false; }
+	if (layout.bits != 8 && layout.bits != 16 && layout.bits != 32 && layout.bits != 64){ return false; }
+	if (layout.format == SAMPLEFORMAT_IEEEFP ? (layout.bits < 32) : (layout.format != SAMPLEFORMAT_UINT && layout.format != SAMPLEFORMAT_INT)){
+		return false;
+	}
+
+	layout.tiled = TIFFIsTiled(tif);
+	if (layout.tiled){
+		if (!TIFFGetField(tif, TIFFTAG_TILEWIDTH, &layout.blockWidth) || !TIFFGetField(tif, TIFFTAG_TILELENGTH, &layout.blockHeight)){
+			return false;
+		}
+	} else {
+		layout.blockWidth = layout.width;
+		layout.blockHeight = layout.height;
+		TIFFGetField(tif, TIFFTAG_ROWSPERSTRIP, &layout.blockHeight);
+		layout.blockHeight = std::min(layout.blockHeight, layout.height);
+	}
+	return layout.blockWidth > 0 && layout.blockHeight > 0;
+}
+
+template< typename TSample, typename TPixel >
+void convertTiffRow (const unsigned char * in, uint32_t count, TPixel * out){
+	const TSample * samples = reinterpret_cast<const TSample *>(in);
+	for (uint32_t i = 0; i < count; ++i){ out[i] = static_cast<TPixel>(samples[i]); }
+}
+
+// count samples of the layout's type into pixels
+template< typename TPixel >
+void convertTiffSamples (const TiffLayout &layout, const unsigned char * in, uint32_t count, TPixel * out){
+	if (layout.format == SAMPLEFORMAT_IEEEFP){
+		if (layout.bits == 32){ convertTiffRow<float>(in, count, out); }
+		else { convertTiffRow<double>(in, count, out); }
+	} else if (layout.format == SAMPLEFORMAT_INT){
+		switch (layout.bits){
+			case 8: convertTiffRow<int8_t>(in, count, out); break;
+			case 16: convertTiffRow<int16_t>(in, count, out); break;
+			case 32: convertTiffRow<int32_t>(in, count, out); break;
+			default: convertTiffRow<int64_t>(in, count, out); break;
+		}
+	} else {
+		switch (layout.bits){
+			case 8: convertTiffRow<uint8_t>(in, count, out); break;
+			case 16: convertTiffRow<uint16_t>(in, count, out); break;
+			case 32: convertTiffRow<uint32_t>(in, count, out); break;
+			default: convertTiffRow<uint64_t>(in, count, out); break;
+		}
+	}
+}
+
+// Fill the buffered region of image (already allocated, 2D or a one-slice 3D) from
+// the only page of a TIFF. Returns false when the file is not something this
+// reader handles or a block fails to decode, the caller then reads through ITK.
+template< typename TImage >
+bool readTiffRegion (const std::string &filename, TImage * image,
+		unsigned int threads = workerThreads()){
+	const typename TImage::RegionType region = image->GetBufferedRegion();
+	if (TImage::ImageDimension > 3){ return false; }
+	if (TImage::ImageDimension == 3 && (region.GetIndex(2) != 0 || region.GetSize(2) != 1)){ return false; }
+
+	TIFFErrorHandler warnings = TIFFSetWarningHandler(nullptr);	// unknown tags are ITK's business
+	TIFF * tif = TIFFOpen(filename.c_str(), "r");
+	TIFFSetWarningHandler(warnings);
+	if (!tif){ return false; }
+	TiffLayout layout;
+	const bool handled = TIFFNumberOfDirectories(tif) == 1 && readTiffLayout(tif, layout);
+	TIFFClose(tif);
+	if (!handled){ return false; }
+
+	const uint32_t x0 = region.GetIndex(0), y0 = region.GetIndex(1);
+	const uint32_t x1 = x0 + region.GetSize(0), y1 = y0 + region.GetSize(1);
+	if (x1 > layout.width || y1 > layout.height){ return false; }
+	if (x1 == x0 || y1 == y0){ return true; }
+
+	// strips or tiles the region touches, in row-major block order
+	const uint32_t bx0 = x0/layout.blockWidth, bx1 = (x1 - 1)/layout.blockWidth;
+	const uint32_t by0 = y0/layout.blockHeight, by1 = (y1 - 1)/layout.blockHeight;
+	const uint32_t blocksAcross = bx1 - bx0 + 1;
+	const uint32_t blockCount = blocksAcross*(by1 - by0 + 1);
+	const std::size_t sampleBytes = layout.bits/8;
+
+	typename TImage::PixelType * out = image->GetBufferPointer();
+	const std::size_t outWidth = region.GetSize(0);
+	std::atomic<uint32_t> next(0);
+	std::atomic<bool> failed(false);
+	auto worker = [&](){
+		TIFF * handle = TIFFOpen(filename.c_str(), "r");
+		if (!handle){ failed = true; return; }
+		std::vector<unsigned char> block(layout.tiled ? TIFFTileSize(handle) : TIFFStripSize(handle));
+		for (uint32_t b = next++; b < blockCount && !failed; b = next++){
+			const uint32_t bx = bx0 + b % blocksAcross, by = by0 + b / blocksAcross;
+			const uint32_t left = bx*layout.blockWidth, top = by*layout.blockHeight;
+			const tmsize_t read = layout.tiled
+				? TIFFReadEncodedTile(handle, TIFFComputeTile(handle, left, top, 0, 0), block.data(), block.size())
+				: TIFFReadEncodedStrip(handle, TIFFComputeStrip(handle, top, 0), block.data(), block.size());
+			if (read < 0){ failed = true; break; }
+
+			// the part of this block inside the region, rows of a tile are tile wide
+			const uint32_t rowLeft = std::max(x0, left), rowRight = std::min(x1, left + layout.blockWidth);
+			const uint32_t rowTop = std::max(y0, top), rowBottom = std::min(y1, std::min(top + layout.blockHeight, layout.height));
+			for (uint32_t y = rowTop; y < rowBottom; ++y){
+				const unsigned char * row = block.data() + ((std::size_t)(y - top)*layout.blockWidth + (rowLeft - left))*sampleBytes;
+				convertTiffSamples(layout, row, rowRight - rowLeft, out + (std::size_t)(y - y0)*outWidth + (rowLeft - x0));
+			}
+		}
+		TIFFClose(handle);
+	};
+	threads = std::max<unsigned int>(1, std::min<uint32_t>(threads, blockCount));
+	runWorkers(threads, worker);
+	return !failed;
+}
+
+#endif
@@ -0,0 +1,249 @@
+// File name: 	Trace.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Scoped spans for a timeline of where a run spends its time. A TraceSpan
+// 		records its kind (open, decode, compute, encode, write, ...), a name,
+// 		the thread, and the bytes and voxels it handled, from construction to
+// 		destruction. Spans are compiled in only with -DITKSCRIPTS_TRACE (cmake
+// 		-DITKSCRIPTS_TRACE=ON), otherwise TraceSpan is empty and the calls vanish.
+// 		Compiled in, a run records when ITKSCRIPTS_TRACE_FILE names the output
+// 		("%p" becomes the process id); at exit the spans are written there as
+// 		Chrome trace JSON (chrome://tracing, ui.perfetto.dev) and one summary
+// 		line goes to stderr.
+
+#ifndef ITKSCRIPTS_TRACE_H
+#define ITKSCRIPTS_TRACE_H
+
+#include <string>
+
+#ifdef ITKSCRIPTS_TRACE
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+struct TraceEvent {
+	const char * kind;
+	std::string name, detail;
+	uint64_t start, duration;	// nanoseconds of the steady clock, the same in every process
+	long thread;
+	double bytes, voxels;
+};
+
+// every span of the process, kept per thread until the process exits
+class TraceLog {
+public:
+	static TraceLog & instance (){
+		static TraceLog log;
+		return log;
+	}
+
+	bool enabled () const { return !m_Path.empty(); }
+
+	static uint64_t now (){
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	void record (TraceEvent &event){
+		Buffer &buffer = threadBuffer();
+		event.thread = buffer.thread;
+		std::lock_guard<std::mutex> lock(buffer.mutex);	// only contended while write() runs
+		buffer.events.push_back(std::move(event));
+	}
+
+	// all spans so far to the trace file, and the summary to stderr
+	void write (){
+		std::vector<TraceEvent> events;
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			for (auto &buffer : m_Buffers){
+				std::lock_guard<std::mutex> bufferLock(buffer->mutex);
+				events.insert(events.end(), buffer->events.begin(), buffer->events.end());
+			}
+		}
+		if (events.empty()){ return; }
+		std::sort(events.begin(), events.end(), [](const TraceEvent &a, const TraceEvent &b){
+			return a.start < b.start || (a.start == b.start && a.duration > b.duration);
+		});
+
+		const long pid = getpid();
+		std::ofstream out(m_Path.c_str());
+		out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+		out << "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": " << pid << ", \"tid\": " << pid
+			<< ", \"args\": {\"name\": " << quote(processName()) << "}}";
+		char times[64];
+		for (const TraceEvent &event : events){
+			std::snprintf(times, sizeof(times), "\"ts\": %.3f, \"dur\": %.3f", 1e-3*event.start, 1e-3*event.duration);
+			out << ",\n{\"name\": " << quote(event.name) << ", \"cat\": " << quote(event.kind) << ", \"ph\": \"X\", " << times
+				<< ", \"pid\": " << pid << ", \"tid\": " << event.thread << ", \"args\": {";
+			const char * separator = "";
+			if (event.bytes > 0){ out << "\"bytes\": " << (uint64_t)event.bytes; separator = ", "; }
+			if (event.voxels > 0){ out << separator << "\"voxels\": " << (uint64_t)event.voxels; separator = ", "; }
+			if (!event.detail.empty()){ out << separator << "\"detail\": " << quote(event.detail); }
+			out << "}}";
+		}
+		out << "\n]}\n";
+		out.close();
+		std::cerr << summary(events) << (out ? " -> " : " (could not write ") << m_Path << (out ? "" : ")") << std::endl;
+	}
+
+	~TraceLog (){
+		if (enabled()){ write(); }
+	}
+
+private:
+	struct Buffer {
+		long thread;
+		std::mutex mutex;
+		std::vector<TraceEvent> events;
+	};
+
+	TraceLog (){
+		const char * path = std::getenv("ITKSCRIPTS_TRACE_FILE");
+		m_Path = path ? path : "";
+		const std::size_t pid = m_Path.find("%p");
+		if (pid != std::string::npos){ m_Path.replace(pid, 2, std::to_string((long long)getpid())); }
+	}
+
+	// buffers outlive their threads, the worker threads are gone long before exit
+	Buffer & threadBuffer (){
+		thread_local Buffer * mine = nullptr;
+		if (!mine){
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_Buffers.push_back(std::unique_ptr<Buffer>(new Buffer()));
+			mine = m_Buffers.back().get();
+			mine->thread = syscall(SYS_gettid);
+		}
+		return *mine;
+	}
+
+	static std::string processName (){
+		std::ifstream comm("/proc/self/comm");
+		std::string name;
+		std::getline(comm, name);
+		return name;
+	}
+
+	static std::string quote (const std::string &text){
+		std::string quoted = "\"";
+		for (char c : text){
+			if (c == '"' || c == '\\'){ quoted += '\\'; quoted += c; }
+			else if ((unsigned char)c < 0x20){ quoted += ' '; }
+			else { quoted += c; }
+		}
+		return quoted + "\"";
+	}
+
+	// wall time per kind, time covered by several spans (other threads, nesting)
+	// counted once. Bytes are summed, so only one level of a kind should set them.
+	static std::string summary (const std::vector<TraceEvent> &events){
+		struct Kind {
+			std::string name;
+			uint64_t wall, end;
+			double bytes;
+		};
+		std::vector<Kind> kinds;
+		std::vector<long> threads;
+		uint64_t first = events.front().start, last = 0;
+		for (const TraceEvent &event : events){	// sorted by start
+			const uint64_t end = event.start + event.duration;
+			last = std::max(last, end);
+			if (std::find(threads.begin(), threads.end(), event.thread) == threads.end()){ threads.push_back(event.thread); }
+			auto kind = std::find_if(kinds.begin(), kinds.end(), [&](const Kind &k){ return k.name == event.kind; });
+			if (kind == kinds.end()){
+				Kind added = { event.kind, 0, 0, 0.0 };
+				kinds.push_back(added);
+				kind = kinds.end() - 1;
+			}
+			kind->bytes += event.bytes;
+			if (end <= kind->end){ continue; }
+			kind->wall += end - std::max(event.start, kind->end);
+			kind->end = end;
+		}
+
+		char part[96];
+		std::snprintf(part, sizeof(part), "trace: %zu spans on %zu threads over %.0f ms",
+			events.size(), threads.size(), 1e-6*(last - first));
+		std::string line = part;
+		for (const Kind &kind : kinds){
+			std::snprintf(part, sizeof(part), ", %s %.0f ms", kind.name.c_str(), 1e-6*kind.wall);
+			line += part;
+			if (kind.bytes > 0 && kind.wall > 0){
+				std::snprintf(part, sizeof(part), " (%.0f MB/s)", 1e3*kind.bytes/kind.wall);
+				line += part;
+			}
+		}
+		return line;
+	}
+
+	std::string m_Path;
+	std::mutex m_Mutex;
+	std::vector< std::unique_ptr<Buffer> > m_Buffers;
+};
+
+inline bool traceEnabled (){ return TraceLog::instance().enabled(); }
+
+// one span, from construction to destruction
+class TraceSpan {
+public:
+	TraceSpan (const char * kind, const char * name) : m_Active(traceEnabled()) {
+		if (m_Active){ begin(kind, name); }
+	}
+	TraceSpan (const char * kind, const std::string &name) : m_Active(traceEnabled()) {
+		if (m_Active){ begin(kind, name); }
+	}
+	~TraceSpan (){
+		if (!m_Active){ return; }
+		m_Event.duration = TraceLog::now() - m_Event.start;
+		TraceLog::instance().record(m_Event);
+	}
+	TraceSpan (const TraceSpan &) = delete;
+	TraceSpan & operator= (const TraceSpan &) = delete;
+
+	void setBytes (double bytes){ m_Event.bytes = bytes; }
+	void setVoxels (double voxels){ m_Event.voxels = voxels; }
+	void setDetail (const std::string &detail){ if (m_Active){ m_Event.detail = detail; } }
+
+private:
+	void begin (const char * kind, const std::string &name){
+		m_Event.kind = kind;
+		m_Event.name = name;
+		m_Event.bytes = m_Event.voxels = 0.0;
+		m_Event.start = TraceLog::now();
+	}
+
+	bool m_Active;
+	TraceEvent m_Event;
+};
+
+#else
+
+// tracing compiled out: nothing is recorded, guard costly details with traceEnabled()
+inline constexpr bool traceEnabled (){ return false; }
+
+class TraceSpan {
+public:
+	template< typename TName >
+	TraceSpan (const char *, const TName &) {}
+	TraceSpan (const TraceSpan &) = delete;
+	TraceSpan & operator= (const TraceSpan &) = delete;
+
+	void setBytes (double){}
+	void setVoxels (double){}
+	template< typename TDetail >
+	void setDetail (const TDetail &){}
+};
+
+#endif
+
+#endif
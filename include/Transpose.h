@@ -0,0 +1,111 @@
+// File name: 	Transpose.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Permuted copies of a volume. Only x is contiguous in an itk::Image, so
+// 		a slice along x touches one voxel per cache line. A slice-major copy
+// 		(in-slice axes first, the slicing direction last) makes every slice one
+// 		contiguous plane, after which work along x or y runs like work along z.
+// 		The copy is done in small cubic tiles so reads and writes both stay in
+// 		cache, tiles are spread over threads.
+
+#ifndef ITKSCRIPTS_TRANSPOSE_H
+#define ITKSCRIPTS_TRANSPOSE_H
+
+#include "itkImage.h"
+
+#include "WorkerThreads.h"
+
+#include <cstdint>
+
+#include <vector>
+#include <atomic>
+#include <algorithm>
+
+constexpr uint64_t transposeTile = 16;	// 16^3 floats = 16 KB, fits in L1
+
+// axis order that makes slices along direction contiguous: the two in-slice
+// axes in increasing order (like sliceAxes), then direction
+inline void sliceMajorOrder (int direction, int order[3]){
+	order[0] = (direction == 0) ? 1 : 0;
+	order[1] = (direction == 2) ? 1 : 2;
+	order[2] = direction;
+}
+
+// the order that undoes order
+inline void inverseOrder (const int order[3], int inverse[3]){
+	for (int k = 0; k < 3; ++k){ inverse[order[k]] = k; }
+}
+
+// out axis k is in axis order[k]: out(a, b, c) = in(i) with i[order[0]] = a, i[order[1]] = b, i[order[2]] = c
+template< typename TPixel >
+void transposeBuffer (const TPixel * in, const uint64_t size[3], const int order[3], TPixel * out,
+		unsigned int threads = workerThreads()){
+	const uint64_t inStride[3] = { 1, size[0], size[0]*size[1] };
+	const uint64_t outSize[3] = { size[order[0]], size[order[1]], size[order[2]] };
+	const uint64_t step[3] = { inStride[order[0]], inStride[order[1]], inStride[order[2]] };
+	const uint64_t tiles[3] = { (outSize[0] + transposeTile - 1)/transposeTile,
+		(outSize[1] + transposeTile - 1)/transposeTile, (outSize[2] + transposeTile - 1)/transposeTile };
+	const uint64_t tileCount = tiles[0]*tiles[1]*tiles[2];
+
+	std::atomic<uint64_t> next(0);
+	auto worker = [&](){
+		for (uint64_t t = next++; t < tileCount; t = next++){
+			const uint64_t a0 = (t % tiles[0])*transposeTile;
+			const uint64_t b0 = ((t / tiles[0]) % tiles[1])*transposeTile;
+			const uint64_t c0 = (t / (tiles[0]*tiles[1]))*transposeTile;
+			const uint64_t a1 = std::min(a0 + transposeTile, outSize[0]);
+			const uint64_t b1 = std::min(b0 + transposeTile, outSize[1]);
+			const uint64_t c1 = std::min(c0 + transposeTile, outSize[2]);
+			for (uint64_t c = c0; c < c1; ++c){
+				for (uint64_t b = b0; b < b1; ++b){
+					const TPixel * source = in + b*step[1] + c*step[2];
+					TPixel * target = out + (c*outSize[1] + b)*outSize[0];
+					for (uint64_t a = a0; a < a1; ++a){ target[a] = source[a*step[0]]; }
+				}
+			}
+		}
+	};
+	threads = std::max<unsigned int>(1, std::min<uint64_t>(threads, tileCount));
+	runWorkers(threads, worker);
+}
+
+// a permuted copy that is the same object in physical space: spacing and the
+// direction columns move with their axes, the origin stays
+template< typename TImage >
+typename TImage::Pointer transposeImage (const TImage * image, const int order[3]){
+	static_assert(TImage::ImageDimension == 3, "transposeImage works on volumes");
+	const typename TImage::RegionType region = image->GetBufferedRegion();
+	uint64_t size[3];
+	typename TImage::RegionType outRegion;
+	typename TImage::SpacingType spacing;
+	typename TImage::DirectionType direction;
+	typename TImage::PointType origin;
+	image->TransformIndexToPhysicalPoint( region.GetIndex(), origin );
+	for (int d = 0; d < 3; ++d){
+		size[d] = region.GetSize(d);
+		outRegion.SetIndex(d, 0);
+		outRegion.SetSize(d, region.GetSize(order[d]));
+		spacing[d] = image->GetSpacing()[order[d]];
+		for (int e = 0; e < 3; ++e){ direction[e][d] = image->GetDirection()[e][order[d]]; }
+	}
+
+	typename TImage::Pointer output = TImage::New();
+	output->SetRegions( outRegion );
+	output->SetSpacing( spacing );
+	output->SetDirection( direction );
+	output->SetOrigin( origin );
+	output->Allocate();
+	transposeBuffer(image->GetBufferPointer(), size, order, output->GetBufferPointer());
+	return output;
+}
+
+// the volume with slices along direction contiguous
+template< typename TImage >
+typename TImage::Pointer sliceMajorImage (const TImage * image, int direction){
+	int order[3];
+	sliceMajorOrder(direction, order);
+	return transposeImage(image, order);
+}
+
+#endif
@@ -0,0 +1,127 @@
+// File name: 	VolumeCache.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Decoded volumes kept in memory, least recently used goes first once
+// 		the byte capacity is exceeded. An entry is reloaded when its file changes.
+// 		Slice-major copies (Transpose.h) are cached next to the volume, so slices
+// 		along x and y are contiguous after the first request in that direction.
+
+#ifndef ITKSCRIPTS_VOLUMECACHE_H
+#define ITKSCRIPTS_VOLUMECACHE_H
+
+#include "Pipeline.h"
+#include "Transpose.h"
+#include "GzipIndex.h"
+
+#include <sys/stat.h>
+
+#include <string>
+#include <list>
+#include <iterator>
+#include <unordered_map>
+#include <mutex>
+
+class VolumeCache {
+public:
+	explicit VolumeCache (std::size_t capacityBytes) : m_Capacity(capacityBytes), m_Bytes(0), m_Hits(0), m_Misses(0) {}
+
+	// decoded volume for path, read on a miss. Throws like readImage.
+	// With layout 0 or 1 the slice-major copy for that direction (sliceMajorImage),
+	// made from the cached volume on a miss; 2 is the volume itself.
+	PipelineImageType::Pointer get (const std::string &path, int layout = 2){
+		struct stat info;
+		if (stat(path.c_str(), &info) != 0){
+			itkGenericExceptionMacro(<< "cannot stat " << path);
+		}
+
+		const std::string key = (layout == 2) ? path : path + "#" + std::to_string(layout);
+		std::unique_lock<std::mutex> lock(m_Mutex);
+		auto found = m_Index.find(key);
+		if (found != m_Index.end()){
+			if (found->second->modified == modifiedNanoseconds(info) && found->second->fileSize == info.st_size){
+				m_Entries.splice(m_Entries.begin(), m_Entries, found->second);
+				++m_Hits;
+				return found->second->image;
+			}
+			erase(found->second);
+		}
+		++m_Misses;
+		lock.unlock();
+
+		// decode or transpose without holding the lock, other volumes stay servable
+		PipelineImageType::Pointer image = (layout == 2) ? readImage< PipelineImageType >( path )
+			: sliceMajorImage(get(path).GetPointer(), layout);
+		insert(key, info, image);
+		return image;
+	}
+
+	// the server's connections ask while others load
+	std::size_t bytes () const {
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		return m_Bytes;
+	}
+	std::size_t size () const {
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		return m_Entries.size();
+	}
+	std::size_t hits () const {
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		return m_Hits;
+	}
+	std::size_t misses () const {
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		return m_Misses;
+	}
+
+private:
+	struct Entry {
+		std::string key;
+		int64_t modified;	// ns, a same-second rewrite is a change too
+		off_t fileSize;
+		std::size_t bytes;
+		PipelineImageType::Pointer image;
+	};
+	using EntryList = std::list<Entry>;
+
+	static std::size_t imageBytes (const PipelineImageType * image){
+		return image->GetBufferedRegion().GetNumberOfPixels()*sizeof(PipelinePixelType);
+	}
+
+	void insert (const std::string &key, const struct stat &info, PipelineImageType::Pointer image){
+		std::lock_guard<std::mutex> lock(m_Mutex);
+		auto found = m_Index.find(key);
+		if (found != m_Index.end()){ erase(found->second); }
+
+		Entry entry;
+		entry.key = key;
+		entry.modified = modifiedNanoseconds(info);
+		entry.fileSize = info.st_size;
+		entry.bytes = imageBytes(image);
+		entry.image = image;
+		m_Entries.push_front(entry);
+		m_Index[key] = m_Entries.begin();
+		m_Bytes += entry.bytes;
+
+		// evict from the back, but never the entry we just added
+		while (m_Bytes > m_Capacity && m_Entries.size() > 1){
+			erase(std::prev(m_Entries.end()));
+		}
+	}
+
+	void erase (EntryList::iterator entry){
+		m_Bytes -= entry->bytes;
+		m_Index.erase(entry->key);
+		m_Entries.erase(entry);
+	}
+
+	std::size_t m_Capacity;
+	std::size_t m_Bytes;
+	std::size_t m_Hits;
+	std::size_t m_Misses;
+	EntryList m_Entries;
+	std::unordered_map<std::string, EntryList::iterator> m_Index;
+	mutable std::mutex m_Mutex;
+};
+
+#endif
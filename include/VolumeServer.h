@@ -0,0 +1,340 @@
+// File name: 	VolumeServer.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: Long running server that keeps decoded volumes in a VolumeCache and
+// 		answers slice / projection / window statistics requests over a Unix socket.
+//
+// 		Protocol (native byte order, the socket is local):
+// 		  request:  RequestHeader, then pathLength bytes of volume path
+// 		  response: ResponseHeader, then payloadBytes of float voxels (x fastest),
+// 		            or of error message when status != 0
+// 		A connection may send any number of requests. Connections are served
+// 		side by side, one thread each.
+
+#ifndef ITKSCRIPTS_VOLUMESERVER_H
+#define ITKSCRIPTS_VOLUMESERVER_H
+
+#include "Pipeline.h"
+#include "VolumeCache.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+
+#include <string>
+#include <vector>
+#include <set>
+#include <iostream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+constexpr uint32_t volumeServerMagic = 0x534b5449;	// "ITKS"
+
+enum VolumeServerOp : uint32_t {
+	opSlice = 1,		// args: direction, slice
+	opProjection = 2,	// args: direction
+	opStatistics = 3,	// args: direction, slice, x, y, step
+	opStatus = 4,		// no path, values = { volumes, bytes, hits, misses }
+	opShutdown = 5		// no path
+};
+
+struct RequestHeader {
+	uint32_t magic;
+	uint32_t op;
+	int32_t args[6];
+	uint32_t pathLength;
+};
+
+struct ResponseHeader {
+	uint32_t magic;
+	int32_t status;			// 0 ok
+	uint32_t size[3];		// voxels in the payload image
+	double spacing[3];
+	double origin[3];
+	double direction[9];
+	double values[4];		// statistics: sum, mean, min, max
+	uint64_t payloadBytes;
+};
+
+/********** SOCKET HELPERS **********/
+
+inline bool sendAll (int socket, const void * data, std::size_t bytes){
+	const char * pointer = static_cast<const char *>(data);
+	while (bytes > 0){
+		ssize_t sent = send(socket, pointer, bytes, MSG_NOSIGNAL);
+		if (sent < 0 && errno == EINTR){ continue; }
+		if (sent <= 0){ return false; }
+		pointer += sent;
+		bytes -= sent;
+	}
+	return true;
+}
+
+inline bool receiveAll (int socket, void * data, std::size_t bytes){
+	char * pointer = static_cast<char *>(data);
+	while (bytes > 0){
+		ssize_t received = recv(socket, pointer, bytes, 0);
+		if (received < 0 && errno == EINTR){ continue; }
+		if (received <= 0){ return false; }
+		pointer += received;
+		bytes -= received;
+	}
+	return true;
+}
+
+inline sockaddr_un socketAddress (const std::string &path){
+	sockaddr_un address;
+	std::memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(address.sun_path)){
+		itkGenericExceptionMacro(<< "socket path too long: " << path);
+	}
+	std::strncpy(address.sun_path, path.c_str(), sizeof(address.sun_path) - 1);
+	return address;
+}
+
+/********** SERVER **********/
+
+inline ResponseHeader emptyResponse (){
+	ResponseHeader response;
+	std::memset(&response, 0, sizeof(response));
+	response.magic = volumeServerMagic;
+	return response;
+}
+
+inline void describeImage (const PipelineImageType * image, ResponseHeader &response){
+	const PipelineImageType::SizeType size = image->GetBufferedRegion().GetSize();
+	for (int d = 0; d < 3; ++d){
+		response.size[d] = size[d];
+		response.spacing[d] = image->GetSpacing()[d];
+		response.origin[d] = image->GetOrigin()[d];
+		for (int e = 0; e < 3; ++e){ response.direction[3*d + e] = image->GetDirection()[d][e]; }
+	}
+	response.payloadBytes = (uint64_t)size[0]*size[1]*size[2]*sizeof(PipelinePixelType);
+}
+
+// answer one request, returns the image to send back (null when there is no payload)
+inline PipelineImageType::Pointer handleRequest (VolumeCache &cache, const RequestHeader &request,
+		const std::string &path, ResponseHeader &response){
+	if (request.op == opStatus){
+		response.values[0] = cache.size();
+		response.values[1] = cache.bytes();
+		response.values[2] = cache.hits();
+		response.values[3] = cache.misses();
+		return PipelineImageType::Pointer();
+	}
+
+	PipelineState state;
+	state.image = cache.get(path);
+	const std::string direction = std::to_string(request.args[0]);
+	if (request.op == opSlice && (request.args[0] == 0 || request.args[0] == 1)){
+		// from the cached slice-major copy, where the slice is one contiguous plane
+		const int axis = request.args[0];
+		const int k = request.args[1];
+		const PipelineImageType::RegionType region = state.image->GetBufferedRegion();
+		if (k < 0 || k >= (int)region.GetSize()[axis]){
+			itkGenericExceptionMacro(<< "slice " << k << " out of range");
+		}
+		const PipelineImageType::Pointer layout = cache.get(path, axis);
+		PipelineImageType::RegionType slice = region;
+		PipelineImageType::SizeType sliceSize = region.GetSize();
+		PipelineImageType::IndexType sliceStart = region.GetIndex();
+		sliceSize[axis] = 1;
+		sliceStart[axis] += k;
+		slice.SetSize( sliceSize );
+		slice.SetIndex( sliceStart );
+		state.image = allocateLike(state.image, slice);
+		const std::size_t plane = slice.GetNumberOfPixels();
+		std::memcpy(state.image->GetBufferPointer(), layout->GetBufferPointer() + k*plane, plane*sizeof(PipelinePixelType));
+	} else if (request.op == opSlice){
+		extractStage(state, { direction, std::to_string(request.args[1]) });
+	} else if (request.op == opProjection){
+		projectStage(state, { direction });
+	} else if (request.op == opStatistics){
+		const int axis = stageDirection(direction);
+		if (request.args[1] < 0 || request.args[1] >= (int)state.image->GetBufferedRegion().GetSize()[axis]){
+			itkGenericExceptionMacro(<< "slice " << request.args[1] << " out of range");
+		}
+		const RegionStatistics stats = sliceRoiStatistics(state.image, axis, request.args[1],
+				request.args[2], request.args[3], request.args[4]);
+		response.values[0] = stats.sum;
+		response.values[1] = stats.sum/stats.count;
+		response.values[2] = stats.min;
+		response.values[3] = stats.max;
+		return PipelineImageType::Pointer();
+	} else {
+		itkGenericExceptionMacro(<< "unknown request " << request.op);
+	}
+	describeImage(state.image, response);
+	return state.image;
+}
+
+// The requests of one connection, until it closes, sends something that is not a
+// request or asks for shutdown (then running goes false and the listener is shut
+// down, which wakes accept). A failed request, out of memory included, is answered
+// with status 1 and the connection stays up.
+inline void serveConnection (VolumeCache &cache, int connection, int listener, std::atomic<bool> &running){
+	RequestHeader request;
+	while (running && receiveAll(connection, &request, sizeof(request))){
+		auto begin = std::chrono::high_resolution_clock::now();
+		ResponseHeader response = emptyResponse();
+		if (request.magic != volumeServerMagic || request.pathLength > 4096){
+			break;
+		}
+		std::string path(request.pathLength, '\0');
+		if (request.pathLength > 0 && !receiveAll(connection, &path[0], request.pathLength)){
+			break;
+		}
+		if (request.op == opShutdown){
+			running = false;
+			sendAll(connection, &response, sizeof(response));
+			shutdown(listener, SHUT_RDWR);
+			break;
+		}
+
+		PipelineImageType::Pointer result;
+		std::string error;
+		try {
+			result = handleRequest(cache, request, path, response);
+		} catch ( itk::ExceptionObject & err ){
+			error = err.GetDescription();
+		} catch ( std::exception & err ){
+			error = err.what();
+		}
+		if (!error.empty()){
+			response = emptyResponse();
+			response.status = 1;
+			response.payloadBytes = error.size();
+			sendAll(connection, &response, sizeof(response));
+			sendAll(connection, error.data(), error.size());
+			continue;
+		}
+
+		bool sent = sendAll(connection, &response, sizeof(response));
+		if (sent && result.IsNotNull()){
+			sent = sendAll(connection, result->GetBufferPointer(), response.payloadBytes);
+		}
+		auto stop = std::chrono::high_resolution_clock::now();
+		auto duration = std::chrono::duration_cast<std::chrono::microseconds>(stop - begin);
+		// one write per line, connections log side by side
+		std::cout << (std::to_string((long long)duration.count()) + " microseconds for request "
+			+ std::to_string((unsigned long long)request.op) + " " + path + "\n") << std::flush;
+		if (!sent){ break; }
+	}
+}
+
+// Serve until a shutdown request, every connection on a thread of its own, so a viewer
+// that keeps its socket open does not hold up the other clients. They share the cache.
+inline void runVolumeServer (const std::string &socketPath, std::size_t capacityBytes){
+	VolumeCache cache(capacityBytes);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0){ itkGenericExceptionMacro(<< "cannot create socket"); }
+	sockaddr_un address = socketAddress(socketPath);
+	unlink(socketPath.c_str());
+	if (bind(listener, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0 || listen(listener, 16) != 0){
+		close(listener);
+		itkGenericExceptionMacro(<< "cannot listen on " << socketPath << ": " << std::strerror(errno));
+	}
+	std::cout << "serving on " << socketPath << " with " << (capacityBytes >> 20) << " MB of cache" << std::endl;
+
+	std::atomic<bool> running(true);
+	std::mutex mutex;
+	std::condition_variable finished;
+	std::set<int> open;	// connections being served, guarded by mutex
+	while (running){
+		int connection = accept(listener, nullptr, nullptr);
+		if (connection < 0){
+			if (errno == EINTR || errno == ECONNABORTED){ continue; }
+			break;
+		}
+		std::lock_guard<std::mutex> lock(mutex);
+		open.insert(connection);
+		std::thread([&cache, &running, &mutex, &finished, &open, connection, listener](){
+			serveConnection(cache, connection, listener, running);
+			std::lock_guard<std::mutex> lock(mutex);
+			close(connection);
+			open.erase(connection);
+			finished.notify_all();
+		}).detach();
+	}
+
+	// wake the connections still waiting for a request, and wait for all of them
+	running = false;
+	std::unique_lock<std::mutex> lock(mutex);
+	for (int connection : open){ shutdown(connection, SHUT_RDWR); }
+	finished.wait(lock, [&open](){ return open.empty(); });
+	lock.unlock();
+	close(listener);
+	unlink(socketPath.c_str());
+}
+
+/********** CLIENT **********/
+
+inline int connectVolumeServer (const std::string &socketPath){
+	int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+	sockaddr_un address = socketAddress(socketPath);
+	if (connection < 0 || connect(connection, reinterpret_cast<sockaddr *>(&address), sizeof(address)) != 0){
+		if (connection >= 0){ close(connection); }
+		itkGenericExceptionMacro(<< "cannot connect to " << socketPath);
+	}
+	return connection;
+}
+
+// send one request and wait for the answer, image is filled when the answer has voxels
+inline ResponseHeader queryVolumeServer (int connection, uint32_t op, const std::vector<int> &args,
+		const std::string &path, PipelineImageType::Pointer &image){
+	RequestHeader request;
+	std::memset(&request, 0, sizeof(request));
+	request.magic = volumeServerMagic;
+	request.op = op;
+	for (std::size_t i = 0; i < args.size() && i < 6; ++i){ request.args[i] = args[i]; }
+	request.pathLength = path.size();
+
+	ResponseHeader response;
+	if (!sendAll(connection, &request, sizeof(request)) || !sendAll(connection, path.data(), path.size())
+			|| !receiveAll(connection, &response, sizeof(response)) || response.magic != volumeServerMagic){
+		itkGenericExceptionMacro(<< "lost connection to the server");
+	}
+	if (response.status != 0){
+		std::string error(response.payloadBytes, '\0');
+		receiveAll(connection, &error[0], error.size());
+		itkGenericExceptionMacro(<< "server: " << error);
+	}
+	if (response.payloadBytes == 0){ return response; }
+
+	PipelineImageType::RegionType region;
+	PipelineImageType::SizeType size;
+	PipelineImageType::IndexType start;
+	PipelineImageType::SpacingType spacing;
+	PipelineImageType::PointType origin;
+	PipelineImageType::DirectionType direction;
+	for (int d = 0; d < 3; ++d){
+		size[d] = response.size[d];
+		start[d] = 0;
+		spacing[d] = response.spacing[d];
+		origin[d] = response.origin[d];
+		for (int e = 0; e < 3; ++e){ direction[d][e] = response.direction[3*d + e]; }
+	}
+	region.SetSize( size );
+	region.SetIndex( start );
+	image = PipelineImageType::New();
+	image->SetRegions( region );
+	image->SetSpacing( spacing );
+	image->SetOrigin( origin );
+	image->SetDirection( direction );
+	image->Allocate();
+	if (!receiveAll(connection, image->GetBufferPointer(), response.payloadBytes)){
+		itkGenericExceptionMacro(<< "lost connection to the server");
+	}
+	return response;
+}
+
+#endif
@@ -0,0 +1,155 @@
+// File name: 	WorkStealingPool.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: A pool of workers for whole jobs (a volume through a script) under a
+// 		memory budget. Jobs are dealt out to the workers' deques in the order
+// 		given, a worker takes from the front of its own deque and, once that is
+// 		empty, steals from the back of another's, so a worker stuck with a long
+// 		job does not hold up the short ones behind it. A job starts only when its
+// 		memory fits in what the running jobs leave of the budget; a job larger
+// 		than the whole budget runs alone.
+
+#ifndef ITKSCRIPTS_WORKSTEALINGPOOL_H
+#define ITKSCRIPTS_WORKSTEALINGPOOL_H
+
+#include "itkImage.h"
+
+#include "WorkerThreads.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <algorithm>
+
+class WorkStealingPool {
+public:
+	struct Job {
+		std::function<void ()> run;
+		std::size_t bytes;	// memory the job holds while it runs
+	};
+
+	// workers jobs side by side, each with threadsPerJob threads for itself
+	WorkStealingPool (unsigned int workers, unsigned int threadsPerJob, std::size_t memoryBudget)
+		: m_Workers(std::max(1u, workers)), m_ThreadsPerJob(std::max(1u, threadsPerJob)),
+		m_Budget(memoryBudget), m_Reserved(0), m_Running(0) {}
+
+	// jobs are started in about the order they are added, add the longest first
+	void add (const Job &job){
+		m_Jobs.push_back(job);
+	}
+
+	// run every job, returns the error of every job that threw, by job number
+	std::vector< std::pair<std::size_t, std::string> > run (){
+		m_Queues.clear();
+		for (unsigned int w = 0; w < m_Workers; ++w){ m_Queues.push_back(std::unique_ptr<Queue>(new Queue)); }
+		for (std::size_t j = 0; j < m_Jobs.size(); ++j){ m_Queues[j % m_Workers]->jobs.push_back(j); }
+		m_Left = m_Jobs.size();
+		m_Errors.clear();
+
+		auto worker = [this](unsigned int w){
+			workerThreadBudget() = m_ThreadsPerJob;
+			std::size_t j;
+			while (take(w, j)){
+				try {
+					m_Jobs[j].run();
+				} catch ( itk::ExceptionObject & err ){
+					failed(j, err.GetDescription());
+				} catch ( std::exception & err ){
+					failed(j, err.what());
+				}
+				release(m_Jobs[j].bytes);
+			}
+		};
+		const unsigned int workers = std::max<unsigned int>(1, std::min<std::size_t>(m_Workers, m_Jobs.size()));
+		std::vector<std::thread> threads;
+		for (unsigned int w = 1; w < workers; ++w){ threads.push_back(std::thread(worker, w)); }
+		const unsigned int budget = workerThreadBudget();
+		worker(0);
+		workerThreadBudget() = budget;
+		for (auto &t : threads){ t.join(); }
+		std::sort(m_Errors.begin(), m_Errors.end());
+		return m_Errors;
+	}
+
+private:
+	struct Queue {
+		std::deque<std::size_t> jobs;
+		std::mutex mutex;
+	};
+
+	// reserve bytes of the budget, always granted when nothing else runs
+	bool reserve (std::size_t bytes){
+		std::lock_guard<std::mutex> lock(m_BudgetMutex);
+		if (m_Running > 0 && m_Reserved + bytes > m_Budget){ return false; }
+		m_Reserved += bytes;
+		++m_Running;
+		return true;
+	}
+
+	void release (std::size_t bytes){
+		{
+			std::lock_guard<std::mutex> lock(m_BudgetMutex);
+			m_Reserved -= bytes;
+			--m_Running;
+		}
+		m_Released.notify_all();
+	}
+
+	// the first job of queue that fits the budget, from the front for its owner
+	// and from the back for a thief
+	bool pop (Queue &queue, bool owner, std::size_t &j){
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		for (std::size_t i = 0; i < queue.jobs.size(); ++i){
+			const std::size_t at = owner ? i : queue.jobs.size() - 1 - i;
+			if (reserve(m_Jobs[queue.jobs[at]].bytes)){
+				j = queue.jobs[at];
+				queue.jobs.erase(queue.jobs.begin() + at);
+				--m_Left;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// the next job for worker w, false once every job has been taken
+	bool take (unsigned int w, std::size_t &j){
+		while (m_Left > 0){
+			if (pop(*m_Queues[w], true, j)){ return true; }
+			for (unsigned int v = 1; v < m_Workers; ++v){
+				if (pop(*m_Queues[(w + v) % m_Workers], false, j)){ return true; }
+			}
+			// everything left waits for memory, or was taken meanwhile
+			std::unique_lock<std::mutex> lock(m_BudgetMutex);
+			m_Released.wait_for(lock, std::chrono::milliseconds(50));
+		}
+		return false;
+	}
+
+	void failed (std::size_t j, const std::string &error){
+		std::lock_guard<std::mutex> lock(m_ErrorMutex);
+		m_Errors.push_back(std::make_pair(j, error));
+	}
+
+	unsigned int m_Workers;
+	unsigned int m_ThreadsPerJob;
+	std::size_t m_Budget;
+	std::size_t m_Reserved;
+	unsigned int m_Running;
+	std::vector<Job> m_Jobs;
+	std::vector< std::unique_ptr<Queue> > m_Queues;
+	std::atomic<std::size_t> m_Left;
+	std::mutex m_BudgetMutex;
+	std::condition_variable m_Released;
+	std::vector< std::pair<std::size_t, std::string> > m_Errors;
+	std::mutex m_ErrorMutex;
+};
+
+#endif
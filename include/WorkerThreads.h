@@ -0,0 +1,235 @@
+// File name: 	WorkerThreads.h
+// Author: 	Viet Than
+// Email: 	viet.than@vanderbilt.edu (thanhoangviet@gmail.com)
+// Lab: 	Medical Imaging Lab under Ipek Oguz at Vanderbilt University, TN, USA
+// Description: How many threads a parallel helper (gzip, transpose, slice decoding, ...)
+// 		may use, and the threads it runs on. On its own a script uses every core,
+// 		or --threads=<n> (ITKSCRIPTS_THREADS) of them, ITK's filters included; a
+// 		job of the batch driver gets its share of the machine, so that jobs
+// 		running side by side do not each start a thread per core. Helpers run
+// 		their workers on one pool for the whole process: the caller works too,
+// 		pool threads join in as they come free and steal from each other's
+// 		queues, so a helper inside another helper (slices of files, rows of
+// 		slices) adds work to the pool instead of threads to the machine.
+// 		Pool threads count their hardware counters for whoever they work for.
+
+#ifndef ITKSCRIPTS_WORKERTHREADS_H
+#define ITKSCRIPTS_WORKERTHREADS_H
+
+#include "itkMultiThreader.h"
+
+#include "PerfCounters.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <exception>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+
+// threads of the whole process, from --threads or ITKSCRIPTS_THREADS, every core otherwise
+inline unsigned int &processThreads (){
+	static unsigned int threads = std::getenv("ITKSCRIPTS_THREADS") && std::atoi(std::getenv("ITKSCRIPTS_THREADS")) > 0
+		? (unsigned int)std::atoi(std::getenv("ITKSCRIPTS_THREADS")) : std::max(1u, std::thread::hardware_concurrency());
+	return threads;
+}
+
+// threads of the job running on this thread, 0 when it has no budget of its own
+inline unsigned int &workerThreadBudget (){
+	static thread_local unsigned int budget = 0;
+	return budget;
+}
+
+inline unsigned int workerThreads (){
+	const unsigned int budget = workerThreadBudget();
+	return budget > 0 ? budget : processThreads();
+}
+
+// Take --threads=<n> out of the arguments, wherever it is, like --mem-budget. With it
+// or ITKSCRIPTS_THREADS, ITK's filters get the same number of threads. False (after
+// saying why) for a bad value.
+inline bool takeThreads (int &argc, char * argv []){
+	const char * flag = "--threads=";
+	int kept = 1;
+	bool ok = true;
+	bool given = std::getenv("ITKSCRIPTS_THREADS") != nullptr;
+	for (int i = 1; i < argc; ++i){
+		if (std::strncmp(argv[i], flag, std::strlen(flag)) != 0){
+			argv[kept++] = argv[i];
+			continue;
+		}
+		const int threads = std::atoi(argv[i] + std::strlen(flag));
+		if (threads < 1){
+			std::cout << "--threads takes a number of threads, got " << argv[i] + std::strlen(flag) << std::endl;
+			ok = false;
+			continue;
+		}
+		processThreads() = threads;
+		given = true;
+	}
+	argc = kept;
+	argv[argc] = nullptr;
+	if (given){
+		itk::MultiThreader::SetGlobalMaximumNumberOfThreads( processThreads() );
+		itk::MultiThreader::SetGlobalDefaultNumberOfThreads( processThreads() );
+	}
+	return ok;
+}
+
+// processThreads() - 1 threads that help whoever calls runWorkers
+class WorkerPool {
+public:
+	static WorkerPool & instance (){
+		static WorkerPool pool(processThreads() > 1 ? processThreads() - 1 : 1);
+		return pool;
+	}
+
+	// worker on the calling thread and on up to helpers pool threads, back once every
+	// copy that started has returned. Workers share their work through an atomic
+	// counter, so a copy that starts late finds nothing left and a copy that has
+	// not started when the caller is done never starts. The first exception is
+	// thrown again here.
+	void run (unsigned int helpers, const std::function<void ()> &worker){
+		std::shared_ptr<Group> group = std::make_shared<Group>();
+		group->worker = &worker;
+		group->budget = workerThreadBudget();
+		group->sink = perfSink();
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			for (unsigned int h = 0; h < helpers; ++h){
+				// a pool thread queues at its own front, where it takes from
+				if (poolIndex() >= 0){ m_Queues[poolIndex()].push_front(group); }
+				else { m_Queues[m_Next++ % m_Queues.size()].push_back(group); }
+			}
+			m_Pending += helpers;
+		}
+		if (helpers == 1){ m_Wake.notify_one(); } else { m_Wake.notify_all(); }
+
+		try {
+			worker();
+		} catch ( ... ){
+			std::lock_guard<std::mutex> lock(group->mutex);
+			if (!group->error){ group->error = std::current_exception(); }
+		}
+		std::unique_lock<std::mutex> lock(group->mutex);
+		group->closed = true;
+		group->done.wait(lock, [&](){ return group->running == 0; });
+		if (group->error){ std::rethrow_exception(group->error); }
+	}
+
+	~WorkerPool (){
+		{
+			std::lock_guard<std::mutex> lock(m_Mutex);
+			m_Stop = true;
+		}
+		m_Wake.notify_all();
+		for (auto &thread : m_Threads){ thread.join(); }
+	}
+
+private:
+	struct Group {
+		Group () : worker(nullptr), budget(0), sink(nullptr), closed(false), running(0) {}
+		const std::function<void ()> * worker;	// the caller's, only touched while it waits
+		unsigned int budget;
+		PerfSink * sink;	// the caller's counters, null when nothing counts it
+		bool closed;
+		unsigned int running;
+		std::exception_ptr error;
+		std::mutex mutex;
+		std::condition_variable done;
+	};
+	typedef std::deque< std::shared_ptr<Group> > Queue;
+
+	explicit WorkerPool (unsigned int threads) : m_Queues(threads), m_Next(0), m_Pending(0), m_Stop(false) {
+		for (unsigned int t = 0; t < threads; ++t){ m_Threads.push_back(std::thread(&WorkerPool::loop, this, (int)t)); }
+	}
+
+	void loop (int index){
+		poolIndex() = index;
+		for (;;){
+			std::shared_ptr<Group> group;
+			{
+				std::unique_lock<std::mutex> lock(m_Mutex);
+				m_Wake.wait(lock, [this](){ return m_Stop || m_Pending > 0; });
+				if (m_Stop){ return; }
+				group = take(index);
+				--m_Pending;
+			}
+			help(*group);
+		}
+	}
+
+	// own front first, then the back of the others' (caller holds m_Mutex, m_Pending > 0)
+	std::shared_ptr<Group> take (int index){
+		std::shared_ptr<Group> group;
+		if (!m_Queues[index].empty()){
+			group = m_Queues[index].front();
+			m_Queues[index].pop_front();
+			return group;
+		}
+		for (std::size_t step = 1; step < m_Queues.size(); ++step){
+			Queue &victim = m_Queues[(index + step) % m_Queues.size()];
+			if (victim.empty()){ continue; }
+			group = victim.back();
+			victim.pop_back();
+			return group;
+		}
+		return group;
+	}
+
+	static void help (Group &group){
+		{
+			std::lock_guard<std::mutex> lock(group.mutex);
+			if (group.closed){ return; }
+			++group.running;
+		}
+		const unsigned int budget = workerThreadBudget();
+		workerThreadBudget() = group.budget;
+		std::exception_ptr error;
+		{
+			PerfSinkScope counted(group.sink);
+			try {
+				(*group.worker)();
+			} catch ( ... ){
+				error = std::current_exception();
+			}
+		}
+		workerThreadBudget() = budget;
+		std::lock_guard<std::mutex> lock(group.mutex);
+		if (error && !group.error){ group.error = error; }
+		if (--group.running == 0){ group.done.notify_all(); }
+	}
+
+	// queue of the pool thread, -1 elsewhere
+	static int & poolIndex (){
+		static thread_local int index = -1;
+		return index;
+	}
+
+	std::vector<Queue> m_Queues;
+	std::vector<std::thread> m_Threads;
+	std::size_t m_Next, m_Pending;
+	bool m_Stop;
+	std::mutex m_Mutex;
+	std::condition_variable m_Wake;
+};
+
+// worker on the calling thread and threads - 1 pool threads, like starting threads - 1
+// std::threads running worker and joining them
+inline void runWorkers (unsigned int threads, const std::function<void ()> &worker){
+	if (threads <= 1 || processThreads() <= 1){
+		worker();
+		return;
+	}
+	WorkerPool::instance().run(threads - 1, worker);
+}
+
+#endif